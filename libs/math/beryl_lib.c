@@ -116,8 +116,8 @@ static struct i_val lib_val;
 #define LENOF(a) (sizeof(a)/sizeof(a[0]))
 
 static void init_lib() {
-	#define FN(name, arity, fn) { arity, true, name, sizeof(name) - 1, fn }
-	#define MANUAL_RELEASE_FN(arity, name, fn) { arity, false, name, sizeof(name) - 1, fn }
+	#define FN(name, arity, fn) { arity, true, name, sizeof(name) - 1, fn, false }
+	#define MANUAL_RELEASE_FN(arity, name, fn) { arity, false, name, sizeof(name) - 1, fn, false }
 	static struct beryl_external_fn fns[] = {
 		FN("pow", 2, pow_callback),
 		FN("sqrt", 1, sqrt_callback),
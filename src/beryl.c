@@ -1,5 +1,7 @@
 #include "beryl.h"
 #include "lexer.h"
+#include "mem.h"
+#include "num.h"
 
 #include "utils.h"
 
@@ -13,14 +15,21 @@ typedef struct beryl_table beryl_table;
 typedef struct beryl_object beryl_object;
 typedef struct beryl_object_class beryl_object_class;
 
+// Strings and arrays can also be views into (a part of) another string or array, in which case parent is non-NULL and the view has no contents
+// of its own. Views keep their parent alive, and always point directly to a string/array that is not itself a view.
 typedef struct i_managed_str {
 	i_refc ref_c;
+	i_size cap; // Unused for views
+	i_size offset;
+	struct i_managed_str *parent;
 	char str[];
 } i_managed_str;
 
 typedef struct i_managed_array {
 	i_refc ref_c;
-	i_size cap;
+	i_size cap; // For views, this is instead the length of the parent array
+	i_size offset;
+	struct i_managed_array *parent;
 	i_val items[];
 } i_managed_array;
 
@@ -207,14 +216,7 @@ static void log_err(i_val err_val) {
 bool cmp_len_strs(const char *a, size_t alen, const char *b, size_t blen) {
 	if(alen != blen)
 		return false;
-	
-	while(alen--) {
-		if(*a != *b)
-			return false;
-		a++, b++;
-	}
-	
-	return true;
+	return mem_equal(a, b, alen);
 }
 
 void (*free_callback)(void *ptr) = NULL;
@@ -227,6 +229,29 @@ void beryl_set_mem(void *(*alloc)(size_t), void (*free)(void *), void *(*realloc
 	realloc_callback = realloc;
 }
 
+static void (*run_parallel_callback)(void (*task)(void *, size_t), void *data, size_t n_tasks) = NULL;
+static unsigned n_threads = 1;
+
+void beryl_set_threads(void (*run_parallel)(void (*task)(void *, size_t), void *data, size_t n_tasks), unsigned threads) {
+	run_parallel_callback = run_parallel;
+	n_threads = threads == 0 ? 1 : threads;
+}
+
+unsigned beryl_get_threads() {
+	if(run_parallel_callback == NULL)
+		return 1;
+	return n_threads;
+}
+
+void beryl_run_parallel(void (*task)(void *, size_t), void *data, size_t n_tasks) {
+	if(run_parallel_callback == NULL || n_threads == 1 || n_tasks < 2) {
+		for(size_t i = 0; i < n_tasks; i++)
+			task(data, i);
+		return;
+	}
+	run_parallel_callback(task, data, n_tasks);
+}
+
 void beryl_free(void *ptr) {
 	if(free_callback == NULL)
 		return;
@@ -257,11 +282,7 @@ void *beryl_realloc(void *ptr, size_t n) {
 		if(new_alloc == NULL)
 			return NULL;
 			
-		unsigned char *p = ptr;
-		size_t cpy_len = MIN(TMP_ALLOC_BUFFER_SIZE, n);
-		unsigned char *t = new_alloc;
-		while(cpy_len--)
-			*(t++) = *(p++);
+		mem_copy(new_alloc, ptr, MIN(TMP_ALLOC_BUFFER_SIZE, n));
 		tmp_buffer_free = true;
 		return new_alloc;
 	}
@@ -341,9 +362,12 @@ void beryl_release(i_val val) {
 		switch(val.type) {
 			
 			case TYPE_ERR:
-			case TYPE_STR:
+			case TYPE_STR: {
+				i_managed_str *parent = val.val.managed_str->parent;
 				beryl_free(val.val.managed_str);
-				break;
+				if(parent != NULL)
+					beryl_release((i_val) { .type = TYPE_STR, .managed = true, .len = BERYL_INLINE_STR_MAX_LEN + 1, .val.managed_str = parent });
+			} break;
 			case TYPE_TABLE: {
 				i_val_pair *iter = NULL;
 				while( (iter = beryl_iter_table(val, iter)) ) {
@@ -353,10 +377,16 @@ void beryl_release(i_val val) {
 				beryl_free(val.val.table);
 			} break;
 			case TYPE_ARRAY: {
-				const i_val *items = beryl_get_raw_array(val);
+				i_managed_array *array = val.val.managed_array;
+				if(array->parent != NULL) {
+					i_val parent = { .type = TYPE_ARRAY, .managed = true, .len = array->cap, .val.managed_array = array->parent };
+					beryl_free(array);
+					beryl_release(parent);
+					break;
+				}
 				for(i_size i = 0; i < BERYL_LENOF(val); i++)
-					beryl_release(items[i]);
-				beryl_free(val.val.managed_array);
+					beryl_release(array->items[i]);
+				beryl_free(array);
 			} break;
 			
 			case TYPE_OBJECT: {
@@ -377,10 +407,24 @@ void beryl_release_values(const i_val *items, size_t n) {
 		beryl_release(*(items++));
 }
 
+static bool is_view(i_val val) {
+	switch(BERYL_TYPEOF(val)) {
+		case TYPE_ERR:
+		case TYPE_STR:
+			return val.managed && val.len > BERYL_INLINE_STR_MAX_LEN && val.val.managed_str->parent != NULL;
+		case TYPE_ARRAY:
+			return val.managed && val.val.managed_array->parent != NULL;
+		default:
+			return false;
+	}
+}
+
 i_refc beryl_get_refcount(i_val val) {
 	i_refc *counter = get_reference_counter(val);
 	if(counter == NULL)
 		return I_REFC_MAX;
+	if(is_view(val) && *counter < I_REFC_MAX) // Views share their contents with the parent, so they can never be modified in place
+		return *counter + 1;
 	return *counter;
 }
 
@@ -392,7 +436,10 @@ const char *beryl_get_raw_str(const i_val *str) {
 	if(str->len <= BERYL_INLINE_STR_MAX_LEN)
 		return &str->val.inline_str[0];
 	
-	return &str->val.managed_str->str[0];
+	const i_managed_str *mstr = str->val.managed_str;
+	if(mstr->parent != NULL)
+		return &mstr->parent->str[mstr->offset];
+	return &mstr->str[0];
 }
 
 i_float beryl_as_num(struct i_val val) {
@@ -438,7 +485,7 @@ static stack_entry *stack_end = static_stack + STATIC_STACK_SIZE;
 
 static struct scope_namespace current_namespace = { NULL, NULL };
 
-#define GLOBALS_LOOKUP_TABLE_SIZE 256
+#define GLOBALS_LOOKUP_TABLE_SIZE 512 // The libraries define around 160 globals, so this leaves room for scripts (and keeps the probe sequences short)
 static stack_entry globals_lookup[GLOBALS_LOOKUP_TABLE_SIZE];
 //static stack_entry *globals_lookup_end = globals_lookup + GLOBALS_LOOKUP_TABLE_SIZE;
 
@@ -640,12 +687,11 @@ int beryl_val_cmp(i_val a, i_val b) { // -1 if a is larger, 0 if they are equal,
 			i_size l_a = BERYL_LENOF(a), l_b = BERYL_LENOF(b);
 			
 			i_size minl = MIN(l_a, l_b);
-			for(i_size i = 0; i < minl; i++) {
-				if(s_a[i] != s_b[i]) {
-					if(s_a[i] > s_b[i])
-						return -1;
-					return 1;
-				}
+			i_size i = mem_mismatch(s_a, s_b, minl);
+			if(i != minl) {
+				if(s_a[i] > s_b[i])
+					return -1;
+				return 1;
 			}
 			
 			if(l_a == l_b)
@@ -692,16 +738,15 @@ i_val beryl_new_string(i_size len, const char *from) {
 			return BERYL_NULL;
 			
 		mstr->ref_c = 1;
+		mstr->cap = len;
+		mstr->parent = NULL;
 		str = &mstr->str[0];
 		
 		res.val.managed_str = mstr;
 	}
 	
-	if(from != NULL) {
-		while(len--) {
-			*(str++) = *(from++);
-		}
-	}
+	if(from != NULL)
+		mem_copy(str, from, len);
 	
 	return res;
 }
@@ -768,6 +813,8 @@ static size_t hash_val(i_val key) {
 			return beryl_as_num(key);
 		case TYPE_BOOL:
 			return beryl_as_bool(key);
+		case TYPE_TAG:
+			return beryl_as_tag(key);
 			
 		case TYPE_STR: {
 			size_t hash = 0;
@@ -787,40 +834,150 @@ static size_t hash_val(i_val key) {
 	}
 }
 
-static i_val_pair *search_table(beryl_table *table, i_val key, i_size from, i_size until) {
-	assert(until <= table->cap);
+static bool keys_equal(i_val a, i_val b) {
+	assert(is_hashable(a) && is_hashable(b));
+	if(BERYL_TYPEOF(a) != BERYL_TYPEOF(b))
+		return false;
 	
-	for(i_size i = from; i < until; i++) {
-		if(BERYL_TYPEOF(table->entries[i].key) == TYPE_NULL)
-			return &table->entries[i];
-		if(beryl_val_cmp(table->entries[i].key, key) == 0)
-			return &table->entries[i];
+	switch(BERYL_TYPEOF(a)) {
+		case TYPE_STR: {
+			if(BERYL_LENOF(a) != BERYL_LENOF(b))
+				return false;
+			const char *s_a = beryl_get_raw_str(&a);
+			const char *s_b = beryl_get_raw_str(&b);
+			if(s_a == s_b) // Keys written in the source code, like :x, usually point to the same string constant
+				return true;
+			return cmp_len_strs(s_a, BERYL_LENOF(a), s_b, BERYL_LENOF(b));
+		}
+		
+		case TYPE_NUMBER:
+			return beryl_as_num(a) == beryl_as_num(b);
+		case TYPE_BOOL:
+			return beryl_as_bool(a) == beryl_as_bool(b);
+		case TYPE_TAG:
+			return beryl_as_tag(a) == beryl_as_tag(b);
+		
+		default:
+			assert(false);
+			return false;
+	}
+}
+
+#define SMALL_TABLE_MAX 8 //Tables that can hold at most this many entries have no index, and are searched linearly instead
+
+static i_size get_table_slot(beryl_table *table, i_size i) {
+	assert(i < table->n_slots);
+	const void *index = table->entries + table->cap;
+	switch(table->slot_size) {
+		case 1:
+			return ((const unsigned char *) index)[i];
+		case 2:
+			return ((const unsigned short *) index)[i];
+		default:
+			return ((const unsigned *) index)[i];
 	}
+}
+
+static void set_table_slot(beryl_table *table, i_size i, i_size entry) {
+	assert(i < table->n_slots);
+	void *index = table->entries + table->cap;
+	switch(table->slot_size) {
+		case 1:
+			((unsigned char *) index)[i] = entry;
+			break;
+		case 2:
+			((unsigned short *) index)[i] = entry;
+			break;
+		default:
+			((unsigned *) index)[i] = entry;
+	}
+}
+
+static i_size find_table_slot(beryl_table *table, i_val key) { // Returns the slot that either refers to key, or the empty slot where it should be inserted
+	assert(table->n_slots > table->cap); //Guarantees that there is always at least one empty slot (and that the table has an index at all)
 	
+	i_size i = hash_val(key) % table->n_slots;
+	while(true) {
+		i_size entry = get_table_slot(table, i);
+		if(entry == 0 || keys_equal(table->entries[entry - 1].key, key))
+			return i;
+		i++;
+		if(i == table->n_slots)
+			i = 0;
+	}
+}
+
+static i_val_pair *search_small_table(beryl_table *table, i_size len, i_val key) {
+	assert(table->n_slots == 0);
+	for(i_size i = 0; i < len; i++) {
+		if(keys_equal(table->entries[i].key, key))
+			return &table->entries[i];
+	}
 	return NULL;
 }
 
-static i_val_pair *table_get(beryl_table *table, i_val key) {
+static bool get_array_part_index(beryl_table *table, i_val key, i_size *index) {
+	if(BERYL_TYPEOF(key) != TYPE_NUMBER || !beryl_is_integer(key))
+		return false;
+	i_float n = beryl_as_num(key);
+	if(n < 0 || n >= table->n_array)
+		return false;
+	*index = (i_size) n;
+	return true;
+}
+
+static i_val_pair *table_get(beryl_table *table, i_size len, i_val key) {
 	if(!is_hashable(key))
 		return NULL;
-	if(table->cap == 0)
-		return NULL;
 	
-	size_t hash = hash_val(key);
-	i_size index = hash % table->cap;
+	i_size array_i;
+	if(get_array_part_index(table, key, &array_i))
+		return &table->entries[array_i];
+	
+	if(table->n_slots == 0)
+		return search_small_table(table, len, key);
+	
+	i_size entry = get_table_slot(table, find_table_slot(table, key));
+	if(entry == 0)
+		return NULL;
+	return &table->entries[entry - 1];
+}
+
+// Tables built by the same code (i.e struct :x ... :y ...) store their keys in the same order, so an expression like (point :x) tends to find
+// its key at the same position every time. Each call site remembers where its key was last found, and checks that position before doing a full lookup.
+#define CALL_SITE_CACHE_SIZE 128
+
+static struct {
+	const char *site;
+	i_size entry;
+} call_site_cache[CALL_SITE_CACHE_SIZE];
+
+static const char *next_call_site = NULL; // Set by the evaluator right before calling a table
+
+static i_val_pair *table_get_cached(beryl_table *table, i_size len, i_val key, const char *site) {
+	if(site == NULL || !is_hashable(key))
+		return table_get(table, len, key);
 	
-	i_val_pair *entry = search_table(table, key, index, table->cap);
-	if(entry != NULL)
-		return entry;
+	size_t cache_i = ((size_t) site) % CALL_SITE_CACHE_SIZE;
+	if(call_site_cache[cache_i].site == site) {
+		i_size entry = call_site_cache[cache_i].entry;
+		if(entry < len && keys_equal(table->entries[entry].key, key))
+			return &table->entries[entry];
+	}
 	
-	return search_table(table, key, 0, index);
+	i_val_pair *pair = table_get(table, len, key);
+	if(pair != NULL) {
+		call_site_cache[cache_i].site = site;
+		call_site_cache[cache_i].entry = pair - table->entries;
+	}
+	return pair;
 }
 
-static i_val index_table(i_val table, i_val key) {
+static i_val index_table(i_val table, i_val key, const char *site) {
 	assert(BERYL_TYPEOF(table) == TYPE_TABLE);
 	
-	i_val_pair *entry = table_get(table.val.table, key);
-	if(entry == NULL || BERYL_TYPEOF(entry->key) == TYPE_NULL)
+	i_val_pair *entry = table_get_cached(table.val.table, BERYL_LENOF(table), key, site);
+	if(entry == NULL)
 		return BERYL_NULL;
 	
 	return beryl_retain(entry->val);
@@ -835,64 +992,102 @@ int beryl_table_insert(i_val *table_v, i_val key, i_val val, bool replace) {
 	if(!is_hashable(key))
 		return 3;
 	
+	i_size slot = 0;
+	i_size array_i;
+	i_val_pair *pair;
+	bool extends_array_part = false;
+	if(get_array_part_index(table, key, &array_i))
+		pair = &table->entries[array_i];
+	else if(table->n_array == table_v->len && BERYL_TYPEOF(key) == TYPE_NUMBER && beryl_as_num(key) == table->n_array) {
+		pair = NULL; // Keys in the array part are never also stored in the index, so if key is the next integer, it cannot already exist
+		extends_array_part = true;
+	} else if(table->n_slots == 0)
+		pair = search_small_table(table, table_v->len, key);
+	else {
+		slot = find_table_slot(table, key);
+		i_size entry = get_table_slot(table, slot);
+		pair = entry == 0 ? NULL : &table->entries[entry - 1];
+	}
+	
+	if(pair != NULL) {
+		if(!replace)
+			return 2; //Key already exists and replace is false
+		
+		beryl_release(pair->val);
+		pair->val = beryl_retain(val);
+		return 0;
+	}
+	
 	if(table_v->len == table->cap)
 		return 1;
 	assert(table->cap > table_v->len);
+	
+	table->entries[table_v->len] = (i_val_pair) { beryl_retain(key), beryl_retain(val) };
+	table_v->len++;
+	if(extends_array_part)
+		table->n_array++;
+	else if(table->n_slots != 0)
+		set_table_slot(table, slot, table_v->len);
+	
+	return 0;	
+}
 
-	i_val_pair *entry = table_get(table, key);
-	assert(entry != NULL);
-	if(BERYL_TYPEOF(entry->key) != TYPE_NULL) {
-		if(!replace)
-			return 2; //Key already exists and replace is false
-		
-		beryl_release(entry->val);
-		beryl_release(entry->key);
-	} else
-		table_v->len++;
+static unsigned char table_slot_size(i_size cap) {
+	if(cap < 0xFF)
+		return 1;
+	if(cap < 0xFFFF)
+		return 2;
+	return 4;
+}
 
-	entry->key = beryl_retain(key);
-	entry->val = beryl_retain(val);
+static void init_table(beryl_table *table, i_size cap, i_size n_slots) {
+	table->cap = cap;
+	table->n_slots = n_slots;
+	table->n_array = 0;
+	table->ref_c = 1;
+	table->slot_size = table_slot_size(cap);
 	
-	return 0;	
+	unsigned char *index = (unsigned char *) (table->entries + cap);
+	for(size_t i = 0; i < (size_t) n_slots * table->slot_size; i++)
+		index[i] = 0;
+}
+
+static size_t table_n_slots(i_size cap, bool padding) {
+	if(cap <= SMALL_TABLE_MAX)
+		return 0;
+	return padding ? ((size_t) cap * 3) / 2 + 1 : (size_t) cap + 1; // The index must always have at least one more slot than there are entries
 }
 
 i_val beryl_new_table(i_size cap, bool padding) {
-	if(padding) {
-		i_size padded_size = (cap * 3) / 2;
-		if(padded_size < cap)
-			return BERYL_NULL;
-		cap = padded_size;
-	}
-	
-	beryl_table *table = beryl_alloc(sizeof(beryl_table) + sizeof(i_val_pair) * cap);
-	if(table == NULL)
+	size_t n_slots = table_n_slots(cap, padding);
+	if(n_slots > I_SIZE_MAX)
 		return BERYL_NULL;
 	
-	table->cap = cap;
-	table->ref_c = 1;
+	size_t index_size = n_slots * table_slot_size(cap);
+	size_t entries_size = sizeof(i_val_pair) * (size_t) cap;
+	if(entries_size / sizeof(i_val_pair) != cap)
+		return BERYL_NULL;
 	
-	for(i_size i = 0; i < cap; i++)
-		table->entries[i] = (i_val_pair) { BERYL_NULL, BERYL_NULL };
+	beryl_table *table = beryl_alloc(sizeof(beryl_table) + entries_size + index_size);
+	if(table == NULL)
+		return BERYL_NULL;
 	
+	init_table(table, cap, n_slots);
 	return (i_val) { .type = TYPE_TABLE, .val.table = table, .managed = true, .len = 0 };
 }
 
 i_val beryl_static_table(i_size cap, unsigned char *bytes, size_t bytes_size) {
-	assert(sizeof(beryl_table) + sizeof(i_val_pair) * cap <= bytes_size); (void) bytes_size;
-	
 	beryl_table *table = (beryl_table *) bytes;
-	table->cap = cap;
-	table->ref_c = 1;
-	for(i_size i = 0; i < cap; i++) {
-		table->entries[i] = (i_val_pair) { BERYL_NULL, BERYL_NULL };
-	}
+	i_size n_slots = table_n_slots(cap, true);
+	assert(sizeof(beryl_table) + sizeof(i_val_pair) * cap + n_slots * table_slot_size(cap) <= bytes_size); (void) bytes_size;
 	
+	init_table(table, cap, n_slots);
 	return (i_val) { .type = TYPE_TABLE, .managed = false, .val.table = table, .len = 0 };
 }
 
 bool beryl_table_should_grow(struct i_val table, i_size extra) {
 	assert(BERYL_TYPEOF(table) == TYPE_TABLE);
-	i_size expected_capacity = (table.len + extra) * 4 / 3;
+	i_size expected_capacity = table.len + extra;
 	return table.val.table->cap < expected_capacity || expected_capacity < table.len;
 }
 
@@ -907,6 +1102,7 @@ i_val beryl_new_array(i_size len, const i_val *items, i_size fit_for, bool padde
 		return BERYL_NULL;
 	array->cap = cap;
 	array->ref_c = 1;
+	array->parent = NULL;
 	
 	if(items != NULL) {
 		for(i_size i = 0; i < len; i++) {
@@ -921,7 +1117,7 @@ i_val beryl_new_array(i_size len, const i_val *items, i_size fit_for, bool padde
 
 i_size beryl_get_array_capacity(i_val val) {
 	assert(BERYL_TYPEOF(val) == TYPE_ARRAY);
-	if(val.managed)
+	if(val.managed && val.val.managed_array->parent == NULL)
 		return val.val.managed_array->cap;
 	else
 		return BERYL_LENOF(val);
@@ -929,11 +1125,39 @@ i_size beryl_get_array_capacity(i_val val) {
 
 const i_val *beryl_get_raw_array(i_val array) {
 	assert(BERYL_TYPEOF(array) == TYPE_ARRAY);
-	if(array.managed)
-		return &array.val.managed_array->items[0];
+	if(array.managed) {
+		const i_managed_array *ma = array.val.managed_array;
+		if(ma->parent != NULL)
+			return &ma->parent->items[ma->offset];
+		return &ma->items[0];
+	}
 	return array.val.static_array;
 }
 
+static i_managed_array *resize_managed_array(i_managed_array *array, i_size cap) { // array may be NULL, in which case a new array is allocated
+	size_t size = sizeof(i_val) * (size_t) cap;
+	if(size / sizeof(i_val) != cap)
+		return NULL;
+	
+	size += sizeof(i_managed_array);
+	i_managed_array *new_array = array == NULL ? beryl_alloc(size) : beryl_realloc(array, size);
+	if(new_array == NULL)
+		return NULL;
+	if(array == NULL) {
+		new_array->ref_c = 1;
+		new_array->parent = NULL;
+	}
+	new_array->cap = cap;
+	return new_array;
+}
+
+static i_size grown_array_cap(i_size cap, i_size min_cap) { // Returns 0 if there is no capacity large enough
+	i_size new_cap = cap * 3 / 2 + 1;
+	if(new_cap <= cap)
+		return min_cap > cap ? min_cap : 0;
+	return new_cap < min_cap ? min_cap : new_cap;
+}
+
 bool beryl_array_push(i_val *array, i_val val) {
 	assert(BERYL_TYPEOF(*array) == TYPE_ARRAY);
 	assert(beryl_get_refcount(*array) == 1);
@@ -941,22 +1165,14 @@ bool beryl_array_push(i_val *array, i_val val) {
 	
 	i_managed_array *ma = array->val.managed_array;
 	if(ma->cap == array->len) {
-		i_size new_cap = ma->cap * 3 / 2 + 1;
-		if(new_cap <= ma->cap)
+		i_size new_cap = grown_array_cap(ma->cap, ma->cap + 1);
+		if(new_cap == 0)
 			return false;
 		
-		i_managed_array *new_array = beryl_alloc(sizeof(i_managed_array) + sizeof(i_val) * new_cap);
-		if(new_array == NULL)
+		ma = resize_managed_array(ma, new_cap);
+		if(ma == NULL)
 			return false;
-		new_array->ref_c = 1;
-		
-		for(i_size i = 0; i < array->len; i++)
-			new_array->items[i] = ma->items[i];
-		new_array->cap = new_cap;
-		
-		array->val.managed_array = new_array;
-		beryl_free(ma);
-		ma = new_array;
+		array->val.managed_array = ma;
 	}
 	
 	assert(ma->cap > array->len);
@@ -964,24 +1180,480 @@ bool beryl_array_push(i_val *array, i_val val) {
 	return true;
 }
 
+bool beryl_string_append(i_val *str, const char *from, i_size len) {
+	assert(BERYL_TYPEOF(*str) == TYPE_STR);
+	assert(beryl_get_refcount(*str) == 1);
+	assert(str->managed && BERYL_LENOF(*str) > BERYL_INLINE_STR_MAX_LEN);
+	
+	i_managed_str *mstr = str->val.managed_str;
+	i_size new_len = str->len + len;
+	if(new_len < str->len)
+		return false;
+	
+	if(new_len > mstr->cap) {
+		i_size new_cap = mstr->cap + mstr->cap / 2;
+		if(new_cap < new_len)
+			new_cap = new_len;
+		mstr = beryl_realloc(mstr, sizeof(i_managed_str) + sizeof(char) * new_cap);
+		if(mstr == NULL)
+			return false;
+		mstr->cap = new_cap;
+		str->val.managed_str = mstr;
+	}
+	
+	mem_copy(mstr->str + str->len, from, len);
+	str->len = new_len;
+	return true;
+}
+
+bool beryl_array_builder_init(struct beryl_array_builder *builder, i_size reserve) {
+	builder->array = NULL;
+	builder->len = 0;
+	return reserve == 0 || beryl_array_builder_reserve(builder, reserve);
+}
+
+bool beryl_array_builder_reserve(struct beryl_array_builder *builder, i_size extra) {
+	i_size min_cap = builder->len + extra;
+	if(min_cap < builder->len)
+		return false;
+	
+	i_size cap = builder->array == NULL ? 0 : builder->array->cap;
+	if(cap >= min_cap)
+		return true;
+	
+	i_managed_array *array = resize_managed_array(builder->array, min_cap);
+	if(array == NULL)
+		return false;
+	builder->array = array;
+	return true;
+}
+
+bool beryl_array_builder_push(struct beryl_array_builder *builder, i_val val) {
+	i_size cap = builder->array == NULL ? 0 : builder->array->cap;
+	if(builder->len == cap) {
+		i_size new_cap = grown_array_cap(cap, cap < 4 ? 4 : cap + 1);
+		i_managed_array *array = new_cap == 0 ? NULL : resize_managed_array(builder->array, new_cap);
+		if(array == NULL) {
+			beryl_release(val);
+			return false;
+		}
+		builder->array = array;
+	}
+	
+	builder->array->items[builder->len++] = val;
+	return true;
+}
+
+i_val beryl_array_builder_finish(struct beryl_array_builder *builder) {
+	i_managed_array *array = builder->array;
+	if(array == NULL) {
+		array = resize_managed_array(NULL, 0);
+		if(array == NULL)
+			return BERYL_NULL;
+	} else if(array->cap != builder->len) {
+		i_managed_array *shrunk = resize_managed_array(array, builder->len);
+		if(shrunk != NULL) // If shrinking fails the array is simply left with some extra capacity
+			array = shrunk;
+	}
+	
+	i_val res = { .type = TYPE_ARRAY, .len = builder->len, .managed = true, .val.managed_array = array };
+	builder->array = NULL;
+	builder->len = 0;
+	return res;
+}
+
+void beryl_array_builder_discard(struct beryl_array_builder *builder) {
+	if(builder->array != NULL) {
+		beryl_release_values(builder->array->items, builder->len);
+		beryl_free(builder->array);
+	}
+	builder->array = NULL;
+	builder->len = 0;
+}
+
+// Slices that are at least this large, and at least a quarter of the size of the string/array they are taken from, become views instead of copies.
+// Smaller views would pin a much larger parent in memory.
+#define MIN_STR_VIEW_LEN 64
+#define MIN_ARRAY_VIEW_LEN 16
+
+static bool should_make_view(i_size len, i_size parent_len, i_size min_len) {
+	return len >= min_len && len >= parent_len / 4;
+}
+
+i_val beryl_substring(i_val str, i_size from, i_size to) {
+	assert(BERYL_TYPEOF(str) == TYPE_STR);
+	assert(from <= to && to <= BERYL_LENOF(str));
+	
+	i_size len = to - from;
+	bool shares_managed_str = str.managed && BERYL_LENOF(str) > BERYL_INLINE_STR_MAX_LEN;
+	if(len <= BERYL_INLINE_STR_MAX_LEN || !shares_managed_str || !should_make_view(len, BERYL_LENOF(str), MIN_STR_VIEW_LEN))
+		return beryl_new_string(len, beryl_get_raw_str(&str) + from);
+	
+	i_managed_str *parent = str.val.managed_str;
+	if(parent->parent != NULL) {
+		from += parent->offset;
+		parent = parent->parent;
+	}
+	
+	i_managed_str *view = beryl_alloc(sizeof(i_managed_str));
+	if(view == NULL)
+		return BERYL_NULL;
+	view->ref_c = 1;
+	view->cap = 0;
+	view->offset = from;
+	view->parent = parent;
+	if(parent->ref_c != I_REFC_MAX)
+		parent->ref_c++;
+	
+	return (i_val) { .type = TYPE_STR, .managed = true, .len = len, .val.managed_str = view };
+}
+
+i_val beryl_array_slice(i_val array, i_size from, i_size to) {
+	assert(BERYL_TYPEOF(array) == TYPE_ARRAY);
+	assert(from <= to && to <= BERYL_LENOF(array));
+	
+	i_size len = to - from;
+	if(!array.managed || !should_make_view(len, BERYL_LENOF(array), MIN_ARRAY_VIEW_LEN))
+		return beryl_new_array(len, beryl_get_raw_array(array) + from, len, false);
+	
+	i_managed_array *parent = array.val.managed_array;
+	i_size parent_len = BERYL_LENOF(array);
+	if(parent->parent != NULL) {
+		from += parent->offset;
+		parent_len = parent->cap;
+		parent = parent->parent;
+	}
+	
+	i_managed_array *view = beryl_alloc(sizeof(i_managed_array));
+	if(view == NULL)
+		return BERYL_NULL;
+	view->ref_c = 1;
+	view->cap = parent_len;
+	view->offset = from;
+	view->parent = parent;
+	if(parent->ref_c != I_REFC_MAX)
+		parent->ref_c++;
+	
+	return (i_val) { .type = TYPE_ARRAY, .managed = true, .len = len, .val.managed_array = view };
+}
+
 i_val_pair *beryl_iter_table(i_val table_v, i_val_pair *iter) {
 	assert(BERYL_TYPEOF(table_v) == TYPE_TABLE);
 	
 	beryl_table *table = table_v.val.table;
-	i_val_pair *table_end = table->entries + table->cap;
+	i_val_pair *table_end = table->entries + table_v.len;
 	
 	assert((iter >= table->entries && iter < table_end) || iter == NULL);
-	if(table_v.len == 0)
-		return NULL;
 	
-	if(iter == NULL)
-		iter = table->entries - 1;
+	i_val_pair *next = (iter == NULL) ? table->entries : iter + 1;
+	if(next < table_end)
+		return next;
+	return NULL;
+}
+
+// Formatting works in two passes over the format string: the first only measures how long the result will be, and the second writes it
+// into a string allocated with exactly that length. Both passes run the same code, with out->str set to null while measuring.
+#define FORMAT_MAX_PRECISION NUM_FIXED_PRECISION_MAX
+
+struct format_out {
+	char *str;
+	size_t len;
+};
+
+static void format_write(struct format_out *out, const char *from, size_t len) {
+	if(out->str != NULL)
+		mem_copy(out->str + out->len, from, len);
+	out->len += len;
+}
+
+static void format_fill(struct format_out *out, char c, size_t n) {
+	if(out->str != NULL)
+		mem_fill(out->str + out->len, c, n);
+	out->len += n;
+}
+
+struct format_spec {
+	char fill, align; // align is '<', '>', '^', or 0 for the default (right for numbers and left for everything else)
+	bool plus, zero;
+	size_t width;
+	int precision; // -1 if not given
+	char type; // 0 if not given
+};
+
+static bool is_format_align(char c) {
+	return c == '<' || c == '>' || c == '^';
+}
+
+static bool parse_format_spec(const char *c, const char *end, struct format_spec *spec) {
+	*spec = (struct format_spec) { .fill = ' ', .align = 0, .plus = false, .zero = false, .width = 0, .precision = -1, .type = 0 };
 	
-	for(i_val_pair *i = iter + 1; i < table_end; i++) {
-		if(BERYL_TYPEOF(i->key) != TYPE_NULL)
-			return i;
+	if(end - c >= 2 && is_format_align(c[1])) {
+		spec->fill = c[0];
+		spec->align = c[1];
+		c += 2;
+	} else if(c != end && is_format_align(*c))
+		spec->align = *(c++);
+	
+	if(c != end && *c == '+') {
+		spec->plus = true;
+		c++;
 	}
-	return NULL;
+	if(c != end && *c == '0') {
+		spec->zero = true;
+		c++;
+	}
+	for(; c != end && *c >= '0' && *c <= '9'; c++) {
+		spec->width = spec->width * 10 + (*c - '0');
+		if(spec->width > I_SIZE_MAX)
+			return false;
+	}
+	
+	if(c != end && *c == '.') {
+		c++;
+		if(c == end || *c < '0' || *c > '9')
+			return false;
+		spec->precision = 0;
+		for(; c != end && *c >= '0' && *c <= '9'; c++) {
+			spec->precision = spec->precision * 10 + (*c - '0');
+			if(spec->precision > FORMAT_MAX_PRECISION)
+				return false;
+		}
+	}
+	
+	if(c != end) {
+		switch(*c) {
+			case 's': case 'd': case 'f': case 'x': case 'X': case 'o': case 'b':
+				spec->type = *(c++);
+				break;
+		}
+	}
+	return c == end;
+}
+
+// Writes the digits of n in the given base to the end of buff, and returns where they start
+static char *format_uint(char *buff_end, large_uint_type n, unsigned base, bool upper) {
+	const char *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+	char *c = buff_end;
+	do {
+		*(--c) = digits[n % base];
+		n /= base;
+	} while(n != 0);
+	return c;
+}
+
+static const char *format_val_name(i_val val, size_t *len) {
+	const char *name;
+	switch(BERYL_TYPEOF(val)) {
+		case TYPE_NULL:
+			name = "Null";
+			break;
+		case TYPE_BOOL:
+			name = beryl_as_bool(val) ? "true" : "false";
+			break;
+		case TYPE_TABLE:
+			name = "Table";
+			break;
+		case TYPE_ARRAY:
+			name = "Array";
+			break;
+		case TYPE_TAG:
+			name = "Tag";
+			break;
+		case TYPE_FN:
+		case TYPE_EXT_FN:
+			name = "Function";
+			break;
+		case TYPE_OBJECT: {
+			beryl_object_class *obj_class = beryl_object_class_type(val);
+			*len = obj_class->name_len;
+			return obj_class->name;
+		}
+		default:
+			name = "Unknown";
+			break;
+	}
+	
+	*len = 0;
+	while(name[*len] != '\0')
+		(*len)++;
+	return name;
+}
+
+static bool format_val(struct format_out *out, i_val val, const struct format_spec *spec, i_val *err) {
+	char num_buff[NUM_FIXED_STR_MAX(FORMAT_MAX_PRECISION)];
+	const char *sign = "";
+	const char *text;
+	size_t text_len;
+	bool is_num = BERYL_TYPEOF(val) == TYPE_NUMBER;
+	
+	if(is_num && spec->type != 's') {
+		i_float num = beryl_as_num(val);
+		if(num < 0) {
+			sign = "-";
+			num = -num;
+		} else if(spec->plus && num == num)
+			sign = "+";
+		
+		unsigned base = 0;
+		switch(spec->type) {
+			case 'd': base = 10; break;
+			case 'x': case 'X': base = 16; break;
+			case 'o': base = 8; break;
+			case 'b': base = 2; break;
+		}
+		
+		if(base != 0) {
+			if(!beryl_is_integer(val) || num >= BERYL_NUM_MAX_INT) {
+				*err = BERYL_ERR("Expected integers for the integer fields in the format string %0");
+				return false;
+			}
+			char *buff_end = num_buff + sizeof(num_buff);
+			text = format_uint(buff_end, (large_uint_type) num, base, spec->type == 'X');
+			text_len = buff_end - text;
+		} else {
+			text = num_buff;
+			if(spec->type == 'f' || spec->precision != -1)
+				text_len = num_format_fixed(num, spec->precision == -1 ? 6 : spec->precision, num_buff);
+			else
+				text_len = num_format(num, num_buff);
+		}
+	} else {
+		if(spec->type != 0 && spec->type != 's') {
+			*err = BERYL_ERR("Expected numbers for the numeric fields in the format string %0");
+			return false;
+		}
+		if(BERYL_TYPEOF(val) == TYPE_STR) {
+			text = beryl_get_raw_str(&val);
+			text_len = BERYL_LENOF(val);
+		} else if(is_num) {
+			text = num_buff;
+			text_len = num_format(beryl_as_num(val), num_buff);
+		} else
+			text = format_val_name(val, &text_len);
+		
+		if(spec->precision != -1 && text_len > (size_t) spec->precision) { // Cut back to the start of a UTF-8 character, so that none are split
+			text_len = spec->precision;
+			while(text_len > 0 && ((unsigned char) text[text_len] & 0xC0) == 0x80)
+				text_len--;
+		}
+	}
+	
+	size_t sign_len = sign[0] != '\0';
+	size_t pad = spec->width > sign_len + text_len ? spec->width - (sign_len + text_len) : 0;
+	if(is_num && spec->zero && spec->align == 0) {
+		format_write(out, sign, sign_len);
+		format_fill(out, '0', pad);
+		format_write(out, text, text_len);
+		return true;
+	}
+	
+	char align = spec->align != 0 ? spec->align : is_num ? '>' : '<';
+	size_t left_pad = align == '<' ? 0 : align == '>' ? pad : pad / 2;
+	format_fill(out, spec->fill, left_pad);
+	format_write(out, sign, sign_len);
+	format_write(out, text, text_len);
+	format_fill(out, spec->fill, pad - left_pad);
+	return true;
+}
+
+static bool format_pass(struct format_out *out, const char *fmt, size_t fmt_len, const i_val *args, i_size n_args, i_val *err) {
+	const char *c = fmt, *end = fmt + fmt_len;
+	size_t next_arg = 0;
+	
+	while(c != end) {
+		const char *literal = c;
+		while(c != end && *c != '{' && *c != '}')
+			c++;
+		format_write(out, literal, c - literal);
+		if(c == end)
+			break;
+		
+		if(end - c >= 2 && c[1] == *c) { // {{ or }}
+			format_write(out, c, 1);
+			c += 2;
+			continue;
+		}
+		if(*c == '}') {
+			*err = BERYL_ERR("Unmatched '}' in the format string %0");
+			return false;
+		}
+		
+		const char *ref = ++c;
+		while(c != end && *c != ':' && *c != '}')
+			c++;
+		const char *ref_end = c;
+		while(c != end && *c != '}')
+			c++;
+		if(c == end) {
+			*err = BERYL_ERR("Unterminated field in the format string %0");
+			return false;
+		}
+		
+		struct format_spec spec;
+		const char *spec_start = ref_end == c ? c : ref_end + 1;
+		if(!parse_format_spec(spec_start, c, &spec)) {
+			*err = BERYL_ERR("Invalid field specifier in the format string %0");
+			return false;
+		}
+		c++;
+		
+		i_val val;
+		if(ref == ref_end || (*ref >= '0' && *ref <= '9')) {
+			size_t arg = next_arg;
+			if(ref != ref_end) {
+				arg = 0;
+				for(const char *d = ref; d != ref_end; d++) {
+					if(*d < '0' || *d > '9' || arg > n_args) {
+						*err = BERYL_ERR("Invalid argument index in the format string %0");
+						return false;
+					}
+					arg = arg * 10 + (*d - '0');
+				}
+			}
+			if(arg >= n_args) {
+				*err = BERYL_ERR("The format string %0 refers to more arguments than were given");
+				return false;
+			}
+			val = args[arg];
+			next_arg = arg + 1;
+		} else {
+			if(n_args == 0 || BERYL_TYPEOF(args[0]) != TYPE_TABLE) {
+				*err = BERYL_ERR("The format string %0 has named fields, but the first argument is not a table");
+				return false;
+			}
+			i_val_pair *field = table_get(args[0].val.table, args[0].len, BERYL_STATIC_STR(ref, ref_end - ref));
+			if(field == NULL) {
+				*err = BERYL_ERR("The format string %0 names a field that is not in the table");
+				return false;
+			}
+			val = field->val;
+		}
+		
+		if(!format_val(out, val, &spec, err))
+			return false;
+	}
+	return true;
+}
+
+i_val beryl_format(const char *fmt, size_t fmt_len, const i_val *args, i_size n_args) {
+	struct format_out out = { NULL, 0 };
+	i_val err;
+	if(!format_pass(&out, fmt, fmt_len, args, n_args, &err))
+		return err;
+	if(out.len > I_SIZE_MAX)
+		return BERYL_ERR("Formatted string would be too large");
+	
+	i_val res = beryl_new_string(out.len, NULL);
+	if(BERYL_TYPEOF(res) == TYPE_NULL)
+		return BERYL_ERR("Out of memory");
+	
+	size_t len = out.len;
+	out = (struct format_out) { (char *) beryl_get_raw_str(&res), 0 };
+	bool ok = format_pass(&out, fmt, fmt_len, args, n_args, &err);
+	assert(ok && out.len == len);
+	(void) ok;
+	(void) len;
+	return res;
 }
 
 static i_val parse_eval_expr(struct lex_state *lex, bool eval, bool ignore_newlines);
@@ -1058,6 +1730,102 @@ static i_val parse_eval_fn_assign(struct lex_state *lex, bool eval, struct lex_t
 	return err;
 }
 
+// An assignment like x = push x y moves the old value of x into the call instead of copying it, the same way x push= y does,
+// so that push (or replace etc.) sees a refcount of 1 and can modify it in place. Nothing may observe x while its value is moved out,
+// so this is only done if x is referenced once, as an argument of the outermost call, and is followed only by names, strings and numbers.
+// The call itself must also not be able to run any code that could read x, see call_with_moved_arg
+static const char *move_on_use = NULL; // The source position of the variable reference to move, if any
+static struct {
+	stack_entry *var; // The variable that the value was moved out of, or NULL
+	i_val *arg; // Where the value is on the argument stack, or NULL if it has not been pushed yet
+} moved = { NULL, NULL };
+
+static void restore_moved(i_val val) {
+	moved.var->val = val;
+	moved.var = NULL;
+	moved.arg = NULL;
+}
+
+static bool sym_token_is(struct lex_token tok, struct lex_token sym) {
+	if((tok.type != TOK_SYM && tok.type != TOK_OP) || tok.content.sym.len != sym.content.sym.len)
+		return false;
+	for(i_size i = 0; i < sym.content.sym.len; i++) {
+		if(tok.content.sym.str[i] != sym.content.sym.str[i])
+			return false;
+	}
+	return true;
+}
+
+static const char *find_single_use(const struct lex_state *lex, struct lex_token var_tok) {
+	struct lex_state scan;
+	LEX_STATE_COPY(&scan, lex);
+	
+	const char *use = NULL;
+	unsigned brackets = 0, blocks = 0;
+	unsigned char prev_type = TOK_ASSIGN;
+	while(true) {
+		struct lex_token tok = lex_pop(&scan);
+		if(use != NULL) { // Only values that can't observe the variable may be evaluated after it has been moved
+			switch(tok.type) {
+				case TOK_SYM:
+					if(sym_token_is(tok, var_tok))
+						return NULL;
+					break;
+				case TOK_NUMBER:
+				case TOK_STRING:
+					break;
+				
+				case TOK_CLOSE_BRACKET:
+				case TOK_END:
+				case TOK_ENDLINE:
+				case TOK_EOF:
+					return use;
+				default:
+					return NULL;
+			}
+			continue;
+		}
+		
+		switch(tok.type) {
+			case TOK_OPEN_BRACKET:
+				brackets++;
+				break;
+			case TOK_CLOSE_BRACKET:
+				if(brackets == 0)
+					return NULL;
+				brackets--;
+				break;
+			
+			case TOK_DO:
+				blocks++;
+				break;
+			case TOK_END:
+				if(blocks == 0)
+					return NULL;
+				blocks--;
+				break;
+			
+			case TOK_ENDLINE:
+				if(brackets == 0 && blocks == 0)
+					return NULL;
+				break;
+			case TOK_EOF:
+			case TOK_ERR:
+				return NULL;
+			
+			default:
+				if(sym_token_is(tok, var_tok)) {
+					// The first term is the function being called, and a term after an operator is its right hand side
+					if(brackets != 0 || blocks != 0 || prev_type == TOK_ASSIGN || prev_type == TOK_OP)
+						return NULL;
+					use = tok.src;
+				}
+				break;
+		}
+		prev_type = tok.type;
+	}
+}
+
 static i_val parse_eval_term(struct lex_state *lex, bool eval) {
 	struct lex_token tok = lex_pop(lex);
 	switch(tok.type) {
@@ -1087,7 +1855,17 @@ static i_val parse_eval_term(struct lex_state *lex, bool eval) {
 		case TOK_OP: {
 			struct lex_token fn_assign;
 			if(lex_accept(lex, TOK_ASSIGN, NULL)) {
+				const char *prev_move_on_use = move_on_use;
+				move_on_use = NULL;
+				if(eval) {
+					stack_entry *var = get_global(tok.content.sym.str, tok.content.sym.len);
+					if(var != NULL && !var->is_const && get_reference_counter(var->val) != NULL) // Moving only matters for reference counted values
+						move_on_use = find_single_use(lex, tok);
+				}
+				
 				i_val assign_val = parse_eval_expr(lex, eval, false);
+				move_on_use = prev_move_on_use;
+				assert(moved.var == NULL);
 				if(BERYL_TYPEOF(assign_val) == TYPE_ERR)
 					return assign_val;
 				if(!eval)
@@ -1121,6 +1899,13 @@ static i_val parse_eval_term(struct lex_state *lex, bool eval) {
 				blame_token(lex, tok);
 				return BERYL_ERR("Undeclared variable");
 			}
+			if(tok.src == move_on_use) {
+				move_on_use = NULL;
+				moved.var = var;
+				i_val val = var->val;
+				var->val = BERYL_NULL;
+				return val;
+			}
 			return beryl_retain(var->val);
 		}
 		
@@ -1164,6 +1949,11 @@ static i_val parse_eval_term(struct lex_state *lex, bool eval) {
 				}
 			} else {
 				stack_entry *var = index_globals(var_name, var_name_len);
+				if(var == NULL) {
+					beryl_release(assign_val);
+					blame_token(lex, var_sym);
+					return BERYL_ERR("Out of variable space");
+				}
 				if(var->name != NULL) {
 					beryl_release(assign_val);
 					blame_token(lex, var_sym);
@@ -1291,9 +2081,14 @@ static i_val parse_eval_args(struct lex_state *lex, bool eval, bool ignore_newli
 		
 		bool ok = push_arg(res);
 		if(!ok) {
-			beryl_release(res);
+			if(moved.var != NULL && moved.arg == NULL)
+				restore_moved(res);
+			else
+				beryl_release(res);
 			return BERYL_ERR("Argument stack overflow");
 		}
+		if(moved.var != NULL && moved.arg == NULL)
+			moved.arg = arg_stack_top - 1;
 		n_args++;
 	}
 	
@@ -1301,6 +2096,57 @@ static i_val parse_eval_args(struct lex_state *lex, bool eval, bool ignore_newli
 	return BERYL_NULL;
 }
 
+static bool ext_fn_accepts(const struct beryl_external_fn *fn, size_t n_args) {
+	if(fn->arity < 0)
+		return n_args >= (size_t) -(fn->arity + 1);
+	return n_args == (size_t) fn->arity;
+}
+
+// Calls fn with arguments where one has been moved out of a variable (see find_single_use). The value is only passed on without the variable
+// holding it if fn is an external function that can't call back into any code that could read the variable (and that either auto releases, or
+// accepts a moved first argument), in which case it is put back if the call fails. Otherwise the variable gets its value back before the call
+static i_val call_with_moved_arg(i_val fn, i_val *args, i_size n_args) {
+	i_val *arg = moved.arg;
+	stack_entry *var = moved.var;
+	moved.var = NULL;
+	moved.arg = NULL;
+	
+	bool can_move = false;
+	if(BERYL_TYPEOF(fn) == TYPE_EXT_FN && ext_fn_accepts(fn.val.ext_fn, n_args))
+		can_move = fn.val.ext_fn->auto_release || (fn.val.ext_fn->accepts_moved_arg && arg == &args[0]);
+	for(i_size i = 0; i < n_args && can_move; i++) {
+		switch(BERYL_TYPEOF(args[i])) {
+			case TYPE_TABLE: // Tables can have methods
+				if(&args[i] == arg) // But the moved value is only being modified
+					break;
+				/* fall through */
+			case TYPE_FN:
+			case TYPE_EXT_FN:
+			case TYPE_OBJECT:
+				can_move = false;
+				break;
+			default:
+				break;
+		}
+	}
+	if(!can_move) {
+		var->val = beryl_retain(*arg);
+		return beryl_call(fn, args, n_args, false);
+	}
+	
+	struct beryl_external_fn *ext_fn = fn.val.ext_fn;
+	i_val res = ext_fn->fn(args, n_args);
+	if(BERYL_TYPEOF(res) == TYPE_ERR) {
+		blame_name(ext_fn->name, ext_fn->name_len);
+		var->val = *arg;
+		*arg = BERYL_NULL;
+	}
+	if(ext_fn->auto_release)
+		beryl_release_values(args, n_args);
+	beryl_release(fn);
+	return res;
+}
+
 static i_val parse_eval_expr(struct lex_state *lex, bool eval, bool ignore_newlines) {
 	i_val err;
 	
@@ -1340,7 +2186,13 @@ static i_val parse_eval_expr(struct lex_state *lex, bool eval, bool ignore_newli
 	if(n_args == 0) //If there are no arguments, return the 'function'. I.e (1) means '1' and not, 'call 1'
 		return fn;
 	
-	i_val res = beryl_call(fn, args_begin, n_args, false);
+	if(BERYL_TYPEOF(fn) == TYPE_TABLE)
+		next_call_site = fn_tok.src;
+	i_val res;
+	if(moved.arg != NULL)
+		res = call_with_moved_arg(fn, args_begin, n_args);
+	else
+		res = beryl_call(fn, args_begin, n_args, false);
 	if(BERYL_TYPEOF(res) == TYPE_ERR)
 		blame_token(lex, fn_tok);
 	
@@ -1349,6 +2201,11 @@ static i_val parse_eval_expr(struct lex_state *lex, bool eval, bool ignore_newli
 	
 	ERR:
 	expr_recursion_counter--;
+	if(moved.arg != NULL && moved.arg >= args_begin) { // An argument after the moved one failed
+		i_val *arg = moved.arg;
+		restore_moved(*arg);
+		*arg = BERYL_NULL;
+	}
 	restore_arg_state(args_begin, true);
 	return err;
 }
@@ -1521,6 +2378,8 @@ i_val beryl_call(i_val fn, const i_val *args, size_t n_args, bool borrow) {
 			i_val res = ext_fn->fn(args, n_args);
 			if(ext_fn->auto_release)
 				beryl_release_values(args, n_args);
+			else if(ext_fn->accepts_moved_arg && BERYL_TYPEOF(res) == TYPE_ERR && n_args > 0)
+				beryl_release(args[0]); // Left to the caller on errors
 			beryl_release(fn);
 			
 			if(BERYL_TYPEOF(res) == TYPE_ERR)
@@ -1535,17 +2394,20 @@ i_val beryl_call(i_val fn, const i_val *args, size_t n_args, bool borrow) {
 		}
 		
 		case TYPE_TABLE: {
+			const char *site = next_call_site;
+			next_call_site = NULL;
+			
 			if(n_args == 0) {
 				err = BERYL_ERR("Cannot index table without key");
 				goto ERR;
 			} if(n_args == 1) {
-				i_val res = index_table(fn, args[0]);
+				i_val res = index_table(fn, args[0], site);
 				beryl_release(args[0]);
 				beryl_release(fn);
 				return res;
 			}
 			
-			i_val member = index_table(fn, args[0]);
+			i_val member = index_table(fn, args[0], site);
 			beryl_release(args[0]);
 			
 			stack_entry *prev_scope = enter_scope();
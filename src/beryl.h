@@ -84,15 +84,22 @@ struct beryl_external_fn {
 	const char *name;
 	size_t name_len;
 	struct i_val (*fn)(const struct i_val *, i_size);
+	// Only for functions that don't auto release: set if the function never calls back into the script, and leaves its first argument
+	// unreleased and unchanged when it returns an error. x = f x ... then moves x into the function, so that it can modify it in place
+	bool accepts_moved_arg;
 };
 
 struct i_val_pair {
 	struct i_val key, val;
 };
 
+// Entries are stored densely, in insertion order. They are followed by an index array of n_slots slot numbers (each slot_size bytes wide),
+// where each slot is either 0 (empty) or the position of an entry + 1. Small tables (cap <= 8) have no index (n_slots == 0) and are searched linearly.
+// The first n_array entries have the keys 0, 1, 2 ... n_array - 1; these are indexed directly by their key, and are not stored in the index.
 struct beryl_table {
-	i_size cap;
+	i_size cap, n_slots, n_array;
 	i_refc ref_c;
+	unsigned char slot_size;
 	struct i_val_pair entries[];
 };
 
@@ -161,7 +168,29 @@ i_size beryl_get_array_capacity(struct i_val array);
 
 bool beryl_array_push(struct i_val *array, struct i_val val);
 
-#define BERYL_STATIC_TABLE_SIZE(l) ( sizeof(struct beryl_table) + sizeof(struct i_val_pair) * ((l)*3 / 2) )
+// Appends len bytes to the end of str, in place. str must be a managed string longer than BERYL_INLINE_STR_MAX_LEN, with a refcount of 1,
+// and from must not point into str. Strings grow geometrically, so repeated appends take amortized linear time. Returns false if out of memory.
+bool beryl_string_append(struct i_val *str, const char *from, i_size len);
+
+// Builds an array one element at a time, growing geometrically. Unlike beryl_array_push, beryl_array_builder_push takes ownership of val
+// (also if it fails, in which case val is released). beryl_array_builder_finish returns the built array with no extra capacity (or null if out of memory),
+// and leaves the builder empty. A builder that is not finished must be discarded.
+struct beryl_array_builder {
+	struct i_managed_array *array;
+	i_size len;
+};
+
+bool beryl_array_builder_init(struct beryl_array_builder *builder, i_size reserve);
+bool beryl_array_builder_reserve(struct beryl_array_builder *builder, i_size extra);
+bool beryl_array_builder_push(struct beryl_array_builder *builder, struct i_val val);
+struct i_val beryl_array_builder_finish(struct beryl_array_builder *builder);
+void beryl_array_builder_discard(struct beryl_array_builder *builder);
+
+// Both of these return a new string/array containing the elements [from, to), or null if out of memory. The result may share memory with the original.
+struct i_val beryl_substring(struct i_val str, i_size from, i_size to);
+struct i_val beryl_array_slice(struct i_val array, i_size from, i_size to);
+
+#define BERYL_STATIC_TABLE_SIZE(l) ( sizeof(struct beryl_table) + sizeof(struct i_val_pair) * (l) + sizeof(unsigned) * ((l)*3 / 2 + 1) )
 struct i_val beryl_static_table(i_size cap, unsigned char *bytes, size_t bytes_size);
 
 struct i_val_pair *beryl_iter_table(struct i_val table_v, struct i_val_pair *iter);
@@ -173,8 +202,18 @@ void beryl_set_io(void (*print)(void *, const char *, size_t), void (*print_i_va
 void beryl_print_i_val(void *f, struct i_val val);
 void beryl_i_vals_printf(void *f, const char *str, size_t strlen, const struct i_val *vals, unsigned n); // N must be at max 10
 
+// Returns a new string where every field {ref:spec} in fmt is replaced by a formatted argument (see the format function in the core library),
+// or an error, whose message refers to fmt as %0
+struct i_val beryl_format(const char *fmt, size_t fmt_len, const struct i_val *args, i_size n_args);
+
 void beryl_set_mem(void *(*alloc)(size_t), void (*free)(void *), void *(*realloc)(void *, size_t));
 
+// Lets libraries split work across threads. run_parallel must call task(data, i) once for every i in [0, n_tasks), using at most threads threads,
+// and return once all calls have finished. The tasks never call back into the interpreter. If this is never set, everything runs on the calling thread.
+void beryl_set_threads(void (*run_parallel)(void (*task)(void *, size_t), void *data, size_t n_tasks), unsigned threads);
+unsigned beryl_get_threads();
+void beryl_run_parallel(void (*task)(void *, size_t), void *data, size_t n_tasks);
+
 struct i_val beryl_new_string(i_size len, const char *from);
 
 struct i_val beryl_new_object(struct beryl_object_class *obj_class);
@@ -1,6 +1,7 @@
 #include "io.h"
 
 #include "beryl.h"
+#include "num.h"
 
 #include <string.h>
 
@@ -45,11 +46,9 @@ void print_i_val(FILE *f, struct i_val val) {
 			break;
 			
 		case TYPE_NUMBER: {
-			i_float num = beryl_as_num(val);
-			if(beryl_is_integer(val) && num <= LLONG_MAX && num >= LLONG_MIN)
-				fprintf(f, "%lli", (long long int) num);
-			else
-				fprintf(f, "%f", num);
+			char buff[NUM_STR_MAX];
+			size_t len = num_format(beryl_as_num(val), buff);
+			fwrite(buff, sizeof(char), len, f);
 		} break;
 		
 		case TYPE_BOOL:
@@ -1,4 +1,5 @@
 #include "lexer.h"
+#include "num.h"
 #include "utils.h"
 
 typedef struct lex_token lex_token;
@@ -129,35 +130,10 @@ static unsigned char match_keyword(const char *sym, i_size len) {
 }
 
 struct lex_token parse_number(struct lex_state *state) {
-	
 	const char *start = state->at;
 	i_float float_v = 0;
-	while(!is_at_end(state) && (is_digit(*state->at) || *state->at == '\'')) {
-		if(*state->at == '\'') {
-			state->at++;
-			continue;
-		}
-		float_v *= 10;
-		float_v += *state->at - '0';
-		state->at++;
-	}
-
-	if(!is_at_end(state) && *state->at == '.') { //Decimals
-		state->at++;
-		i_float decimals = 0;
-		i_float pow = 1.0;
-		while(!is_at_end(state) && (is_digit(*state->at) || *state->at == '\'')) {
-			if(*state->at == '\'') {
-				state->at++;
-				continue;
-			}
-			pow *= 0.1;
-			decimals += (*state->at - '0') * pow;
-			state->at++;
-		}
-		float_v += decimals;
-	}
-
+	state->at += num_parse(state->at, state->end - state->at, true, &float_v);
+	
 	return (lex_token) { TOK_NUMBER, start, state->at - start, { .number = float_v } };
 }
 
@@ -1,6 +1,10 @@
 #include "libs.h"
 
 #include "../beryl.h"
+#include "../mem.h"
+#include "../num.h"
+#include "../regex.h"
+#include "../utf8.h"
 
 #include "../utils.h"
 
@@ -82,8 +86,9 @@ static i_val mul_op(i_val a, i_val b) {
 
 } */
 
-#define FN(arity, name, fn) { arity, true, name, sizeof(name) - 1, fn }
-#define MANUAL_RELEASE_FN(arity, name, fn) { arity, false, name, sizeof(name) - 1, fn }
+#define FN(arity, name, fn) { arity, true, name, sizeof(name) - 1, fn, false }
+#define MANUAL_RELEASE_FN(arity, name, fn) { arity, false, name, sizeof(name) - 1, fn, false }
+#define MOVED_ARG_FN(arity, name, fn) { arity, false, name, sizeof(name) - 1, fn, true } // See accepts_moved_arg in beryl.h
 
 #define MATH_OP(name, start_val, start_index, op) \
 static i_val name(const i_val *args, i_size n_args) { \
@@ -523,8 +528,15 @@ CMP_OP(greater_eq_callback,
 	
 	Binary function.
 	For each key and value in *table*, calls *body* with the key and value as arguments.
-	Can also iterate over arrays, in which case the arguments given to *body* are the index and element for each entry.
+	Can also iterate over arrays, deques and ranges, in which case the arguments given to *body* are the index and element for each entry.
 @@*/
+static bool container_object_size(i_val obj, i_size *size);
+static bool container_object_get(i_val obj, i_size i, i_val *item);
+static bool container_object_indexable(i_val obj, i_size *size);
+static i_val container_object_as_array(i_val obj);
+static bool range_length(i_float from, i_float to, i_float step, i_size *len);
+static i_val range_as_array(i_float from, i_float step, i_size len);
+
 static i_val foreach_in_callback(const i_val *args, i_size n_args) {
 	(void) n_args;
 
@@ -557,7 +569,26 @@ static i_val foreach_in_callback(const i_val *args, i_size n_args) {
 			return res;
 		}
 		
+		case TYPE_OBJECT: {
+			i_val res = BERYL_NULL;
+			i_size size;
+			i_val item;
+			if(!container_object_indexable(args[0], &size))
+				goto TYPE_ERR;
+			
+			for(i_size i = 0; container_object_size(args[0], &size) && i < size; i++) { // The object may be modified by body, so the size is checked on each iteration
+				beryl_release(res);
+				container_object_get(args[0], i, &item);
+				i_val iter_args[] = { BERYL_NUMBER(i), item };
+				res = beryl_call(args[1], iter_args, 2, true);
+				if(BERYL_TYPEOF(res) == TYPE_ERR)
+					return res;
+			}
+			return res;
+		}
+		
 		default:
+		TYPE_ERR:
 			beryl_blame_arg(args[0]);
 			return BERYL_ERR("Expected array or table as argument for 'foreach-in'");
 	}
@@ -594,8 +625,14 @@ static i_val insert_callback(const i_val *args, i_size n_args) {
 	i_refc refs = beryl_get_refcount(table);
 	bool retain_table = false;
 	
+	// Tables only store as many entries as they have been allocated for, so leave some room to make repeated insertions amortized O(1)
+	i_size len = BERYL_LENOF(table);
+	i_size grown_cap = len + len / 2 + 1;
+	if(grown_cap <= len)
+		return BERYL_ERR("Out of memory");
+	
 	if(refs != 1) {
-		i_val new_table = beryl_new_table(BERYL_LENOF(table) + 1, true);
+		i_val new_table = beryl_new_table(grown_cap, true);
 		if(BERYL_TYPEOF(new_table) == TYPE_NULL)
 			return BERYL_ERR("Out of memory");
 		
@@ -603,7 +640,7 @@ static i_val insert_callback(const i_val *args, i_size n_args) {
 		table = new_table;
 	} else {
 		if(beryl_table_should_grow(table, 1)) {
-			i_val new_table = beryl_new_table(BERYL_LENOF(table) + 1, true);
+			i_val new_table = beryl_new_table(grown_cap, true);
 			if(BERYL_TYPEOF(new_table) == TYPE_NULL)
 				return BERYL_ERR("Out of memory");
 			union_tables(&new_table, table);
@@ -680,13 +717,6 @@ static i_val union_callback(const i_val *args, i_size n_args) {
 	return new_table;
 }
 
-static void mcpy(void *to_ptr, const void *from_ptr, size_t n) {
-	char *to = to_ptr;
-	const char *from = from_ptr;
-	while(n--)
-		*(to++) = *(from++);
-}
-
 /*@@
 	cat
 	a b ... rest
@@ -701,10 +731,13 @@ static void mcpy(void *to_ptr, const void *from_ptr, size_t n) {
 		let s = cat "x is " x ", y is " y
 	The string 's' will in this case be "x is 5, y is 10"
 @@*/
-static i_val concat_callback(const i_val *args, i_size n_args) {
-	i_val err;
+static i_val concat_callback(const i_val *args, i_size n_args) { // DOESN'T USE AUTORELEASE, and leaves args[0] to the caller on errors (see accepts_moved_arg)
+	i_val err = BERYL_NULL;
 	bool only_strings = true;
 	
+	// If the first string is not referenced anywhere else (i.e for s cat= x or s = cat s x), the others are appended to it in place, the same way push does for arrays
+	bool in_place = BERYL_TYPEOF(args[0]) == TYPE_STR && args[0].managed && BERYL_LENOF(args[0]) > BERYL_INLINE_STR_MAX_LEN && beryl_get_refcount(args[0]) == 1;
+	
 	for(i_size i = 0; i < n_args; i++) {
 		if(BERYL_TYPEOF(args[i]) != TYPE_STR) {
 			only_strings = false;
@@ -715,7 +748,12 @@ static i_val concat_callback(const i_val *args, i_size n_args) {
 	i_val *str_array = NULL;
 	if(!only_strings) {
 		str_array = beryl_talloc(n_args * sizeof(i_val));
-		for(i_size i = 0; i < n_args; i++)
+		if(str_array == NULL) {
+			beryl_release_values(args + 1, n_args - 1);
+			return BERYL_ERR("Out of memory");
+		}
+		str_array[0] = in_place ? args[0] : i_val_as_string(args[0]); // Not retained when in place, so that the refcount stays at 1
+		for(i_size i = 1; i < n_args; i++)
 			str_array[i] = i_val_as_string(args[i]);
 		strings = str_array;
 	}
@@ -726,10 +764,51 @@ static i_val concat_callback(const i_val *args, i_size n_args) {
 			err = beryl_retain(strings[i]);
 			goto ERR;
 		}
+		if(BERYL_LENOF(strings[i]) > I_SIZE_MAX - total_len) {
+			err = BERYL_ERR("Resulting string would be too large");
+			goto ERR;
+		}
 		total_len += BERYL_LENOF(strings[i]);
 	}
 	
-	i_val res_str = beryl_new_string(total_len, NULL);
+	i_val res_str;
+	if(in_place) {
+		// Appended in one go, so that args[0] is left unchanged if it fails. More than one string is first joined into a temporary buffer
+		res_str = args[0];
+		const char *append = beryl_get_raw_str(&strings[1]);
+		i_size append_len = total_len - BERYL_LENOF(args[0]);
+		char *joined = NULL;
+		if(n_args > 2 && append_len > 0) {
+			joined = beryl_talloc(append_len);
+			if(joined == NULL) {
+				err = BERYL_ERR("Out of memory");
+				goto ERR;
+			}
+			char *s = joined;
+			for(i_size i = 1; i < n_args; i++) {
+				mem_copy(s, beryl_get_raw_str(&strings[i]), BERYL_LENOF(strings[i]));
+				s += BERYL_LENOF(strings[i]);
+			}
+			append = joined;
+		}
+		bool ok = beryl_string_append(&res_str, append, append_len);
+		if(joined != NULL)
+			beryl_tfree(joined);
+		if(!ok) {
+			err = BERYL_ERR("Out of memory");
+			goto ERR;
+		}
+		
+		// args[0] has been moved into res_str (and may have been reallocated), so it is released through res_str
+		if(str_array != NULL) {
+			beryl_release_values(str_array + 1, n_args - 1);
+			beryl_tfree(str_array);
+		}
+		beryl_release_values(args + 1, n_args - 1);
+		return res_str;
+	}
+	
+	res_str = beryl_new_string(total_len, NULL);
 	if(BERYL_TYPEOF(res_str) == TYPE_NULL) {
 		err = BERYL_ERR("Out of memory");
 		goto ERR;
@@ -742,23 +821,23 @@ static i_val concat_callback(const i_val *args, i_size n_args) {
 		if(len > 0) {
 			assert(s < raw_str + total_len);
 		}
-		mcpy(s, beryl_get_raw_str(&strings[i]), len);
+		mem_copy(s, beryl_get_raw_str(&strings[i]), len);
 		s += len;
 	}
 	
 	if(str_array != NULL) {
-		for(size_t i = 0; i < n_args; i++)
-			beryl_release(str_array[i]);
+		beryl_release_values(str_array, n_args);
 		beryl_tfree(str_array);
 	}
+	beryl_release_values(args, n_args);
 	return res_str;
 	
 	ERR:
 	if(str_array != NULL) {
-		for(size_t i = 0; i < n_args; i++)
-			beryl_release(str_array[i]);
+		beryl_release_values(str_array + in_place, n_args - in_place);
 		beryl_tfree(str_array);
 	}
+	beryl_release_values(args + 1, n_args - 1);
 	return err;
 }
 
@@ -788,6 +867,7 @@ static i_val in_callback(const i_val *args, i_size n_args) { // DOESN'T USE AUTO
 	If *value* is an array, returns the number of items in that array.
 	If *value* is a table, returns the number of entries.
 	If *value* is a string, returns the number of bytes in the string.
+	If *value* is a priority queue or a deque, returns the number of values in it.
 	Otherwise, returns 1.
 @@*/
 static i_val sizeof_callback(const i_val *args, i_size n_args) {
@@ -798,6 +878,13 @@ static i_val sizeof_callback(const i_val *args, i_size n_args) {
 		case TYPE_ARRAY:
 			return BERYL_NUMBER(BERYL_LENOF(args[0]));
 		
+		case TYPE_OBJECT: {
+			i_size size;
+			if(container_object_size(args[0], &size))
+				return BERYL_NUMBER(size);
+			return BERYL_NUMBER(1);
+		}
+		
 		default:
 			return BERYL_NUMBER(1);
 	}
@@ -834,11 +921,11 @@ static i_val replace_callback(const i_val *args, i_size n_args) {
 				beryl_table_insert(&res, args[1], args[2], true); //Replace it via mutation
 				return beryl_retain(res);
 			} else {
-				i_val new_table = beryl_new_table(BERYL_LENOF(args[0]) + 1, true);
+				i_val new_table = beryl_new_table(BERYL_LENOF(args[0]), true);
 				if(BERYL_TYPEOF(new_table) == TYPE_NULL)	
 					return BERYL_ERR("Out of memory");
-				beryl_table_insert(&new_table, args[1], args[2], false);
 				union_tables(&new_table, args[0]);
+				beryl_table_insert(&new_table, args[1], args[2], true); // Replaced after the union so that the entry keeps its position
 				return new_table;
 			}
 		}
@@ -949,6 +1036,7 @@ static i_val eval_callback(const i_val *args, i_size n_args) {
 	Binary function.
 	Creates a new array that is a copy of the array *array*, except only containing the elements
 	such that *fn* given the element as an argument returns true. 
+	*array* may also be a range or deque, in which case the result is a new array.
 	May return an error if out of memory or if *fn* does not return a boolean.
 
 	Example:
@@ -956,31 +1044,86 @@ static i_val eval_callback(const i_val *args, i_size n_args) {
 		let b = filter a with x do x > 2 end
 	'b' in this case will be the array (3 4)
 @@*/
+static i_val filter_container_object(const i_val *args) {
+	struct beryl_array_builder builder;
+	beryl_array_builder_init(&builder, 0);
+	
+	i_size size;
+	for(i_size i = 0; container_object_size(args[0], &size) && i < size; i++) {
+		i_val item;
+		container_object_get(args[0], i, &item);
+		item = beryl_retain(item); // Retained, since fn may remove it from the container
+		
+		i_val filter_res = beryl_call(args[1], &item, 1, true);
+		if(BERYL_TYPEOF(filter_res) != TYPE_BOOL) {
+			beryl_release(item);
+			beryl_array_builder_discard(&builder);
+			if(BERYL_TYPEOF(filter_res) == TYPE_ERR)
+				return filter_res;
+			beryl_blame_arg(filter_res);
+			beryl_release(filter_res);
+			return BERYL_ERR("Expected filter function to return boolean");
+		}
+		if(!beryl_as_bool(filter_res))
+			beryl_release(item);
+		else if(!beryl_array_builder_push(&builder, item)) {
+			beryl_array_builder_discard(&builder);
+			return BERYL_ERR("Out of memory");
+		}
+	}
+	
+	i_val res = beryl_array_builder_finish(&builder);
+	if(BERYL_TYPEOF(res) == TYPE_NULL)
+		return BERYL_ERR("Out of memory");
+	return res;
+}
+
 static i_val filter_callback(const i_val *args, i_size n_args) { // DOESN'T USE AUTORELEASE
 	(void) n_args;
+	i_size size;
+	if(BERYL_TYPEOF(args[0]) == TYPE_OBJECT && container_object_indexable(args[0], &size)) {
+		i_val res = filter_container_object(args);
+		beryl_release_values(args, n_args);
+		return res;
+	}
 	if(BERYL_TYPEOF(args[0]) != TYPE_ARRAY) {
 		beryl_blame_arg(args[0]);
 		beryl_release_values(args, n_args);
 		return BERYL_ERR("First argument of 'filter' must be array");
 	}
 	
-	i_val res;
 	const i_val *from_array = beryl_get_raw_array(args[0]);
 	
-	if(beryl_get_refcount(args[0]) == 1)
-		res = beryl_retain(args[0]);
-	else {
-		i_size len = BERYL_LENOF(args[0]);
-		res = beryl_new_array(len, NULL, len, false);
-		if(BERYL_TYPEOF(res) == TYPE_NULL) {
-			beryl_release_values(args, n_args);
-			return BERYL_ERR("Out of memory");
+	if(beryl_get_refcount(args[0]) != 1) {
+		struct beryl_array_builder builder;
+		beryl_array_builder_init(&builder, 0);
+		
+		for(i_size i = 0; i < BERYL_LENOF(args[0]); i++) {
+			i_val filter_res = beryl_call(args[1], &from_array[i], 1, true);
+			if(BERYL_TYPEOF(filter_res) != TYPE_BOOL) {
+				beryl_array_builder_discard(&builder);
+				beryl_release_values(args, n_args);
+				if(BERYL_TYPEOF(filter_res) == TYPE_ERR)
+					return filter_res;
+				beryl_blame_arg(filter_res);
+				beryl_release(filter_res);
+				return BERYL_ERR("Expected filter function to return boolean");
+			}
+			if(beryl_as_bool(filter_res) && !beryl_array_builder_push(&builder, beryl_retain(from_array[i]))) {
+				beryl_array_builder_discard(&builder);
+				beryl_release_values(args, n_args);
+				return BERYL_ERR("Out of memory");
+			}
 		}
-		i_val *a = (i_val *) beryl_get_raw_array(res);
-		for(i_size i = 0; i < len; i++)
-			a[i] = BERYL_NULL;
+		
+		beryl_release_values(args, n_args);
+		i_val res = beryl_array_builder_finish(&builder);
+		if(BERYL_TYPEOF(res) == TYPE_NULL)
+			return BERYL_ERR("Out of memory");
+		return res;
 	}
 	
+	i_val res = beryl_retain(args[0]);
 	i_val *to_array = (i_val *) beryl_get_raw_array(res);
 	i_size res_n = 0;
 
@@ -1004,6 +1147,7 @@ static i_val filter_callback(const i_val *args, i_size n_args) { // DOESN'T USE
 			res_n++;
 		}
 	}
+	beryl_release_values(to_array, BERYL_LENOF(res) - res_n); // The items that were not kept, and have not been overwritten
 	
 	beryl_release_values(args, n_args);
 	
@@ -1068,34 +1212,46 @@ static i_val mod_callback(const i_val *args, i_size n_args) {
 
 
 
-static i_val arrayof_array = BERYL_NULL;
+struct arrayof_capture {
+	struct beryl_object obj;
+	struct beryl_array_builder builder;
+	bool done;
+};
 
-static i_val arrayof_capture_callback(const i_val *args, i_size n_args) {
-	if(BERYL_TYPEOF(arrayof_array) == TYPE_NULL)
+static i_val arrayof_capture_call(struct beryl_object *obj, const i_val *args, i_size n_args) {
+	struct arrayof_capture *capture = (struct arrayof_capture *) obj;
+	if(capture->done)
 		return BERYL_NULL;
 	
 	if(n_args == 0)
 		return BERYL_NULL;
 	
-	if(n_args == 1) {
-		bool ok = beryl_array_push(&arrayof_array, args[0]);
-		if(!ok)
-			return BERYL_ERR("Out of memory");
-	} else {
-		i_val new_array = beryl_new_array(n_args, args, n_args, false);
-		if(BERYL_TYPEOF(new_array) == TYPE_NULL)
-			return BERYL_ERR("Out of memory");
-		
-		bool ok = beryl_array_push(&arrayof_array, new_array);
-		beryl_release(new_array);
-		if(!ok)
+	i_val item;
+	if(n_args == 1)
+		item = beryl_retain(args[0]);
+	else {
+		item = beryl_new_array(n_args, args, n_args, false);
+		if(BERYL_TYPEOF(item) == TYPE_NULL)
 			return BERYL_ERR("Out of memory");
 	}
 	
+	if(!beryl_array_builder_push(&capture->builder, item))
+		return BERYL_ERR("Out of memory");
 	return BERYL_NULL;
 }
 
-static struct beryl_external_fn arrayof_capture_fn = FN(-1, "arrayof-capture", arrayof_capture_callback);
+static void arrayof_capture_free(struct beryl_object *obj) {
+	struct arrayof_capture *capture = (struct arrayof_capture *) obj;
+	beryl_array_builder_discard(&capture->builder);
+}
+
+static struct beryl_object_class arrayof_capture_class = {
+	arrayof_capture_free,
+	arrayof_capture_call,
+	sizeof(struct arrayof_capture),
+	"arrayof-capture",
+	sizeof("arrayof-capture") - 1
+};
 
 /*@@
 	arrayof
@@ -1117,36 +1273,54 @@ static struct beryl_external_fn arrayof_capture_fn = FN(-1, "arrayof-capture", a
 		let obj = struct :foo 1 :bar 2
 		let a = arrayof foreach-in obj
 	'a' in this case will be the array ((:foo 1) (:bar 2))
+	
+	If *iterator-fn* is a range or deque (and no *args* are given), returns an array of its values.
 @@*/
 static i_val arrayof_callback(const i_val *args, i_size n_args) {
+	// arrayof for, and arrayof a range or deque, know their size up front, and are built directly without going through a capture function
+	if(n_args == 3 && BERYL_TYPEOF(args[0]) == TYPE_EXT_FN && args[0].val.ext_fn->fn == for_callback &&
+	BERYL_TYPEOF(args[1]) == TYPE_NUMBER && BERYL_TYPEOF(args[2]) == TYPE_NUMBER) {
+		i_float from = beryl_as_num(args[1]), to = beryl_as_num(args[2]);
+		i_float step = to < from ? -1 : 1;
+		i_size len;
+		if(!range_length(from, to, step, &len))
+			return BERYL_ERR("Out of memory");
+		return range_as_array(from, step, len);
+	}
+	i_size size;
+	if(n_args == 1 && BERYL_TYPEOF(args[0]) == TYPE_OBJECT && container_object_indexable(args[0], &size))
+		return container_object_as_array(args[0]);
 	
-	i_val *pass_args = beryl_talloc(sizeof(i_val) * n_args);
-	if(pass_args == NULL)
+	i_val capture_v = beryl_new_object(&arrayof_capture_class);
+	if(BERYL_TYPEOF(capture_v) == TYPE_NULL)
 		return BERYL_ERR("Out of memory");
-	for(i_size i = 1; i < n_args; i++)
-		pass_args[i-1] = args[i];
-	pass_args[n_args-1] = BERYL_EXT_FN(&arrayof_capture_fn); //The pass_args array contains [arg1, arg2, ..., capture_callback]
+	struct arrayof_capture *capture = (struct arrayof_capture *) beryl_as_object(capture_v);
+	capture->done = false;
+	beryl_array_builder_init(&capture->builder, 0);
 	
-	i_val prev_array = arrayof_array;
-	arrayof_array = beryl_new_array(0, NULL, 4, false);
-	if(BERYL_TYPEOF(arrayof_array) == TYPE_NULL) {
-		arrayof_array = prev_array;
-		beryl_tfree(pass_args);
+	i_val *pass_args = beryl_talloc(sizeof(i_val) * n_args);
+	if(pass_args == NULL) {
+		beryl_release(capture_v);
 		return BERYL_ERR("Out of memory");
 	}
+	for(i_size i = 1; i < n_args; i++)
+		pass_args[i-1] = args[i];
+	pass_args[n_args-1] = capture_v; //The pass_args array contains [arg1, arg2, ..., capture_callback]
 	
 	i_val res = beryl_call(args[0], pass_args, n_args, true);
 	beryl_tfree(pass_args);
 	
 	if(BERYL_TYPEOF(res) == TYPE_ERR) {
-		beryl_release(arrayof_array);
-		arrayof_array = prev_array;
+		beryl_release(capture_v);
 		return res;
 	}
-	
 	beryl_release(res);
-	res = arrayof_array;
-	arrayof_array = prev_array;
+	
+	res = beryl_array_builder_finish(&capture->builder);
+	capture->done = true; // The capture function may have been stored somewhere, in which case later calls to it are ignored
+	beryl_release(capture_v);
+	if(BERYL_TYPEOF(res) == TYPE_NULL)
+		return BERYL_ERR("Out of memory");
 	return res;
 }
 
@@ -1260,31 +1434,205 @@ static bool match_str(const char *str, const char *str_end, const char *substr,
 	size_t str_len = str_end - str;
 	if(str_len < substr_len)
 		return false;
+	return mem_equal(str, substr, substr_len);
+}
+
+// Substring search. Candidates are found by checking the first and last byte of the substring at 16 or 32 positions at once using SSE2/AVX2 (when available),
+// and then verified. Inputs that cause too many false candidates, and builds without SIMD, fall back to the Two-Way algorithm, which runs in linear time
+// and constant space. Searching from the right is done by running the same algorithms on the reversed strings.
+
+#define SEARCH_NOT_FOUND ((size_t) -1)
+
+struct search_str {
+	const unsigned char *str;
+	size_t len;
+	bool reverse;
+};
+
+static unsigned char search_at(const struct search_str *s, size_t i) {
+	return s->reverse ? s->str[s->len - 1 - i] : s->str[i];
+}
+
+static ptrdiff_t maximal_suffix(const struct search_str *needle, bool inverted, size_t *period) {
+	ptrdiff_t m = needle->len;
+	ptrdiff_t ms = -1, j = 0, k = 1, p = 1;
+	while(j + k < m) {
+		unsigned char a = search_at(needle, j + k);
+		unsigned char b = search_at(needle, ms + k);
+		if(inverted ? a > b : a < b) {
+			j += k;
+			k = 1;
+			p = j - ms;
+		} else if(a == b) {
+			if(k != p)
+				k++;
+			else {
+				j += p;
+				k = 1;
+			}
+		} else {
+			ms = j;
+			j = ms + 1;
+			k = p = 1;
+		}
+	}
+	*period = p;
+	return ms;
+}
+
+static size_t two_way_search(const struct search_str *hay, size_t from, const struct search_str *needle) {
+	ptrdiff_t m = needle->len, n = hay->len;
+	assert(m > 0);
+	
+	size_t p1, p2;
+	ptrdiff_t ms1 = maximal_suffix(needle, false, &p1);
+	ptrdiff_t ms2 = maximal_suffix(needle, true, &p2);
+	ptrdiff_t ell = ms1 > ms2 ? ms1 : ms2; // The needle is split into needle[0 ... ell] and needle[ell + 1 ... m - 1]
+	ptrdiff_t per = ms1 > ms2 ? (ptrdiff_t) p1 : (ptrdiff_t) p2;
+	
+	bool periodic = per < m;
+	for(ptrdiff_t i = 0; periodic && i <= ell; i++) {
+		if(search_at(needle, i) != search_at(needle, i + per))
+			periodic = false;
+	}
+	
+	ptrdiff_t j = from;
+	if(periodic) {
+		ptrdiff_t memory = -1; // The prefix of the needle that is already known to match, after shifting by the period
+		while(j <= n - m) {
+			ptrdiff_t i = (ell > memory ? ell : memory) + 1;
+			while(i < m && search_at(needle, i) == search_at(hay, i + j))
+				i++;
+			if(i < m) {
+				j += i - ell;
+				memory = -1;
+				continue;
+			}
+			i = ell;
+			while(i > memory && search_at(needle, i) == search_at(hay, i + j))
+				i--;
+			if(i <= memory)
+				return j;
+			j += per;
+			memory = m - per - 1;
+		}
+	} else {
+		per = (ell + 1 > m - ell - 1 ? ell + 1 : m - ell - 1) + 1;
+		while(j <= n - m) {
+			ptrdiff_t i = ell + 1;
+			while(i < m && search_at(needle, i) == search_at(hay, i + j))
+				i++;
+			if(i < m) {
+				j += i - ell;
+				continue;
+			}
+			i = ell;
+			while(i >= 0 && search_at(needle, i) == search_at(hay, i + j))
+				i--;
+			if(i < 0)
+				return j;
+			j += per;
+		}
+	}
+	return SEARCH_NOT_FOUND;
+}
+
+#if !defined(NO_SIMD) && defined(__GNUC__) && (defined(__SSE2__) || defined(__AVX2__))
+	#define SIMD_SEARCH
+	#include <immintrin.h>
+	
+	#ifdef __AVX2__
+		#define SEARCH_BLOCK 32
+		typedef __m256i search_vec;
+		#define SEARCH_SPLAT(c) _mm256_set1_epi8((char) (c))
+		#define SEARCH_MATCHES(p, first, last, offset) \
+			(unsigned) _mm256_movemask_epi8(_mm256_and_si256( \
+				_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (p)), first), \
+				_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) ((p) + (offset))), last) \
+			))
+	#else
+		#define SEARCH_BLOCK 16
+		typedef __m128i search_vec;
+		#define SEARCH_SPLAT(c) _mm_set1_epi8((char) (c))
+		#define SEARCH_MATCHES(p, first, last, offset) \
+			(unsigned) _mm_movemask_epi8(_mm_and_si128( \
+				_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p)), first), \
+				_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) ((p) + (offset))), last) \
+			))
+	#endif
+#endif
+
+static bool search_matches_at(const struct search_str *hay, size_t at, const struct search_str *needle) {
+	const unsigned char *h = hay->reverse ? hay->str + (hay->len - at - needle->len) : hay->str + at;
+	return match_str((const char *) h, (const char *) h + needle->len, (const char *) needle->str, needle->len);
+}
+
+// Returns the position of the first match in hay (counted from the end if searching in reverse), or SEARCH_NOT_FOUND.
+static size_t search(const struct search_str *hay, const struct search_str *needle) {
+	size_t n = hay->len, m = needle->len;
+	if(m > n)
+		return SEARCH_NOT_FOUND;
+	if(m == 0)
+		return n == 0 ? SEARCH_NOT_FOUND : 0;
+	
+	size_t n_candidates = n - m + 1;
+	size_t at = 0;
+	
+	#ifdef SIMD_SEARCH
+	search_vec first = SEARCH_SPLAT(search_at(needle, 0));
+	search_vec last = SEARCH_SPLAT(search_at(needle, m - 1));
+	size_t verified = 0; // Number of bytes compared when verifying candidates
+	
+	for(; at + SEARCH_BLOCK <= n_candidates; at += SEARCH_BLOCK) {
+		// In reverse, the block covers positions at ... at + SEARCH_BLOCK - 1 counted from the end, so the highest bit is the first candidate
+		const unsigned char *block = hay->reverse ? hay->str + (n_candidates - at - SEARCH_BLOCK) : hay->str + at;
+		unsigned mask = hay->reverse ?
+			SEARCH_MATCHES(block, last, first, m - 1) : // The reversed needle starts with its last byte
+			SEARCH_MATCHES(block, first, last, m - 1);
+		
+		while(mask != 0) {
+			unsigned bit = hay->reverse ? (unsigned) (SEARCH_BLOCK - 1 - (31 - __builtin_clz(mask))) : (unsigned) __builtin_ctz(mask);
+			size_t candidate = at + bit;
+			if(search_matches_at(hay, candidate, needle))
+				return candidate;
+			
+			verified += m;
+			if(verified > 2 * candidate + 4096)
+				return two_way_search(hay, candidate, needle);
+			
+			if(hay->reverse)
+				mask &= ~(1u << (SEARCH_BLOCK - 1 - bit));
+			else
+				mask &= mask - 1;
+		}
+	}
+	#endif
 	
-	while(substr_len--) {
-		assert(str < str_end);
-		if(*str != *substr)
-			return false;
-		str++;
-		substr++;
+	if(n_candidates - at <= 64) { // Few enough positions left that checking them directly is faster than preparing Two-Way
+		unsigned char first_c = search_at(needle, 0);
+		for(; at < n_candidates; at++) {
+			if(search_at(hay, at) == first_c && search_matches_at(hay, at, needle))
+				return at;
+		}
+		return SEARCH_NOT_FOUND;
 	}
-	return true;
+	return two_way_search(hay, at, needle);
 }
 
 static const char *find_str(const char *str, const char *str_end, const char *substr, size_t substr_len) {
-	for(const char *c = str; c < str_end; c++) {
-		if(match_str(c, str_end, substr, substr_len))
-			return c;
-	}
-	return NULL;
+	struct search_str hay = { (const unsigned char *) str, str_end - str, false };
+	struct search_str needle = { (const unsigned char *) substr, substr_len, false };
+	size_t at = search(&hay, &needle);
+	return at == SEARCH_NOT_FOUND ? NULL : str + at;
 }
 
 static const char *find_str_right(const char *str, const char *str_end, const char *substr, size_t substr_len) {
-	for(const char *c = str_end - 1; c >= str; c--) {
-		if(match_str(c, str_end, substr, substr_len))
-			return c;
-	}
-	return NULL;
+	if(substr_len == 0) // The empty string is found at the last byte, not past the end
+		return str < str_end ? str_end - 1 : NULL;
+	struct search_str hay = { (const unsigned char *) str, str_end - str, true };
+	struct search_str needle = { (const unsigned char *) substr, substr_len, true };
+	size_t at = search(&hay, &needle);
+	return at == SEARCH_NOT_FOUND ? NULL : str_end - at - substr_len;
 }
 
 /*@@
@@ -1329,8 +1677,8 @@ static i_val beginswith_callback(const i_val *args, i_size n_args) {
 		TYPE_STR, "string"
 	);
 
-	i_val res = find_callback(args, n_args);
-	return BERYL_BOOL(beryl_val_cmp(res, BERYL_NUMBER(0)) == 0);
+	const char *str = beryl_get_raw_str(&args[0]);
+	return BERYL_BOOL(match_str(str, str + BERYL_LENOF(args[0]), beryl_get_raw_str(&args[1]), BERYL_LENOF(args[1])));
 }
 
 /*@@
@@ -1360,6 +1708,54 @@ static i_val find_right_callback(const i_val *args, i_size n_args) {
 	return BERYL_NUMBER(at - str);
 }
 
+/*@@
+	find-all
+	string substring
+	
+	Binary function.
+	Returns an array of the indices of every instance of *substring* in *string*, from left to right.
+	Instances do not overlap; searching continues after the end of each instance found, the same way split and str-replace find them.
+	Returns an error if *substring* is empty.
+	
+	Example:
+		find-all "a,b,,c" ","
+	Returns (1 3 4)
+@@*/
+static i_val find_all_callback(const i_val *args, i_size n_args) {
+	(void) n_args;
+
+	EXPECT_TYPE2(
+		TYPE_STR, "string",
+		TYPE_STR, "string"
+	);
+	
+	const char *str = beryl_get_raw_str(&args[0]);
+	const char *str_end = str + BERYL_LENOF(args[0]);
+	const char *substr = beryl_get_raw_str(&args[1]);
+	i_size substr_len = BERYL_LENOF(args[1]);
+	if(substr_len == 0) {
+		beryl_blame_arg(args[1]);
+		return BERYL_ERR("Cannot search for empty string");
+	}
+	
+	struct beryl_array_builder builder;
+	beryl_array_builder_init(&builder, 0);
+	
+	const char *at = str;
+	while( (at = find_str(at, str_end, substr, substr_len)) ) {
+		if(!beryl_array_builder_push(&builder, BERYL_NUMBER(at - str))) {
+			beryl_array_builder_discard(&builder);
+			return BERYL_ERR("Out of memory");
+		}
+		at += substr_len;
+	}
+	
+	i_val res = beryl_array_builder_finish(&builder);
+	if(BERYL_TYPEOF(res) == TYPE_NULL)
+		return BERYL_ERR("Out of memory");
+	return res;
+}
+
 /*@@
 	endswith
 	string substring
@@ -1379,11 +1775,9 @@ static i_val endswith_callback(const i_val *args, i_size n_args) {
 	const char *str_end = str + str_len;
 	
 	i_size substr_len = BERYL_LENOF(args[1]);
-	const char *at = find_str_right(str, str_end, beryl_get_raw_str(&args[1]), substr_len);
-	if(at == NULL)
+	if(substr_len > str_len)
 		return BERYL_FALSE;
-	
-	return BERYL_BOOL(str_end - substr_len == at);
+	return BERYL_BOOL(match_str(str_end - substr_len, str_end, beryl_get_raw_str(&args[1]), substr_len));
 }
 
 /*@@
@@ -1437,16 +1831,14 @@ static i_val substring_callback(const i_val *args, i_size n_args) {
 	i_size from = fi_f;
 	i_size to = ti_f;
 	
-	i_size substr_len = to - from;
 	if(to > BERYL_LENOF(args[0])) {
 		beryl_blame_arg(args[2]);
 		return BERYL_ERR("Substring end index (%0) is out of bounds");
 	}
 	
-	const char *from_str = beryl_get_raw_str(&args[0]);
-	assert(from_str + from + substr_len <= from_str + BERYL_LENOF(args[0]));
+	assert(from <= to && to <= BERYL_LENOF(args[0]));
 	
-	i_val substr = beryl_new_string(substr_len, from_str + from);
+	i_val substr = beryl_substring(args[0], from, to);
 	
 	if(BERYL_TYPEOF(substr) == TYPE_NULL)
 		return BERYL_ERR("Out of memory");
@@ -1489,16 +1881,6 @@ static void str_buff_free(struct str_buff *buff) {
 	buff->end = NULL;
 }
 
-/*
-static void mcpy(void *to, const void *from, size_t n) {
-	char *to_p = to;
-	const char *from_p = from;
-	while(n--) {
-		*(to_p++) = *(from_p++);
-	}
-}
-*/
-
 static bool str_buff_pushs(struct str_buff *buff, const char *str, size_t len) {
 	char *p = buff->top;
 	buff->top += len;
@@ -1518,7 +1900,7 @@ static bool str_buff_pushs(struct str_buff *buff, const char *str, size_t len) {
 		p = buff->str + blen;
 	}
 	
-	mcpy(p, str, len);
+	mem_copy(p, str, len);
 	return true;
 }
 
@@ -1548,39 +1930,30 @@ static i_val str_replace_callback(const i_val *args, i_size n_args) {
 	
 	const char *replace_with = beryl_get_raw_str(&args[2]);
 	i_size replace_with_len = BERYL_LENOF(args[2]);
-		
-	/*
-	if(BERYL_LENOF(replace) == BERYL_LENOF(replace_with) && beryl_get_refcount(str) == 1) {
 	
-	}*/
+	if(replace_len == 0) {
+		beryl_blame_arg(args[1]);
+		return BERYL_ERR("Cannot replace empty string");
+	}
+	
+	const char *at = find_str(str, str_end, replace, replace_len);
+	if(at == NULL)
+		return beryl_retain(args[0]);
+	
 	struct str_buff buff;
 	bool ok = str_buff_init(&buff);
 	if(!ok)
 		goto MEM_ERR;
 	
-	const char *start = NULL;
-	for(const char *c = str; c < str_end; c++) {
-		if(match_str(c, str_end, replace, replace_len)) {
-			if(start != NULL) {
-				bool ok = str_buff_pushs(&buff, start, c - start);
-				if(!ok)
-					goto MEM_ERR;	
-			}
-			bool ok = str_buff_pushs(&buff, replace_with, replace_with_len);
-			if(!ok)
-				goto MEM_ERR;
-			c += replace_len;
-			c--;
-			start = NULL;
-		} else if(start == NULL)
-			start = c;
-	}
-	
-	if(start != NULL) {
-		bool ok = str_buff_pushs(&buff, start, str_end - start);
-		if(!ok)
+	const char *c = str;
+	while(at != NULL) {
+		if(!str_buff_pushs(&buff, c, at - c) || !str_buff_pushs(&buff, replace_with, replace_with_len))
 			goto MEM_ERR;
+		c = at + replace_len;
+		at = find_str(c, str_end, replace, replace_len);
 	}
+	if(!str_buff_pushs(&buff, c, str_end - c))
+		goto MEM_ERR;
 	
 	size_t res_len = buff.top - buff.str;
 	if(res_len > I_SIZE_MAX) {
@@ -1600,463 +1973,3034 @@ static i_val str_replace_callback(const i_val *args, i_size n_args) {
 	return BERYL_ERR("Out of memory");
 }
 
-static bool c_is_digit(char c) {
-	return c >= '0' && c <= '9';
+// str-replace-all finds every pattern in one pass, using an Aho-Corasick automaton. This is a trie of the patterns, where every node also
+// has a fail link to the node for the longest proper suffix of its string that is in the trie. Nodes are numbered in breadth first order,
+// so the children of a node are consecutive (and sorted by byte); the root also has a full transition table.
+struct replace_node {
+	unsigned first_child, n_children;
+	unsigned fail;
+	unsigned depth;
+	unsigned match; // 1 + the index of the longest pattern that ends at this node (the node's own, or one found via the fail links), 0 if none
+};
+
+struct replacer {
+	struct replace_node *nodes;
+	unsigned char *node_bytes; // The byte leading to each node
+	unsigned root_next[256];
+	
+	i_size n_patterns;
+	i_size *pattern_lens;
+	i_val *replace_with;
+};
+
+static void free_replacer(struct replacer *r) {
+	if(r->replace_with != NULL)
+		beryl_release_values(r->replace_with, r->n_patterns);
+	beryl_free(r->replace_with);
+	beryl_free(r->pattern_lens);
+	beryl_free(r->node_bytes);
+	beryl_free(r->nodes);
+	beryl_free(r);
 }
 
-static int char_as_digit(char c) {
-	assert(c_is_digit(c));
-	return c - '0';
+static unsigned replacer_step(const struct replacer *r, unsigned node, unsigned char c) {
+	while(node != 0) {
+		const struct replace_node *n = &r->nodes[node];
+		for(unsigned i = n->first_child; i < n->first_child + n->n_children; i++) {
+			if(r->node_bytes[i] == c)
+				return i;
+		}
+		node = n->fail;
+	}
+	return r->root_next[c];
 }
 
-/*@@
-	parse-number
-	str
+struct trie_node {
+	unsigned child, sibling; // Children are kept in a list sorted by byte; 0 marks the end of the list
+	unsigned pattern;
+	unsigned char byte;
+};
 
-	Unary function.
-	Parses the string *str* as a number.
-	Skips any leading non-numeric characters.
-	Also skips any characters found after the number.
+static struct replacer *build_replacer(i_val table, i_val *err) {
+	i_size n_patterns = BERYL_LENOF(table);
+	size_t max_nodes = 1;
+	for(struct i_val_pair *p = NULL; (p = beryl_iter_table(table, p)); ) {
+		if(BERYL_TYPEOF(p->key) != TYPE_STR || BERYL_TYPEOF(p->val) != TYPE_STR) {
+			beryl_blame_arg(BERYL_TYPEOF(p->key) != TYPE_STR ? p->key : p->val);
+			*err = BERYL_ERR("Expected table of strings to replace with strings, got %0");
+			return NULL;
+		}
+		if(BERYL_LENOF(p->key) == 0) {
+			beryl_blame_arg(table);
+			*err = BERYL_ERR("Cannot replace empty string");
+			return NULL;
+		}
+		max_nodes += BERYL_LENOF(p->key);
+		if(max_nodes > UINT_MAX / 2) {
+			*err = BERYL_ERR("Too many patterns to replace");
+			return NULL;
+		}
+	}
 	
-	Example:
-		parse-number "   foo -12.5bar"
-	returns the number -12.5
-@@*/
-static i_val parse_number_callback(const i_val *args, i_size n_args) {
-	(void) n_args;
-
-	EXPECT_TYPE1(TYPE_STR, "string");
+	*err = BERYL_ERR("Out of memory");
+	struct replacer *r = beryl_alloc(sizeof(struct replacer));
+	if(r == NULL)
+		return NULL;
+	r->n_patterns = n_patterns;
+	r->pattern_lens = beryl_alloc(sizeof(i_size) * n_patterns);
+	r->replace_with = beryl_alloc(sizeof(i_val) * n_patterns);
+	r->nodes = beryl_alloc(sizeof(struct replace_node) * max_nodes);
+	r->node_bytes = beryl_alloc(max_nodes);
+	
+	struct trie_node *trie = beryl_alloc(sizeof(struct trie_node) * max_nodes);
+	unsigned *order = beryl_alloc(sizeof(unsigned) * max_nodes); // Trie nodes in breadth first order
+	if(r->pattern_lens == NULL || r->replace_with == NULL || r->nodes == NULL || r->node_bytes == NULL || trie == NULL || order == NULL) {
+		if(r->replace_with != NULL) {
+			beryl_free(r->replace_with);
+			r->replace_with = NULL;
+		}
+		goto FAIL;
+	}
+	
+	// Build the trie
+	unsigned n_nodes = 1;
+	trie[0] = (struct trie_node) { 0, 0, 0, 0 };
+	i_size pattern_i = 0;
+	for(struct i_val_pair *p = NULL; (p = beryl_iter_table(table, p)); pattern_i++) {
+		const unsigned char *pattern = (const unsigned char *) beryl_get_raw_str(&p->key);
+		i_size len = BERYL_LENOF(p->key);
+		r->pattern_lens[pattern_i] = len;
+		r->replace_with[pattern_i] = beryl_retain(p->val);
+		
+		unsigned node = 0;
+		for(i_size i = 0; i < len; i++) {
+			unsigned *link = &trie[node].child;
+			while(*link != 0 && trie[*link].byte < pattern[i])
+				link = &trie[*link].sibling;
+			if(*link == 0 || trie[*link].byte != pattern[i]) {
+				trie[n_nodes] = (struct trie_node) { .child = 0, .sibling = *link, .pattern = 0, .byte = pattern[i] };
+				*link = n_nodes++;
+			}
+			node = *link;
+		}
+		trie[node].pattern = pattern_i + 1;
+	}
+	
+	// Number the nodes in breadth first order
+	unsigned n_ordered = 1;
+	order[0] = 0;
+	r->nodes[0].depth = 0;
+	r->nodes[0].fail = 0;
+	r->node_bytes[0] = 0;
+	for(unsigned i = 0; i < n_ordered; i++) {
+		unsigned old = order[i];
+		struct replace_node *node = &r->nodes[i];
+		node->first_child = n_ordered;
+		node->match = trie[old].pattern;
+		for(unsigned c = trie[old].child; c != 0; c = trie[c].sibling) {
+			r->nodes[n_ordered].depth = node->depth + 1;
+			r->node_bytes[n_ordered] = trie[c].byte;
+			order[n_ordered++] = c;
+		}
+		node->n_children = n_ordered - node->first_child;
+	}
+	assert(n_ordered == n_nodes);
 	
-	const char *str = beryl_get_raw_str(&args[0]);
-	i_size len = BERYL_LENOF(args[0]);
-	const char *str_end = str + len;
+	for(unsigned c = 0; c < 256; c++)
+		r->root_next[c] = 0;
+	for(unsigned i = r->nodes[0].first_child; i < r->nodes[0].first_child + r->nodes[0].n_children; i++)
+		r->root_next[r->node_bytes[i]] = i;
 	
-	const char *c = str;
-	for(; c != str_end; c++) { //Skip all the leading non-number characters
-		if(c_is_digit(*c) || *c == '-')
-			break;
+	// Fail links and matches. Fail links always point to shallower nodes, which have already been handled
+	for(unsigned i = 0; i < n_nodes; i++) {
+		struct replace_node *node = &r->nodes[i];
+		if(i != 0 && node->match == 0)
+			node->match = r->nodes[node->fail].match;
+		for(unsigned c = node->first_child; c < node->first_child + node->n_children; c++)
+			r->nodes[c].fail = i == 0 ? 0 : replacer_step(r, node->fail, r->node_bytes[c]);
 	}
 	
-	i_float res = 0;
-	bool negative = false;
-	if(c != str_end && *c == '-') {
-		negative = true;
-		c++;
-	}
+	beryl_free(trie);
+	beryl_free(order);
+	return r;
 	
-	for(; c != str_end; c++) {
-		if(!c_is_digit(*c))
+	FAIL:
+	beryl_free(trie);
+	beryl_free(order);
+	free_replacer(r);
+	return NULL;
+}
+
+// Automatons are cached for the last few tables used. A cached table is retained, so it is never modified in place (and its address is never reused)
+#define REPLACE_CACHE_SIZE 4
+static struct replace_cache_entry {
+	i_val table;
+	struct replacer *replacer;
+} replace_cache[REPLACE_CACHE_SIZE];
+static int replace_cache_len = 0;
+
+static struct replacer *get_replacer(i_val table, i_val *err) {
+	int found = -1;
+	for(int i = 0; i < replace_cache_len; i++) {
+		i_val cached = replace_cache[i].table;
+		if(cached.val.table == table.val.table && BERYL_LENOF(cached) == BERYL_LENOF(table)) {
+			found = i;
 			break;
-		res *= 10;
-		res += char_as_digit(*c);
+		}
 	}
 	
-	if(c != str_end && *c == '.') {
-		c++;
-		i_float pow = 1;
-		for(; c != str_end; c++) {
-			if(!c_is_digit(*c))
-				break;
-			pow *= 0.1;
-			res += pow * char_as_digit(*c);
-		}
+	struct replace_cache_entry entry;
+	if(found != -1)
+		entry = replace_cache[found];
+	else {
+		entry.replacer = build_replacer(table, err);
+		if(entry.replacer == NULL)
+			return NULL;
+		entry.table = beryl_retain(table);
+		
+		if(replace_cache_len == REPLACE_CACHE_SIZE) {
+			struct replace_cache_entry *evicted = &replace_cache[REPLACE_CACHE_SIZE - 1];
+			beryl_release(evicted->table);
+			free_replacer(evicted->replacer);
+		} else
+			replace_cache_len++;
+		found = replace_cache_len - 1;
 	}
 	
-	return BERYL_NUMBER(negative ? -res : res);
-}
-
-size_t iilog10(size_t i) {
-	size_t n = 0;
-	while(i /= 10) //TODO: Optimize
-		n++;
-	return n;
+	// Move the entry to the front
+	for(int i = found; i > 0; i--)
+		replace_cache[i] = replace_cache[i - 1];
+	replace_cache[0] = entry;
+	return entry.replacer;
 }
 
-size_t iflog10(i_float f, i_float *opt_out) {
-	size_t n = 0;
-	while((f /= 10.0) > 1) //TODO: Optimize
-		n++;
+/*@@
+	str-replace-all
+	str table
+
+	Creates a copy of *str* where every instance of a key in *table* is replaced
+	with the corresponding value. The keys and values must all be strings, and the keys may not be empty.
+	Matches do not overlap; when several keys match, the one starting first is replaced, and of those the longest.
+	All keys are searched for at once, so the number of keys does not matter much. However, after a replacement the
+	search continues right after it, and text that was read while looking for a longer match is read again, so in the
+	worst case the time taken is the length of *str* times the length of the longest key.
+	The table's search structure is cached, so reusing the same table is faster than building a new one each time.
+	Returns an error if out of memory.
 	
-	if(opt_out != NULL)
-		*opt_out = f * 10;
+	Example:
+		str-replace-all "a < b & c" (table "<" "&lt;" "&" "&amp;")
+	returns "a &lt; b &amp; c"
+@@*/
+static i_val str_replace_all_callback(const i_val *args, i_size n_args) {
+	(void) n_args;
 	
-	return n;
-}
-
-static char int_as_digit(int i) {
-	assert(i >= 0 && i <= 9);
-	return '0' + i;
-}
+	EXPECT_TYPE2(
+		TYPE_STR, "string",
+		TYPE_TABLE, "table"
+	);
+	
+	if(BERYL_LENOF(args[1]) == 0)
+		return beryl_retain(args[0]);
+	
+	i_val err;
+	const struct replacer *r = get_replacer(args[1], &err);
+	if(r == NULL)
+		return err;
+	
+	const unsigned char *str = (const unsigned char *) beryl_get_raw_str(&args[0]);
+	size_t len = BERYL_LENOF(args[0]);
+	
+	struct str_buff buff = { NULL, NULL, NULL };
+	size_t copied = 0; // Everything before this has been written to buff
+	
+	// The best match found so far. It is replaced once no match starting at or before it can be found, which is when
+	// the string of the current node starts after it
+	bool has_match = false;
+	size_t match_start = 0, match_end = 0;
+	unsigned match = 0;
+	
+	unsigned node = 0;
+	size_t i = 0;
+	for(;;) {
+		if(node == 0) {
+			assert(!has_match);
+			while(i < len && r->root_next[str[i]] == 0)
+				i++;
+		}
+		
+		if(i < len) {
+			node = replacer_step(r, node, str[i]);
+			i++;
+			
+			unsigned node_match = r->nodes[node].match;
+			if(node_match != 0) {
+				size_t start = i - r->pattern_lens[node_match - 1];
+				if(!has_match || start < match_start || (start == match_start && i > match_end)) {
+					has_match = true;
+					match_start = start;
+					match_end = i;
+					match = node_match;
+				}
+			}
+		}
+		
+		if(has_match && (i == len || i - r->nodes[node].depth > match_start)) {
+			if(buff.str == NULL && !str_buff_init(&buff))
+				goto MEM_ERR;
+			const i_val *with = &r->replace_with[match - 1];
+			if(!str_buff_pushs(&buff, (const char *) str + copied, match_start - copied) || !str_buff_pushs(&buff, beryl_get_raw_str(with), BERYL_LENOF(*with)))
+				goto MEM_ERR;
+			
+			// Continue after the match; this searches the part of the string after it again, which at most is the length of the longest key
+			copied = match_end;
+			i = match_end;
+			node = 0;
+			has_match = false;
+		} else if(i == len)
+			break;
+	}
+	
+	if(buff.str == NULL)
+		return beryl_retain(args[0]);
+	if(!str_buff_pushs(&buff, (const char *) str + copied, len - copied))
+		goto MEM_ERR;
+	
+	size_t res_len = buff.top - buff.str;
+	if(res_len > I_SIZE_MAX) {
+		str_buff_free(&buff);
+		return BERYL_ERR("Resulting string would be too large");
+	}
+	
+	i_val res = beryl_new_string(res_len, buff.str);
+	if(BERYL_TYPEOF(res) == TYPE_NULL)
+		goto MEM_ERR;
+	
+	str_buff_free(&buff);
+	return res;
+	
+	MEM_ERR:
+	str_buff_free(&buff);
+	return BERYL_ERR("Out of memory");
+}
+
+// Compiled regular expressions. Patterns given as strings are compiled once, and kept in a small cache with the most recently used first
+struct regex_object {
+	struct beryl_object obj;
+	struct regex *re;
+};
+
+static void regex_object_free(struct beryl_object *obj) {
+	regex_free(((struct regex_object *) obj)->re);
+}
+
+static i_val regex_object_call(struct beryl_object *obj, const i_val *args, i_size n_args);
+
+static struct beryl_object_class regex_class = {
+	regex_object_free,
+	regex_object_call,
+	sizeof(struct regex_object),
+	"regex",
+	sizeof("regex") - 1
+};
+
+static i_val compile_regex(i_val pattern) {
+	i_val err;
+	struct regex *re = regex_compile(beryl_get_raw_str(&pattern), BERYL_LENOF(pattern), &err);
+	if(re == NULL) {
+		beryl_blame_arg(pattern);
+		return err;
+	}
+	
+	i_val res = beryl_new_object(&regex_class);
+	if(BERYL_TYPEOF(res) == TYPE_NULL) {
+		regex_free(re);
+		return BERYL_ERR("Out of memory");
+	}
+	((struct regex_object *) beryl_as_object(res))->re = re;
+	return res;
+}
+
+#define REGEX_CACHE_SIZE 16
+static struct regex_cache_entry {
+	i_val pattern;
+	i_val regex;
+} regex_cache[REGEX_CACHE_SIZE];
+static int regex_cache_len = 0;
+
+// Returns the compiled regex for a pattern string or regex object (not retained), or null and an error in *err
+static struct regex *get_regex(i_val pattern, i_val *err) {
+	if(beryl_object_class_type(pattern) == &regex_class)
+		return ((struct regex_object *) beryl_as_object(pattern))->re;
+	if(BERYL_TYPEOF(pattern) != TYPE_STR) {
+		beryl_blame_arg(pattern);
+		*err = BERYL_ERR("Expected string or regex as regular expression, got %0");
+		return NULL;
+	}
+	
+	const char *str = beryl_get_raw_str(&pattern);
+	i_size len = BERYL_LENOF(pattern);
+	int found = -1;
+	for(int i = 0; i < regex_cache_len; i++) {
+		i_val cached = regex_cache[i].pattern;
+		if(BERYL_LENOF(cached) == len && mem_equal(beryl_get_raw_str(&cached), str, len)) {
+			found = i;
+			break;
+		}
+	}
+	
+	struct regex_cache_entry entry;
+	if(found != -1)
+		entry = regex_cache[found];
+	else {
+		entry.regex = compile_regex(pattern);
+		if(BERYL_TYPEOF(entry.regex) == TYPE_ERR) {
+			*err = entry.regex;
+			return NULL;
+		}
+		entry.pattern = beryl_retain(pattern);
+		
+		if(regex_cache_len == REGEX_CACHE_SIZE) {
+			beryl_release(regex_cache[REGEX_CACHE_SIZE - 1].pattern);
+			beryl_release(regex_cache[REGEX_CACHE_SIZE - 1].regex);
+		} else
+			regex_cache_len++;
+		found = regex_cache_len - 1;
+	}
+	
+	for(int i = found; i > 0; i--)
+		regex_cache[i] = regex_cache[i - 1];
+	regex_cache[0] = entry;
+	return ((struct regex_object *) beryl_as_object(entry.regex))->re;
+}
+
+#define REGEX_MAX_GROUPS 16 // Including the whole match
+
+// An array of the matched string followed by each capture group; groups that did not take part in the match are null
+static i_val regex_match_array(struct regex *re, const char *str, const size_t *groups) {
+	size_t n = regex_n_groups(re) + 1;
+	if(n > REGEX_MAX_GROUPS)
+		n = REGEX_MAX_GROUPS;
+	
+	struct beryl_array_builder builder;
+	if(!beryl_array_builder_init(&builder, n))
+		return BERYL_ERR("Out of memory");
+	for(size_t i = 0; i < n; i++) {
+		i_val group = BERYL_NULL;
+		if(groups[i * 2] != REGEX_NO_MATCH) {
+			group = beryl_new_string(groups[i * 2 + 1] - groups[i * 2], str + groups[i * 2]);
+			if(BERYL_TYPEOF(group) == TYPE_NULL)
+				goto MEM_ERR;
+		}
+		if(!beryl_array_builder_push(&builder, group))
+			goto MEM_ERR;
+	}
+	
+	i_val res = beryl_array_builder_finish(&builder);
+	if(BERYL_TYPEOF(res) == TYPE_NULL)
+		return BERYL_ERR("Out of memory");
+	return res;
+	
+	MEM_ERR:
+	beryl_array_builder_discard(&builder);
+	return BERYL_ERR("Out of memory");
+}
+
+static i_val regex_match(struct regex *re, i_val str) {
+	if(BERYL_TYPEOF(str) != TYPE_STR) {
+		beryl_blame_arg(str);
+		return BERYL_ERR("Expected string to match against, got %0");
+	}
+	
+	size_t groups[REGEX_MAX_GROUPS * 2];
+	int found = regex_search(re, beryl_get_raw_str(&str), BERYL_LENOF(str), 0, groups, REGEX_MAX_GROUPS);
+	if(found == -1)
+		return BERYL_ERR("Out of memory");
+	if(found == 1)
+		return regex_match_array(re, beryl_get_raw_str(&str), groups);
+	
+	i_val res = beryl_new_array(0, NULL, 0, false);
+	if(BERYL_TYPEOF(res) == TYPE_NULL)
+		return BERYL_ERR("Out of memory");
+	return res;
+}
+
+static i_val regex_object_call(struct beryl_object *obj, const i_val *args, i_size n_args) {
+	if(n_args != 1)
+		return BERYL_ERR("A regex takes one argument, the string to match");
+	return regex_match(((struct regex_object *) obj)->re, args[0]);
+}
+
+// Where to search for the next match after a match. An empty match is skipped past, so that searching always makes progress
+static size_t regex_next_from(const size_t *groups) {
+	return groups[1] == groups[0] ? groups[1] + 1 : groups[1];
+}
+
+/*@@
+	regex
+	expr str
+
+	Binary function.
+	Matches the string *str* against the regular expression *expr* and returns an array.
+	The first index of the array is the matched string, the rest of the array contains the strings
+	captured as capture groups (if any), or null for groups that did not take part in the match.
+	Returns an empty array if the expression is not matched.
+	*expr* may be a string or a regex created with regex-compile. Expressions given as strings are compiled once
+	and cached, so reusing the same few expressions does not compile them again.
+	
+	Matching takes time proportional to the length of *str* (times the size of the expression), whatever the expression is,
+	and works the same on every platform. The syntax is that of POSIX extended regular expressions, with some common additions:
+	. matches any byte, [abc], [^a-z] and [[:alpha:]] match a set of bytes, and \d, \w and \s match digits, word characters and whitespace
+	(\D, \W and \S match anything else). ^ and $ match the start and end of the string. (x) is a capture group, and (?:x) a group that is not captured.
+	x|y matches x, or else y. x*, x+, x?, x{n}, x{n,} and x{n,m} repeat x as many times as possible; followed by ? they repeat it as few
+	times as possible. The first alternative or repetition count that leads to a match is the one used, as in Perl.
+	\n, \t, \r, \f, \v and \xHH are escapes for bytes, and \ followed by punctuation matches that character.
+	
+	May return an error on out of memory or if the expression is invalid.
+@@*/
+static i_val regex_callback(const i_val *args, i_size n_args) {
+	(void) n_args;
+	
+	i_val err;
+	struct regex *re = get_regex(args[0], &err);
+	if(re == NULL)
+		return err;
+	return regex_match(re, args[1]);
+}
+
+/*@@
+	regex-compile
+	expr
+
+	Unary function.
+	Compiles the regular expression *expr* (see regex) into a regex, which can be used in place of the expression string by regex, regex-find-all,
+	regex-split and regex-replace. A regex can also be called with a string, which is the same as calling regex with it.
+	Returns an error if the expression is invalid.
+@@*/
+static i_val regex_compile_callback(const i_val *args, i_size n_args) {
+	(void) n_args;
+	
+	EXPECT_TYPE1(
+		TYPE_STR, "string"
+	);
+	return compile_regex(args[0]);
+}
+
+enum regex_iter_mode { REGEX_FIND_ALL, REGEX_SPLIT };
+
+static i_val regex_iter(const i_val *args, enum regex_iter_mode mode) {
+	i_val err;
+	struct regex *re = get_regex(args[0], &err);
+	if(re == NULL)
+		return err;
+	if(BERYL_TYPEOF(args[1]) != TYPE_STR) {
+		beryl_blame_arg(args[1]);
+		return BERYL_ERR("Expected string as second argument, got '%0'");
+	}
+	
+	const char *str = beryl_get_raw_str(&args[1]);
+	size_t len = BERYL_LENOF(args[1]);
+	
+	struct beryl_array_builder builder;
+	beryl_array_builder_init(&builder, 0);
+	
+	size_t groups[2];
+	size_t from = 0, piece_start = 0;
+	int found;
+	while((found = regex_search(re, str, len, from, groups, 1)) == 1) {
+		from = regex_next_from(groups);
+		
+		i_val item;
+		if(mode == REGEX_FIND_ALL)
+			item = beryl_new_string(groups[1] - groups[0], str + groups[0]);
+		else if(groups[0] == groups[1] && (groups[0] == 0 || groups[0] == len)) // Empty matches at the ends do not split anything
+			continue;
+		else {
+			item = beryl_new_string(groups[0] - piece_start, str + piece_start);
+			piece_start = groups[1];
+		}
+		if(BERYL_TYPEOF(item) == TYPE_NULL || !beryl_array_builder_push(&builder, item))
+			goto MEM_ERR;
+	}
+	if(found == -1)
+		goto MEM_ERR;
+	
+	if(mode == REGEX_SPLIT) {
+		i_val item = beryl_new_string(len - piece_start, str + piece_start);
+		if(BERYL_TYPEOF(item) == TYPE_NULL || !beryl_array_builder_push(&builder, item))
+			goto MEM_ERR;
+	}
+	
+	i_val res = beryl_array_builder_finish(&builder);
+	if(BERYL_TYPEOF(res) == TYPE_NULL)
+		return BERYL_ERR("Out of memory");
+	return res;
+	
+	MEM_ERR:
+	beryl_array_builder_discard(&builder);
+	return BERYL_ERR("Out of memory");
+}
+
+/*@@
+	regex-find-all
+	expr str
+
+	Binary function.
+	Returns an array of every match of the regular expression *expr* (see regex) in *str*, from left to right. Matches do not overlap.
+	*expr* may be a string or a regex created with regex-compile.
+	May return an error on out of memory or if the expression is invalid.
+	
+	Example:
+		regex-find-all "[0-9]+" "a1 b22 c333"
+	returns the array ("1" "22" "333")
+@@*/
+static i_val regex_find_all_callback(const i_val *args, i_size n_args) {
+	(void) n_args;
+	return regex_iter(args, REGEX_FIND_ALL);
+}
+
+/*@@
+	regex-split
+	expr str
+
+	Binary function.
+	Splits *str* at every match of the regular expression *expr* (see regex), and returns an array of the parts between the matches.
+	*expr* may be a string or a regex created with regex-compile.
+	May return an error on out of memory or if the expression is invalid.
+	
+	Example:
+		regex-split ", *" "a,b,  c"
+	returns the array ("a" "b" "c")
+@@*/
+static i_val regex_split_callback(const i_val *args, i_size n_args) {
+	(void) n_args;
+	return regex_iter(args, REGEX_SPLIT);
+}
+
+/*@@
+	regex-replace
+	expr str with
+
+	Ternary function.
+	Returns a copy of *str* where every match of the regular expression *expr* (see regex) is replaced. If *with* is a string, matches are replaced with it.
+	Otherwise *with* is called for each match with an array of the matched string and its capture groups (as returned by regex), and the match
+	is replaced with the returned value, converted to a string.
+	*expr* may be a string or a regex created with regex-compile.
+	May return an error on out of memory, if the expression is invalid, or if *with* returns an error.
+	
+	Example:
+		regex-replace "[0-9]+" "a1 b22" with m do cat "<" (m 0) ">" end
+	returns "a<1> b<22>"
+@@*/
+static i_val regex_replace_callback(const i_val *args, i_size n_args) {
+	(void) n_args;
+	
+	i_val err;
+	struct regex *re = get_regex(args[0], &err);
+	if(re == NULL)
+		return err;
+	EXPECT_TYPE_I(1, TYPE_STR, "string", "second");
+	
+	const char *str = beryl_get_raw_str(&args[1]);
+	size_t len = BERYL_LENOF(args[1]);
+	i_val with = args[2];
+	
+	struct str_buff buff = { NULL, NULL, NULL };
+	err = BERYL_ERR("Out of memory");
+	
+	size_t groups[REGEX_MAX_GROUPS * 2];
+	size_t n_groups = BERYL_TYPEOF(with) == TYPE_STR ? 1 : REGEX_MAX_GROUPS;
+	size_t from = 0, copied = 0;
+	int found;
+	while((found = regex_search(re, str, len, from, groups, n_groups)) == 1) {
+		from = regex_next_from(groups);
+		if(buff.str == NULL && !str_buff_init(&buff))
+			goto ERR;
+		if(!str_buff_pushs(&buff, str + copied, groups[0] - copied))
+			goto ERR;
+		copied = groups[1];
+		
+		if(BERYL_TYPEOF(with) == TYPE_STR) {
+			if(!str_buff_pushs(&buff, beryl_get_raw_str(&with), BERYL_LENOF(with)))
+				goto ERR;
+			continue;
+		}
+		
+		i_val match = regex_match_array(re, str, groups);
+		if(BERYL_TYPEOF(match) == TYPE_ERR)
+			goto ERR;
+		i_val res = beryl_call(with, &match, 1, true);
+		beryl_release(match);
+		if(BERYL_TYPEOF(res) == TYPE_ERR) {
+			err = res;
+			goto ERR;
+		}
+		i_val replacement = i_val_as_string(res);
+		beryl_release(res);
+		if(BERYL_TYPEOF(replacement) == TYPE_ERR) {
+			err = replacement;
+			goto ERR;
+		}
+		bool ok = str_buff_pushs(&buff, beryl_get_raw_str(&replacement), BERYL_LENOF(replacement));
+		beryl_release(replacement);
+		if(!ok)
+			goto ERR;
+	}
+	if(found == -1)
+		goto ERR;
+	
+	if(buff.str == NULL)
+		return beryl_retain(args[1]);
+	if(!str_buff_pushs(&buff, str + copied, len - copied))
+		goto ERR;
+	
+	size_t res_len = buff.top - buff.str;
+	if(res_len > I_SIZE_MAX) {
+		str_buff_free(&buff);
+		return BERYL_ERR("Resulting string would be too large");
+	}
+	i_val res = beryl_new_string(res_len, buff.str);
+	str_buff_free(&buff);
+	if(BERYL_TYPEOF(res) == TYPE_NULL)
+		return BERYL_ERR("Out of memory");
+	return res;
+	
+	ERR:
+	str_buff_free(&buff);
+	return err;
+}
+
+#define UTF8_INDEX_MIN_LEN 4096 // Shorter strings are just scanned
+#define UTF8_INDEX_STRIDE 256 // Codepoints between each offset stored in an index
+#define UTF8_INDEX_CACHE_SIZE 8
+
+// A valid UTF-8 string. Large managed strings get an index of the byte offset of every UTF8_INDEX_STRIDE'th codepoint,
+// so that finding a codepoint only needs to scan from the closest indexed one
+struct utf8_str {
+	const char *str;
+	i_size len, n_chars;
+	const i_size *index;
+};
+
+// The strings are retained, so their contents cannot change (nor can their memory be reused) while they are cached
+static struct utf8_index_cache_entry {
+	i_val str;
+	i_size n_chars;
+	i_size *index;
+} utf8_index_cache[UTF8_INDEX_CACHE_SIZE];
+static int utf8_index_cache_len = 0;
+
+static i_size *build_utf8_index(const char *str, i_size len, i_size n_chars) {
+	size_t n = n_chars / UTF8_INDEX_STRIDE + 1;
+	i_size *index = beryl_alloc(sizeof(i_size) * n);
+	if(index == NULL)
+		return NULL;
+	
+	size_t offset = 0;
+	index[0] = 0;
+	for(size_t i = 1; i < n; i++) {
+		offset += utf8_advance(str + offset, len - offset, UTF8_INDEX_STRIDE);
+		index[i] = offset;
+	}
+	return index;
+}
+
+static bool get_utf8_str(i_val str, struct utf8_str *res, i_val *err) {
+	res->str = beryl_get_raw_str(&str);
+	res->len = BERYL_LENOF(str);
+	res->index = NULL;
+	
+	bool indexed = str.managed && res->len >= UTF8_INDEX_MIN_LEN;
+	if(indexed) {
+		for(int i = 0; i < utf8_index_cache_len; i++) {
+			i_val cached = utf8_index_cache[i].str;
+			if(beryl_get_raw_str(&cached) == res->str && BERYL_LENOF(cached) == res->len) {
+				struct utf8_index_cache_entry entry = utf8_index_cache[i];
+				for(int j = i; j > 0; j--)
+					utf8_index_cache[j] = utf8_index_cache[j - 1];
+				utf8_index_cache[0] = entry;
+				
+				res->n_chars = entry.n_chars;
+				res->index = entry.index;
+				return true;
+			}
+		}
+	}
+	
+	if(utf8_validate(res->str, res->len) != res->len) {
+		beryl_blame_arg(str);
+		*err = BERYL_ERR("Expected valid UTF-8 string, got '%0'");
+		return false;
+	}
+	res->n_chars = utf8_count(res->str, res->len);
+	
+	if(indexed) {
+		i_size *index = build_utf8_index(res->str, res->len, res->n_chars);
+		if(index == NULL)
+			return true; // Scanning the whole string still works
+		
+		if(utf8_index_cache_len == UTF8_INDEX_CACHE_SIZE) {
+			beryl_release(utf8_index_cache[UTF8_INDEX_CACHE_SIZE - 1].str);
+			beryl_free(utf8_index_cache[UTF8_INDEX_CACHE_SIZE - 1].index);
+		} else
+			utf8_index_cache_len++;
+		for(int i = utf8_index_cache_len - 1; i > 0; i--)
+			utf8_index_cache[i] = utf8_index_cache[i - 1];
+		utf8_index_cache[0] = (struct utf8_index_cache_entry) { beryl_retain(str), res->n_chars, index };
+		res->index = index;
+	}
+	return true;
+}
+
+// The byte offset of codepoint n, which must be at most the number of codepoints
+static i_size utf8_str_offset(const struct utf8_str *str, i_size n) {
+	i_size base = 0;
+	if(str->index != NULL) {
+		base = str->index[n / UTF8_INDEX_STRIDE];
+		n %= UTF8_INDEX_STRIDE;
+	}
+	return base + utf8_advance(str->str + base, str->len - base, n);
+}
+
+/*@@
+	utf8-valid?
+	string
+	
+	Unary function.
+	Returns true if *string* is valid UTF-8, otherwise false.
+@@*/
+static i_val utf8_valid_callback(const i_val *args, i_size n_args) {
+	(void) n_args;
+	EXPECT_TYPE1(
+		TYPE_STR, "string"
+	);
+	
+	i_size len = BERYL_LENOF(args[0]);
+	return BERYL_BOOL(utf8_validate(beryl_get_raw_str(&args[0]), len) == len);
+}
+
+/*@@
+	utf8-length
+	string
+	
+	Unary function.
+	Returns the number of codepoints in *string*, which must be valid UTF-8.
+	Unlike sizeof, which counts bytes.
+@@*/
+static i_val utf8_length_callback(const i_val *args, i_size n_args) {
+	(void) n_args;
+	EXPECT_TYPE1(
+		TYPE_STR, "string"
+	);
+	
+	struct utf8_str str;
+	i_val err;
+	if(!get_utf8_str(args[0], &str, &err))
+		return err;
+	return BERYL_NUMBER(str.n_chars);
+}
+
+/*@@
+	utf8-substring
+	string from to
+	
+	Like substring, except that *string* must be valid UTF-8, and the indicies
+	*from* and *to* count codepoints instead of bytes.
+	Large strings remember where some of their codepoints are, so that
+	repeatedly taking substrings of the same large string does not have to scan it from the beginning each time.
+	
+	Returns an error if out of memory or if any of the indicies are out of bounds.
+@@*/
+static i_val utf8_substring_callback(const i_val *args, i_size n_args) {
+	(void) n_args;
+	
+	EXPECT_TYPE3(
+		TYPE_STR, "string",
+		TYPE_NUMBER, "number",
+		TYPE_NUMBER, "number"
+	);
+	
+	if(!beryl_is_integer(args[1])) {
+		beryl_blame_arg(args[1]);
+		return BERYL_ERR("Expected starting index as integer, got '%0'");
+	}
+	
+	if(!beryl_is_integer(args[2])) {
+		beryl_blame_arg(args[2]);
+		return BERYL_ERR("Expected ending index as integer, got '%0'");
+	}
+	
+	i_float fi_f = beryl_as_num(args[1]);
+	i_float ti_f = beryl_as_num(args[2]);
+	
+	if(fi_f > ti_f) {
+		beryl_blame_arg(args[1]);
+		beryl_blame_arg(args[2]);
+		return BERYL_ERR("Start index (%0) for substring is larger than end index (%1)");
+	}
+	
+	if(fi_f < 0) {
+		beryl_blame_arg(args[1]);
+		return BERYL_ERR("Substring start index (%0) is out of bounds");
+	}
+	
+	struct utf8_str str;
+	i_val err;
+	if(!get_utf8_str(args[0], &str, &err))
+		return err;
+	
+	if(ti_f > str.n_chars) {
+		beryl_blame_arg(args[2]);
+		return BERYL_ERR("Substring end index (%0) is out of bounds");
+	}
+	
+	i_size from = utf8_str_offset(&str, fi_f);
+	i_size to = utf8_str_offset(&str, ti_f);
+	
+	i_val substr = beryl_substring(args[0], from, to);
+	if(BERYL_TYPEOF(substr) == TYPE_NULL)
+		return BERYL_ERR("Out of memory");
+	return substr;
+}
+
+/*@@
+	utf8-chars
+	string
+	
+	Unary function.
+	Returns an array of strings, one for each codepoint in *string*, which must be valid UTF-8.
+	
+	Example:
+		utf8-chars "hé!"
+	returns the array ("h" "é" "!")
+@@*/
+static i_val utf8_chars_callback(const i_val *args, i_size n_args) {
+	(void) n_args;
+	EXPECT_TYPE1(
+		TYPE_STR, "string"
+	);
+	
+	struct utf8_str str;
+	i_val err;
+	if(!get_utf8_str(args[0], &str, &err))
+		return err;
+	
+	struct beryl_array_builder builder;
+	if(!beryl_array_builder_init(&builder, str.n_chars))
+		return BERYL_ERR("Out of memory");
+	
+	for(i_size i = 0; i < str.len;) {
+		i_size char_len = utf8_char_len(str.str[i]);
+		i_val c = beryl_new_string(char_len, str.str + i);
+		if(BERYL_TYPEOF(c) == TYPE_NULL || !beryl_array_builder_push(&builder, c)) {
+			beryl_array_builder_discard(&builder);
+			return BERYL_ERR("Out of memory");
+		}
+		i += char_len;
+	}
+	
+	i_val res = beryl_array_builder_finish(&builder);
+	if(BERYL_TYPEOF(res) == TYPE_NULL)
+		return BERYL_ERR("Out of memory");
+	return res;
+}
+
+void beryl_core_lib_clear_caches() {
+	for(int i = 0; i < replace_cache_len; i++) {
+		beryl_release(replace_cache[i].table);
+		free_replacer(replace_cache[i].replacer);
+	}
+	replace_cache_len = 0;
+	
+	for(int i = 0; i < regex_cache_len; i++) {
+		beryl_release(regex_cache[i].pattern);
+		beryl_release(regex_cache[i].regex);
+	}
+	regex_cache_len = 0;
+	
+	for(int i = 0; i < utf8_index_cache_len; i++) {
+		beryl_release(utf8_index_cache[i].str);
+		beryl_free(utf8_index_cache[i].index);
+	}
+	utf8_index_cache_len = 0;
+}
+
+static bool c_is_digit(char c) {
+	return c >= '0' && c <= '9';
+}
+
+/*@@
+	parse-number
+	str
+
+	Unary function.
+	Parses the string *str* as a number.
+	Skips any leading non-numeric characters.
+	Also skips any characters found after the number.
+	The number may have an exponent (as in 1.5e-3), and is rounded to the closest representable number.
+	
+	Example:
+		parse-number "   foo -12.5bar"
+	returns the number -12.5
+@@*/
+static i_val parse_number_callback(const i_val *args, i_size n_args) {
+	(void) n_args;
+
+	EXPECT_TYPE1(TYPE_STR, "string");
+	
+	const char *str = beryl_get_raw_str(&args[0]);
+	i_size len = BERYL_LENOF(args[0]);
+	const char *str_end = str + len;
+	
+	const char *c = str;
+	for(; c != str_end; c++) { //Skip all the leading non-number characters
+		if(c_is_digit(*c) || *c == '-')
+			break;
+	}
+	
+	i_float res = 0;
+	bool negative = false;
+	if(c != str_end && *c == '-') {
+		negative = true;
+		c++;
+	}
+	num_parse(c, str_end - c, false, &res);
+	
+	return BERYL_NUMBER(negative ? -res : res);
+}
+
+static i_val num_to_str(i_float num) {
+	char buff[NUM_STR_MAX];
+	size_t len = num_format(num, buff);
+	return beryl_new_string(len, buff);
+}
+
+i_val i_val_as_string(i_val val) {
+	switch(BERYL_TYPEOF(val)) {
+		
+		case TYPE_NUMBER: {
+			i_val res = num_to_str(beryl_as_num(val));
+			if(BERYL_TYPEOF(res) == TYPE_NULL)
+				return BERYL_ERR("Out of memory");
+			return res;
+		}
+		
+		case TYPE_FN:
+		case TYPE_EXT_FN:
+			return BERYL_CONST_STR("Function");
+		case TYPE_ARRAY:
+			return BERYL_CONST_STR("Array"); //TODO: Implement array->string conversion
+		case TYPE_TAG:
+			return BERYL_CONST_STR("Tag");
+		case TYPE_NULL:
+			return BERYL_CONST_STR("Null");
+		case TYPE_STR:
+			return beryl_retain(val);
+		case TYPE_TABLE:
+			return BERYL_CONST_STR("Table");
+		default:
+			return BERYL_CONST_STR("Unkown");
+	}
+}
+
+/*@@
+	as-string
+	val
+
+	Unary function.
+	Coerces *val* into a string.
+@@*/
+static i_val as_string_callback(const i_val *args, i_size n_args) {
+	(void) n_args;
+
+	return i_val_as_string(args[0]);
+}
+
+/*@@
+	format
+	fstr ... args
+	
+	Returns a new string where every field in *fstr*, written as {ref} or {ref:spec}, is replaced by an argument.
+	{{ and }} stand for { and }.
+	
+	*ref* is either empty, for the argument after the one used by the previous field (or the first one),
+	an index such as 0 or 2 to pick an argument by position,
+	or a name, to use that field of the table given as the first argument.
+	
+	*spec* is [[fill]align][+][0][width][.precision][type], where every part is optional:
+		align      < to pad on the right, > to pad on the left, ^ to center (numbers are padded on the left by default, everything else on the right)
+		fill       The character to pad with (a space by default)
+		+          Put a + in front of numbers that are not negative
+		0          Pad numbers with zeros after the sign, if no align is given
+		width      The minimum number of bytes to pad to
+		precision  The number of digits after the decimal point for numbers, or the maximum number of bytes to use of anything else
+		           (fewer if that would split a UTF-8 character)
+		type       d for integers, x or X for hexadecimal integers, o for octal, b for binary, f for fixed point (6 decimals by default),
+		           or s to format numbers as any other value
+	
+	Numbers are otherwise formatted like as-string, and non-string values by the name of their type.
+	The string is measured before it is written, so only the result is allocated.
+	Returns an error if a field is invalid, refers to an argument that does not exist, or if out of memory.
+	
+	Example:
+		format "{name:>6}: {1:.2f} ({1:x})" (struct :name "disk") 255
+	returns "  disk: 255.00 (ff)"
+@@*/
+static i_val format_callback(const i_val *args, i_size n_args) {
+	if(BERYL_TYPEOF(args[0]) != TYPE_STR) {
+		beryl_blame_arg(args[0]);
+		return BERYL_ERR("Expected string as first argument for 'format', got '%0'");
+	}
+	
+	i_val res = beryl_format(beryl_get_raw_str(&args[0]), BERYL_LENOF(args[0]), args + 1, n_args - 1);
+	if(BERYL_TYPEOF(res) == TYPE_ERR)
+		beryl_blame_arg(args[0]);
+	return res;
+}
+
+struct string_builder {
+	struct beryl_object obj;
+	struct str_buff buff;
+};
+
+static void string_builder_free(struct beryl_object *obj);
+
+static struct beryl_object_class string_builder_class = {
+	string_builder_free,
+	NULL,
+	sizeof(struct string_builder),
+	"string builder",
+	sizeof("string builder") - 1
+};
+
+static struct string_builder *as_string_builder(i_val val) {
+	if(beryl_object_class_type(val) != &string_builder_class)
+		return NULL;
+	return (struct string_builder *) beryl_as_object(val);
+}
+
+static void string_builder_free(struct beryl_object *obj) {
+	str_buff_free(&((struct string_builder *) obj)->buff);
+}
+
+static i_val string_builder_append(struct string_builder *sb, const i_val *vals, i_size n) {
+	for(i_size i = 0; i < n; i++) {
+		i_val str = i_val_as_string(vals[i]);
+		if(BERYL_TYPEOF(str) == TYPE_ERR)
+			return str;
+		bool ok = str_buff_pushs(&sb->buff, beryl_get_raw_str(&str), BERYL_LENOF(str));
+		beryl_release(str);
+		if(!ok)
+			return BERYL_ERR("Out of memory");
+	}
+	return BERYL_NULL;
+}
+
+/*@@
+	string-builder
+	... values
+
+	Variadic function.
+	Creates a new string builder, containing *values* converted to strings (the same way as cat converts them).
+	More values can be added to the end of a builder with sb-append, in amortized constant time per byte, and build returns the string built so far.
+	Unlike most values, string builders are modified in place; all references to a builder see the same builder.
+	
+	Example:
+		let sb = string-builder "a"
+		for 0 3 with i do
+			sb-append sb "," i
+		end
+		build sb
+	Returns "a,0,1,2"
+@@*/
+static i_val string_builder_callback(const i_val *args, i_size n_args) {
+	i_val res = beryl_new_object(&string_builder_class);
+	if(BERYL_TYPEOF(res) == TYPE_NULL)
+		return BERYL_ERR("Out of memory");
+	
+	struct string_builder *sb = as_string_builder(res);
+	if(!str_buff_init(&sb->buff)) {
+		beryl_release(res);
+		return BERYL_ERR("Out of memory");
+	}
+	
+	i_val err = string_builder_append(sb, args, n_args);
+	if(BERYL_TYPEOF(err) == TYPE_ERR) {
+		beryl_release(res);
+		return err;
+	}
+	return res;
+}
+
+/*@@
+	sb-append
+	builder ... values
+
+	Variadic function taking at least one argument.
+	Converts each of *values* to a string, and adds them to the end of the string builder *builder*.
+@@*/
+static i_val sb_append_callback(const i_val *args, i_size n_args) {
+	struct string_builder *sb = as_string_builder(args[0]);
+	if(sb == NULL) {
+		beryl_blame_arg(args[0]);
+		return BERYL_ERR("Expected string builder as first argument for 'sb-append', got '%0'");
+	}
+	return string_builder_append(sb, args + 1, n_args - 1);
+}
+
+/*@@
+	build
+	builder
+
+	Returns the string built by the string builder *builder*, copied into a single new string. The builder itself is left unchanged.
+@@*/
+static i_val build_callback(const i_val *args, i_size n_args) {
+	(void) n_args;
+	struct string_builder *sb = as_string_builder(args[0]);
+	if(sb == NULL) {
+		beryl_blame_arg(args[0]);
+		return BERYL_ERR("Expected string builder as argument for 'build', got '%0'");
+	}
+	
+	size_t len = sb->buff.top - sb->buff.str;
+	if(len > I_SIZE_MAX)
+		return BERYL_ERR("Resulting string would be too large");
+	i_val res = beryl_new_string(len, sb->buff.str);
+	if(BERYL_TYPEOF(res) == TYPE_NULL)
+		return BERYL_ERR("Out of memory");
+	return res;
+}
+
+/*@@
+	round
+	number
+
+	Rounds the number to the nearest integer.
+	Rounds away from zero. (0.5 is rounded to 1, -0.5 is rounded to -1)
+@@*/
+static i_val round_callback(const i_val *args, i_size n_args) {
+	(void) n_args;
+
+	EXPECT_TYPE1(TYPE_NUMBER, "number");
+	
+	i_float num = beryl_as_num(args[0]);
+	
+	bool negative = num < 0;
+	if(negative)
+		num = -num;
+	
+	if(num > BERYL_NUM_MAX_INT)
+		return beryl_retain(args[0]);
+	
+	large_uint_type i = (large_uint_type) (num + 0.5);
+	i_float res = i;
+	if(negative)
+		res = -res;
+	
+	return BERYL_NUMBER(res);
+}
+
+/*@@
+	is-int
+	val
+
+	Returns true if *val* is an integer number, false otherwise.
+@@*/
+static i_val is_int_callback(const i_val *args, i_size n_args) {
+	(void) n_args;
+
+	return BERYL_BOOL(beryl_is_integer(args[0]));
+}
+
+static i_val pipe_callback(const i_val *args, i_size n_args) { // DOESN'T USE AUTORELEASE
+	(void) n_args;
+
+	i_val res = beryl_call(args[1], &args[0], 1, false);
+	return res;
+}
+
+static i_val error_callback(const i_val *args, i_size n_args) {
+	if(BERYL_TYPEOF(args[0]) != TYPE_STR) {
+		beryl_blame_arg(args[0]);
+		return BERYL_ERR("Expected string error message as argument for 'error', got '%0'");
+	}
+	for(i_size i = 1; i < n_args; i++)
+		beryl_blame_arg(args[i]);	
+	return beryl_str_as_err(args[0]);
+}
+
+static i_size bt_parent(i_size i) {
+	assert(i != 0);
+	return (i - 1) / 2;
+}
+
+static i_size bt_left_child(i_size i) {
+	return i * 2 + 1;
+}
+
+static i_size bt_right_child(i_size i) {
+	return i * 2 + 2;
+}
+
+static bool is_inside_heap(i_size i, i_size len) {
+	return i < len;
+}
+
+// All of the sorting functions order values by state->less, which may be a user defined function.
+// They must stay memory safe even if less is inconsistent (or has failed and always returns false), so all loops are bounds checked.
+struct sort_state {
+	bool (*less)(struct sort_state *state, i_val a, i_val b);
+	const i_val *keys; // Used by sort-by, where the sorted values are indices into keys
+	i_val fn; // Used by sort-with
+	struct priority_queue *pq; // Used by the priority queue functions
+	
+	bool failed;
+	i_val err;
+};
+
+static void sort_fail(struct sort_state *state, i_val err) {
+	if(!state->failed) {
+		state->failed = true;
+		state->err = err;
+	} else
+		beryl_release(err);
+}
+
+static bool less_generic(struct sort_state *state, i_val a, i_val b) {
+	int res = beryl_val_cmp(a, b);
+	if(res == 2) {
+		if(!state->failed) {
+			beryl_blame_arg(a);
+			beryl_blame_arg(b);
+		}
+		sort_fail(state, BERYL_ERR("Cannot compare values '%0' and '%1'"));
+		return false;
+	}
+	return res == 1;
+}
+
+static bool less_numbers(struct sort_state *state, i_val a, i_val b) {
+	(void) state;
+	return beryl_as_num(a) < beryl_as_num(b);
+}
+
+static bool less_strings(struct sort_state *state, i_val a, i_val b) { // Same ordering as beryl_val_cmp
+	(void) state;
+	const char *s_a = beryl_get_raw_str(&a);
+	const char *s_b = beryl_get_raw_str(&b);
+	i_size l_a = BERYL_LENOF(a), l_b = BERYL_LENOF(b);
+	
+	i_size minl = l_a < l_b ? l_a : l_b;
+	for(i_size i = 0; i < minl; i++) {
+		if(s_a[i] != s_b[i])
+			return s_a[i] < s_b[i];
+	}
+	return l_a < l_b;
+}
+
+static i_size as_index(i_val index) {
+	return (i_size) beryl_as_num(index);
+}
+
+static bool less_generic_keys(struct sort_state *state, i_val a, i_val b) {
+	return less_generic(state, state->keys[as_index(a)], state->keys[as_index(b)]);
+}
+
+static bool less_number_keys(struct sort_state *state, i_val a, i_val b) {
+	return beryl_as_num(state->keys[as_index(a)]) < beryl_as_num(state->keys[as_index(b)]);
+}
+
+static bool less_string_keys(struct sort_state *state, i_val a, i_val b) {
+	return less_strings(state, state->keys[as_index(a)], state->keys[as_index(b)]);
+}
+
+static bool less_fn(struct sort_state *state, i_val a, i_val b) {
+	if(state->failed)
+		return false;
+	
+	i_val args[] = { a, b };
+	i_val res = beryl_call(state->fn, args, 2, true);
+	if(BERYL_TYPEOF(res) == TYPE_BOOL)
+		return beryl_as_bool(res);
+	
+	if(BERYL_TYPEOF(res) != TYPE_ERR) {
+		beryl_blame_arg(res);
+		beryl_release(res);
+		res = BERYL_ERR("Expected comparison function to return boolean, got '%0'");
+	}
+	sort_fail(state, res);
+	return false;
+}
+
+// Picks a specialized comparison when every value is a number, or every value is a string
+static bool (*pick_less(const i_val *values, i_size len, bool keys))(struct sort_state *, i_val, i_val) {
+	if(len == 0)
+		return keys ? less_generic_keys : less_generic;
+	
+	unsigned char type = BERYL_TYPEOF(values[0]);
+	if(type != TYPE_NUMBER && type != TYPE_STR)
+		return keys ? less_generic_keys : less_generic;
+	
+	for(i_size i = 1; i < len; i++) {
+		if(BERYL_TYPEOF(values[i]) != type)
+			return keys ? less_generic_keys : less_generic;
+	}
+	
+	if(type == TYPE_NUMBER)
+		return keys ? less_number_keys : less_numbers;
+	return keys ? less_string_keys : less_strings;
+}
+
+static void swap_vals(i_val *a, i_val *b) {
+	i_val tmp = *a;
+	*a = *b;
+	*b = tmp;
+}
+
+// Returns the index that the value at *at* ends up at
+static i_size make_heap(struct sort_state *state, i_val *array, i_size at, i_size len) {
+	START:
+	assert(at < len);
+	
+	i_val top = array[at];
+	i_size left_i = bt_left_child(at);
+	i_size right_i = bt_right_child(at);
+	
+	if(!is_inside_heap(left_i, len)) { //If the index has no children
+		assert(!is_inside_heap(right_i, len));
+		return at;
+	}
+	
+	i_val left = array[left_i];
+	
+	if(!is_inside_heap(right_i, len)) { //If it only has one child
+		if(state->less(state, top, left)) { //If the left node is larger
+			array[at] = left;
+			array[left_i] = top;
+			
+			at = left_i;
+			goto START; //Essentially tail recursion
+		} else
+			return at; //If it only has one child, and that child is less or equal then nothing needs to be done
+	}
+	
+	//If it has two children
+	assert(is_inside_heap(right_i, len));
+	i_val right = array[right_i];
+	
+	i_size largest_i = state->less(state, left, right) ? right_i : left_i;
+	if(state->less(state, top, array[largest_i])) {
+		array[at] = array[largest_i];
+		array[largest_i] = top;
+		
+		at = largest_i;
+		goto START;
+	}
+	
+	return at;
+}
+
+static void heap_sort(struct sort_state *state, i_val *array, i_size len) {
+	if(len < 2)
+		return;
+	
+	for(i_size i = bt_parent(len - 1); true; i--) {
+		make_heap(state, array, i, len); //Make heap makes a heap at the index i, assuming that all children of i are already heaps
+		if(i == 0)
+			break;
+	}
+	
+	for(i_size heap_len = len; heap_len > 1; heap_len--) {
+		i_size leaf_i = heap_len - 1;
+		swap_vals(&array[0], &array[leaf_i]); //Swap the leaf and the top
+		
+		//Fix the heap now that we've swapped the leaf and the top, but don't include the former leaf (i.e reduce the len by 1)
+		make_heap(state, array, 0, heap_len - 1);
+	}
+}
+
+static void insertion_sort(struct sort_state *state, i_val *begin, i_val *end) {
+	if(begin == end)
+		return;
+	
+	for(i_val *cur = begin + 1; cur < end; cur++) {
+		i_val *sift = cur;
+		if(state->less(state, *sift, sift[-1])) {
+			i_val tmp = *sift;
+			do {
+				*sift = sift[-1];
+				sift--;
+			} while(sift != begin && state->less(state, tmp, sift[-1]));
+			*sift = tmp;
+		}
+	}
+}
+
+// Pattern-defeating quicksort (Orson Peters); quicksort that detects sorted runs and adversarial inputs, and falls back to heap sort if needed
+
+#define INSERTION_SORT_THRESHOLD 24
+#define NINTHER_THRESHOLD 128
+#define PARTIAL_INSERTION_SORT_LIMIT 8
+
+// Like insertion sort, but gives up (and returns false) after moving more than PARTIAL_INSERTION_SORT_LIMIT elements
+static bool partial_insertion_sort(struct sort_state *state, i_val *begin, i_val *end) {
+	if(begin == end)
+		return true;
+	
+	i_size limit = 0;
+	for(i_val *cur = begin + 1; cur < end; cur++) {
+		if(limit > PARTIAL_INSERTION_SORT_LIMIT)
+			return false;
+		
+		i_val *sift = cur;
+		if(state->less(state, *sift, sift[-1])) {
+			i_val tmp = *sift;
+			do {
+				*sift = sift[-1];
+				sift--;
+			} while(sift != begin && state->less(state, tmp, sift[-1]));
+			*sift = tmp;
+			limit += cur - sift;
+		}
+	}
+	return true;
+}
+
+static void sort2(struct sort_state *state, i_val *a, i_val *b) {
+	if(state->less(state, *b, *a))
+		swap_vals(a, b);
+}
+
+static void sort3(struct sort_state *state, i_val *a, i_val *b, i_val *c) {
+	sort2(state, a, b);
+	sort2(state, b, c);
+	sort2(state, a, b);
+}
+
+// Partitions [begin, end) around the pivot *begin, with elements equal to the pivot going to the right. Returns the final position of the pivot.
+static i_val *partition_right(struct sort_state *state, i_val *begin, i_val *end, bool *already_partitioned) {
+	i_val pivot = *begin;
+	i_val *first = begin;
+	i_val *last = end;
+	
+	do first++; while(first < end - 1 && state->less(state, *first, pivot));
+	
+	if(first - 1 == begin) {
+		while(first < last && !state->less(state, *--last, pivot)) ;
+	} else {
+		do last--; while(last > begin && !state->less(state, *last, pivot));
+	}
+	
+	*already_partitioned = first >= last;
+	
+	while(first < last) {
+		swap_vals(first, last);
+		do first++; while(first < end - 1 && state->less(state, *first, pivot));
+		do last--; while(last > begin && !state->less(state, *last, pivot));
+	}
+	
+	i_val *pivot_pos = first - 1;
+	*begin = *pivot_pos;
+	*pivot_pos = pivot;
+	return pivot_pos;
+}
+
+// Partitions [begin, end) around the pivot *begin, with elements equal to the pivot going to the left. Used when there are many equal elements.
+static i_val *partition_left(struct sort_state *state, i_val *begin, i_val *end) {
+	i_val pivot = *begin;
+	i_val *first = begin;
+	i_val *last = end;
+	
+	do last--; while(last > begin && state->less(state, pivot, *last));
+	
+	if(last + 1 == end) {
+		while(first < last && !state->less(state, pivot, *++first)) ;
+	} else {
+		do first++; while(first < end - 1 && !state->less(state, pivot, *first));
+	}
+	
+	while(first < last) {
+		swap_vals(first, last);
+		do last--; while(last > begin && state->less(state, pivot, *last));
+		do first++; while(first < end - 1 && !state->less(state, pivot, *first));
+	}
+	
+	i_val *pivot_pos = last;
+	*begin = *pivot_pos;
+	*pivot_pos = pivot;
+	return pivot_pos;
+}
+
+static void pdq_sort_loop(struct sort_state *state, i_val *begin, i_val *end, int bad_allowed, bool leftmost) {
+	while(true) {
+		i_size size = end - begin;
+		if(size < INSERTION_SORT_THRESHOLD) {
+			insertion_sort(state, begin, end);
+			return;
+		}
+		
+		// Choose the pivot as the median of 3 (or the pseudo-median of 9 for larger partitions), and move it to *begin
+		i_size half = size / 2;
+		if(size > NINTHER_THRESHOLD) {
+			sort3(state, begin, begin + half, end - 1);
+			sort3(state, begin + 1, begin + (half - 1), end - 2);
+			sort3(state, begin + 2, begin + (half + 1), end - 3);
+			sort3(state, begin + (half - 1), begin + half, begin + (half + 1));
+			swap_vals(begin, begin + half);
+		} else
+			sort3(state, begin + half, begin, end - 1);
+		
+		// If the pivot is equal to the element before this partition, then every element in the partition is at least as large as the pivot
+		// so all elements equal to it can be put in place at once
+		if(!leftmost && !state->less(state, begin[-1], *begin)) {
+			begin = partition_left(state, begin, end) + 1;
+			continue;
+		}
+		
+		bool already_partitioned;
+		i_val *pivot_pos = partition_right(state, begin, end, &already_partitioned);
+		
+		i_size l_size = pivot_pos - begin;
+		i_size r_size = end - (pivot_pos + 1);
+		bool highly_unbalanced = l_size < size / 8 || r_size < size / 8;
+		
+		if(highly_unbalanced) {
+			if(--bad_allowed == 0) {
+				heap_sort(state, begin, size);
+				return;
+			}
+			
+			// Shuffle some elements around to break up patterns that cause bad pivots
+			if(l_size >= INSERTION_SORT_THRESHOLD) {
+				swap_vals(begin, begin + l_size / 4);
+				swap_vals(pivot_pos - 1, pivot_pos - l_size / 4);
+				if(l_size > NINTHER_THRESHOLD) {
+					swap_vals(begin + 1, begin + (l_size / 4 + 1));
+					swap_vals(begin + 2, begin + (l_size / 4 + 2));
+					swap_vals(pivot_pos - 2, pivot_pos - (l_size / 4 + 1));
+					swap_vals(pivot_pos - 3, pivot_pos - (l_size / 4 + 2));
+				}
+			}
+			if(r_size >= INSERTION_SORT_THRESHOLD) {
+				swap_vals(pivot_pos + 1, pivot_pos + (1 + r_size / 4));
+				swap_vals(end - 1, end - r_size / 4);
+				if(r_size > NINTHER_THRESHOLD) {
+					swap_vals(pivot_pos + 2, pivot_pos + (2 + r_size / 4));
+					swap_vals(pivot_pos + 3, pivot_pos + (3 + r_size / 4));
+					swap_vals(end - 2, end - (1 + r_size / 4));
+					swap_vals(end - 3, end - (2 + r_size / 4));
+				}
+			}
+		} else if(already_partitioned) {
+			// The partition was already in order, so the input is possibly (nearly) sorted
+			if(partial_insertion_sort(state, begin, pivot_pos) && partial_insertion_sort(state, pivot_pos + 1, end))
+				return;
+		}
+		
+		// Recurse into the smaller partition, and loop on the larger one, so that the stack depth stays logarithmic
+		if(l_size < r_size) {
+			pdq_sort_loop(state, begin, pivot_pos, bad_allowed, leftmost);
+			begin = pivot_pos + 1;
+			leftmost = false;
+		} else {
+			pdq_sort_loop(state, pivot_pos + 1, end, bad_allowed, false);
+			end = pivot_pos;
+		}
+	}
+}
+
+static void pdq_sort(struct sort_state *state, i_val *array, i_size len) {
+	int log2_len = 0;
+	for(i_size l = len; l > 1; l /= 2)
+		log2_len++;
+	pdq_sort_loop(state, array, array + len, log2_len + 1, true);
+}
+
+// Stable merge sort; buffer must have room for at least len / 2 + 1 values
+static void merge_sort(struct sort_state *state, i_val *array, i_size len, i_val *buffer) {
+	if(len < INSERTION_SORT_THRESHOLD) {
+		insertion_sort(state, array, array + len);
+		return;
+	}
+	
+	i_size mid = len / 2;
+	merge_sort(state, array, mid, buffer);
+	merge_sort(state, array + mid, len - mid, buffer);
+	
+	if(!state->less(state, array[mid], array[mid - 1])) // Both halves are already in order
+		return;
+	
+	mem_copy(buffer, array, sizeof(i_val) * mid);
+	
+	i_size left = 0, right = mid, to = 0;
+	while(left < mid && right < len) {
+		if(state->less(state, array[right], buffer[left]))
+			array[to++] = array[right++];
+		else
+			array[to++] = buffer[left++];
+	}
+	while(left < mid)
+		array[to++] = buffer[left++];
+}
+
+// Radix sorts, used instead of comparison sorting for large arrays of only numbers or only strings. Both are stable.
+
+#define RADIX_SORT_THRESHOLD 256
+
+static large_uint_type number_radix_key(i_val num) { // Maps a number to an unsigned integer with the same ordering
+	union {
+		i_float f;
+		large_uint_type u;
+	} bits;
+	bits.f = beryl_as_num(num);
+	if(bits.f == 0)
+		bits.f = 0; // -0 and 0 compare equal, so they must have the same key
+	
+	large_uint_type sign_bit = ((large_uint_type) 1) << (sizeof(large_uint_type) * CHAR_BIT - 1);
+	if(bits.u & sign_bit)
+		return ~bits.u; // Negative numbers are ordered reversed, and before positive numbers
+	return bits.u | sign_bit;
+}
+
+// LSD radix sort, one byte at a time; buffer must have room for len values
+static void radix_sort_numbers(i_val *array, i_size len, i_val *buffer) {
+	#define N_KEY_BYTES sizeof(large_uint_type)
+	i_size counts[N_KEY_BYTES][256] = { { 0 } };
+	
+	for(i_size i = 0; i < len; i++) {
+		large_uint_type key = number_radix_key(array[i]);
+		for(size_t b = 0; b < N_KEY_BYTES; b++)
+			counts[b][(key >> (b * 8)) & 0xFF]++;
+	}
+	
+	i_val *from = array, *to = buffer;
+	for(size_t b = 0; b < N_KEY_BYTES; b++) {
+		i_size *count = counts[b];
+		if(count[(number_radix_key(from[0]) >> (b * 8)) & 0xFF] == len) // Every key has the same value for this byte
+			continue;
+		
+		i_size offset = 0;
+		for(size_t i = 0; i < 256; i++) {
+			i_size c = count[i];
+			count[i] = offset;
+			offset += c;
+		}
+		
+		for(i_size i = 0; i < len; i++) {
+			large_uint_type key = number_radix_key(from[i]);
+			to[count[(key >> (b * 8)) & 0xFF]++] = from[i];
+		}
+		
+		i_val *tmp = from;
+		from = to;
+		to = tmp;
+	}
+	
+	if(from != array)
+		mem_copy(array, from, sizeof(i_val) * len);
+	#undef N_KEY_BYTES
+}
+
+static unsigned string_radix_byte(i_val str, i_size at) { // 0 if str ends before at, otherwise 1 + the byte, ordered like beryl_val_cmp orders chars
+	if(at >= BERYL_LENOF(str))
+		return 0;
+	unsigned char c = beryl_get_raw_str(&str)[at];
+	if(CHAR_MIN < 0)
+		c ^= 0x80; // Chars are signed, so bytes 0x80-0xFF come first
+	return c + 1;
+}
+
+#define STRING_RADIX_MIN_BUCKET 32
+#define STRING_RADIX_MAX_DEPTH 64
+
+// MSD radix sort; every string in array has the same first depth bytes. buffer must have room for len values
+static void radix_sort_strings(struct sort_state *state, i_val *array, i_size len, i_val *buffer, i_size depth) {
+	if(len < STRING_RADIX_MIN_BUCKET) {
+		insertion_sort(state, array, array + len);
+		return;
+	}
+	if(depth == STRING_RADIX_MAX_DEPTH) { // Avoids deep recursion on long common prefixes
+		merge_sort(state, array, len, buffer);
+		return;
+	}
+	
+	i_size counts[257] = { 0 };
+	for(i_size i = 0; i < len; i++)
+		counts[string_radix_byte(array[i], depth)]++;
+	
+	i_size starts[257];
+	i_size offset = 0;
+	for(size_t i = 0; i < 257; i++) {
+		starts[i] = offset;
+		offset += counts[i];
+	}
+	
+	for(i_size i = 0; i < len; i++)
+		buffer[starts[string_radix_byte(array[i], depth)]++] = array[i];
+	mem_copy(array, buffer, sizeof(i_val) * len);
+	
+	// Bucket 0 holds strings that have ended, which are all equal
+	i_size bucket_start = counts[0];
+	for(size_t i = 1; i < 257; i++) {
+		if(counts[i] > 1)
+			radix_sort_strings(state, array + bucket_start, counts[i], buffer, depth + 1);
+		bucket_start += counts[i];
+	}
+}
+
+static bool try_radix_sort(struct sort_state *state, i_val *array, i_size len) {
+	bool numbers = state->less == less_numbers && sizeof(i_float) == sizeof(large_uint_type);
+	bool strings = state->less == less_strings;
+	if(len < RADIX_SORT_THRESHOLD || !(numbers || strings))
+		return false;
+	
+	i_val *buffer = beryl_alloc(sizeof(i_val) * len);
+	if(buffer == NULL)
+		return false;
+	
+	if(numbers)
+		radix_sort_numbers(array, len, buffer);
+	else
+		radix_sort_strings(state, array, len, buffer, 0);
+	
+	beryl_free(buffer);
+	return true;
+}
+
+// Parallel merge sort: the array is split into one chunk per thread, the chunks are sorted, and then merged pairwise.
+// Each merge is itself split into pieces (by binary searching for where each piece's output starts), so that every round uses all threads.
+// This is only done for comparisons that never touch interpreter state, i.e numbers and strings.
+
+#define PARALLEL_SORT_THRESHOLD 65536
+
+struct parallel_sort {
+	struct sort_state *state;
+	i_val *array, *buffer;
+	i_size len, chunk_len;
+	
+	const i_val *from; // Source and destination of the current merge round
+	i_val *to;
+	i_size run_len, pieces;
+};
+
+static bool can_sort_in_parallel(struct sort_state *state) {
+	return state->less == less_numbers || state->less == less_strings || state->less == less_number_keys || state->less == less_string_keys;
+}
+
+static void parallel_sort_chunk(void *data, size_t i) {
+	struct parallel_sort *sort = data;
+	i_size start = i * sort->chunk_len;
+	i_size len = sort->len - start < sort->chunk_len ? sort->len - start : sort->chunk_len;
+	
+	i_val *array = sort->array + start, *buffer = sort->buffer + start;
+	if(sort->state->less == less_numbers && sizeof(i_float) == sizeof(large_uint_type))
+		radix_sort_numbers(array, len, buffer);
+	else if(sort->state->less == less_strings)
+		radix_sort_strings(sort->state, array, len, buffer, 0);
+	else
+		merge_sort(sort->state, array, len, buffer);
+}
+
+// Returns how many of the first n values of the merge of a and b come from a; values in a come before equal values in b
+static i_size merge_split(struct sort_state *state, const i_val *a, i_size a_len, const i_val *b, i_size b_len, i_size n) {
+	i_size lo = n > b_len ? n - b_len : 0;
+	i_size hi = n < a_len ? n : a_len;
+	while(lo < hi) {
+		i_size i = lo + (hi - lo) / 2;
+		i_size j = n - i;
+		if(j > 0 && !state->less(state, b[j - 1], a[i]))
+			lo = i + 1;
+		else
+			hi = i;
+	}
+	return lo;
+}
+
+static void parallel_merge_piece(void *data, size_t task) {
+	struct parallel_sort *sort = data;
+	struct sort_state *state = sort->state;
+	i_size pair = task / sort->pieces, piece = task % sort->pieces;
+	
+	i_size start = pair * sort->run_len * 2;
+	i_size mid = sort->len - start < sort->run_len ? sort->len : start + sort->run_len;
+	i_size end = sort->len - mid < sort->run_len ? sort->len : mid + sort->run_len;
+	
+	const i_val *a = sort->from + start, *b = sort->from + mid;
+	i_size a_len = mid - start, b_len = end - mid;
+	i_size out_len = end - start;
+	
+	i_size out_from = (i_size) ((size_t) out_len * piece / sort->pieces);
+	i_size out_to = (i_size) ((size_t) out_len * (piece + 1) / sort->pieces);
+	
+	i_size a_i = merge_split(state, a, a_len, b, b_len, out_from), b_i = out_from - a_i;
+	i_size a_end = merge_split(state, a, a_len, b, b_len, out_to), b_end = out_to - a_end;
+	
+	i_val *to = sort->to + start + out_from;
+	while(a_i < a_end && b_i < b_end) {
+		if(state->less(state, b[b_i], a[a_i]))
+			*(to++) = b[b_i++];
+		else
+			*(to++) = a[a_i++];
+	}
+	while(a_i < a_end)
+		*(to++) = a[a_i++];
+	while(b_i < b_end)
+		*(to++) = b[b_i++];
+}
+
+static void parallel_copy_chunk(void *data, size_t i) {
+	struct parallel_sort *sort = data;
+	i_size start = i * sort->chunk_len;
+	i_size end = sort->len - start < sort->chunk_len ? sort->len : start + sort->chunk_len;
+	for(i_size j = start; j < end; j++)
+		sort->array[j] = sort->buffer[j];
+}
+
+static bool try_parallel_sort(struct sort_state *state, i_val *array, i_size len) {
+	unsigned n_threads = beryl_get_threads();
+	if(n_threads < 2 || len < PARALLEL_SORT_THRESHOLD || !can_sort_in_parallel(state))
+		return false;
+	
+	i_val *buffer = beryl_alloc(sizeof(i_val) * len);
+	if(buffer == NULL)
+		return false;
+	
+	struct parallel_sort sort = { .state = state, .array = array, .buffer = buffer, .len = len };
+	sort.chunk_len = len / n_threads + (len % n_threads != 0);
+	i_size n_chunks = len / sort.chunk_len + (len % sort.chunk_len != 0);
+	beryl_run_parallel(parallel_sort_chunk, &sort, n_chunks);
+	
+	sort.from = array;
+	sort.to = buffer;
+	for(sort.run_len = sort.chunk_len; sort.run_len < len; sort.run_len *= 2) {
+		i_size pairs = (len - 1) / (sort.run_len * 2) + 1;
+		sort.pieces = pairs >= n_threads ? 1 : n_threads / pairs;
+		beryl_run_parallel(parallel_merge_piece, &sort, (size_t) pairs * sort.pieces);
+		
+		const i_val *tmp = sort.from;
+		sort.from = sort.to;
+		sort.to = (i_val *) tmp;
+		
+		if(sort.run_len > I_SIZE_MAX / 2)
+			break;
+	}
+	
+	if(sort.from != array)
+		beryl_run_parallel(parallel_copy_chunk, &sort, n_chunks);
+	
+	beryl_free(buffer);
+	return true;
+}
+
+static i_val sort_array(struct sort_state *state, i_val *array, i_size len, bool stable) { //Returns BERYL_NULL on sucess, an error otherwise
+	if(try_parallel_sort(state, array, len))
+		return BERYL_NULL;
+	if(try_radix_sort(state, array, len))
+		return BERYL_NULL;
+	
+	if(stable) {
+		i_val *buffer = beryl_alloc(sizeof(i_val) * (len / 2 + 1));
+		if(buffer == NULL)
+			return BERYL_ERR("Out of memory");
+		merge_sort(state, array, len, buffer);
+		beryl_free(buffer);
+	} else
+		pdq_sort(state, array, len);
+	
+	if(state->failed) // If an comparison error occured somewhere when sorting
+		return state->err;
+	
+	return BERYL_NULL;
+}
+
+static i_val sort_copy(i_val array, struct sort_state *state, bool stable) {
+	if(BERYL_TYPEOF(array) != TYPE_ARRAY) {
+		beryl_blame_arg(array);
+		return BERYL_ERR("Can only sort arrays");
+	}
+	
+	i_val array_to_sort;
+	i_size len = BERYL_LENOF(array);
+	if(beryl_get_refcount(array) == 1) {
+		array_to_sort = beryl_retain(array);
+	} else {
+		array_to_sort = beryl_new_array(len, beryl_get_raw_array(array), len, false); //Creates a copy of the array
+	}
+	if(BERYL_TYPEOF(array_to_sort) == TYPE_NULL)
+		return BERYL_ERR("Out of memory");
+	
+	i_val *items = (i_val *) beryl_get_raw_array(array_to_sort);
+	if(state->less == NULL)
+		state->less = pick_less(items, len, false);
+	
+	i_val err = sort_array(state, items, len, stable);
+	if(BERYL_TYPEOF(err) == TYPE_ERR) {
+		beryl_release(array_to_sort);
+		return err;
+	}
+	
+	return array_to_sort;
+}
+
+/*@@
+	sort
+	array
+
+	Returns a sorted copy of *array*.
+	The sort is not stable; see sort-stable.
+	May return an error if any of the values inside array are not comparable, or if out of memory. 
+@@*/
+static i_val sort_callback(const i_val *args, i_size n_args) {
+	(void) n_args;
+	struct sort_state state = { .less = NULL };
+	return sort_copy(args[0], &state, false);
+}
+
+/*@@
+	sort-stable
+	array
+
+	Like sort, but values that compare as equal keep their relative order.
+@@*/
+static i_val sort_stable_callback(const i_val *args, i_size n_args) {
+	(void) n_args;
+	struct sort_state state = { .less = NULL };
+	return sort_copy(args[0], &state, true);
+}
+
+/*@@
+	sort-with
+	array less-fn
+
+	Returns a copy of *array* sorted according to *less-fn*, which is called with two values from *array* and should return
+	true if the first value should be placed before the second one, and false otherwise.
+	The sort is stable.
+	
+	Example:
+		sort-with (array 1 3 2) with a b do a > b end
+	Returns the array (3 2 1)
+@@*/
+static i_val sort_with_callback(const i_val *args, i_size n_args) {
+	(void) n_args;
+	struct sort_state state = { .less = less_fn, .fn = args[1] };
+	return sort_copy(args[0], &state, true);
+}
+
+/*@@
+	sort-by
+	array key-fn
+
+	Returns a copy of *array* sorted by the keys returned by *key-fn*, which is called exactly once for every value in *array*.
+	The sort is stable.
+	May return an error if any of the keys are not comparable, or if out of memory.
+	
+	Example:
+		sort-by (array "ccc" "a" "bb") sizeof
+	Returns the array ("a" "bb" "ccc")
+@@*/
+static i_val sort_by_callback(const i_val *args, i_size n_args) {
+	(void) n_args;
+	if(BERYL_TYPEOF(args[0]) != TYPE_ARRAY) {
+		beryl_blame_arg(args[0]);
+		return BERYL_ERR("Can only sort arrays");
+	}
+	
+	i_size len = BERYL_LENOF(args[0]);
+	const i_val *items = beryl_get_raw_array(args[0]);
+	
+	// Decorate-sort-undecorate; the keys are computed once, and an array of indices into them is sorted
+	i_val *keys = beryl_alloc(sizeof(i_val) * len);
+	if(keys == NULL && len != 0)
+		return BERYL_ERR("Out of memory");
+	
+	i_val res = BERYL_NULL;
+	i_size n_keys = 0;
+	for(; n_keys < len; n_keys++) {
+		i_val key = beryl_call(args[1], &items[n_keys], 1, true);
+		if(BERYL_TYPEOF(key) == TYPE_ERR) {
+			res = key;
+			goto EXIT;
+		}
+		keys[n_keys] = key;
+	}
+	
+	i_val indices = beryl_new_array(len, NULL, len, false);
+	if(BERYL_TYPEOF(indices) == TYPE_NULL) {
+		res = BERYL_ERR("Out of memory");
+		goto EXIT;
+	}
+	i_val *index_items = (i_val *) beryl_get_raw_array(indices);
+	for(i_size i = 0; i < len; i++)
+		index_items[i] = BERYL_NUMBER(i);
+	
+	struct sort_state state = { .less = pick_less(keys, len, true), .keys = keys };
+	i_val err = sort_array(&state, index_items, len, true);
+	if(BERYL_TYPEOF(err) == TYPE_ERR) {
+		beryl_release(indices);
+		res = err;
+		goto EXIT;
+	}
+	
+	res = beryl_new_array(len, NULL, len, false);
+	if(BERYL_TYPEOF(res) == TYPE_NULL) {
+		beryl_release(indices);
+		res = BERYL_ERR("Out of memory");
+		goto EXIT;
+	}
+	i_val *res_items = (i_val *) beryl_get_raw_array(res);
+	for(i_size i = 0; i < len; i++)
+		res_items[i] = beryl_retain(items[as_index(index_items[i])]);
+	beryl_release(indices);
+	
+	EXIT:
+	beryl_release_values(keys, n_keys);
+	beryl_free(keys);
+	return res;
+}
+
+// Priority queues are binary min-heaps, ordered by the same heap routines that heap sort uses (with the comparison reversed)
+// If the queue has a key function, each item in the heap is an array of (key value), so the key function only runs once per value
+struct priority_queue {
+	struct beryl_object obj;
+	i_val *items;
+	i_size len, cap;
+	i_val key_fn;
+};
+
+static void priority_queue_free(struct beryl_object *obj) {
+	struct priority_queue *pq = (struct priority_queue *) obj;
+	beryl_release_values(pq->items, pq->len);
+	beryl_free(pq->items);
+	beryl_release(pq->key_fn);
+}
+
+static struct beryl_object_class priority_queue_class = {
+	priority_queue_free,
+	NULL,
+	sizeof(struct priority_queue),
+	"priority-queue",
+	sizeof("priority-queue") - 1
+};
+
+static struct priority_queue *as_priority_queue(i_val val) {
+	if(beryl_object_class_type(val) != &priority_queue_class)
+		return NULL;
+	return (struct priority_queue *) beryl_as_object(val);
+}
 
-struct stringf {
-	char *str, *end, *at;
+static i_val pq_item_key(struct priority_queue *pq, i_val item) {
+	if(BERYL_TYPEOF(pq->key_fn) == TYPE_NULL)
+		return item;
+	return beryl_get_raw_array(item)[0];
+}
+
+static i_val pq_item_value(struct priority_queue *pq, i_val item) {
+	if(BERYL_TYPEOF(pq->key_fn) == TYPE_NULL)
+		return item;
+	return beryl_get_raw_array(item)[1];
+}
+
+static bool pq_greater(struct sort_state *state, i_val a, i_val b) { // Reversed, so that the heap has the smallest item at the top
+	return less_generic(state, pq_item_key(state->pq, b), pq_item_key(state->pq, a));
+}
+
+static void sift_up(struct sort_state *state, i_val *array, i_size at) {
+	while(at != 0) {
+		i_size parent = bt_parent(at);
+		if(!state->less(state, array[parent], array[at]))
+			return;
+		swap_vals(&array[parent], &array[at]);
+		at = parent;
+	}
+}
+
+// Deques are growable ring buffers; the value at index i is stored at items[(head + i) % cap]
+struct deque {
+	struct beryl_object obj;
+	i_val *items;
+	i_size head, len, cap;
+};
+
+static void deque_free(struct beryl_object *obj);
+static i_val deque_call(struct beryl_object *obj, const i_val *args, i_size n_args);
+
+static struct beryl_object_class deque_class = {
+	deque_free,
+	deque_call,
+	sizeof(struct deque),
+	"deque",
+	sizeof("deque") - 1
 };
 
-static void init_stringf(struct stringf *f, char *str, size_t len) {
-	f->str = str;
-	f->end = str + len;
-	f->at = str;
+static struct deque *as_deque(i_val val) {
+	if(beryl_object_class_type(val) != &deque_class)
+		return NULL;
+	return (struct deque *) beryl_as_object(val);
+}
+
+static i_val *deque_at(struct deque *d, i_size i) {
+	assert(i < d->len);
+	i_size at = d->head + i;
+	if(at >= d->cap || at < d->head)
+		at -= d->cap;
+	return &d->items[at];
+}
+
+static void deque_free(struct beryl_object *obj) {
+	struct deque *d = (struct deque *) obj;
+	for(i_size i = 0; i < d->len; i++)
+		beryl_release(*deque_at(d, i));
+	beryl_free(d->items);
+}
+
+static i_val deque_call(struct beryl_object *obj, const i_val *args, i_size n_args) {
+	struct deque *d = (struct deque *) obj;
+	if(n_args != 1)
+		return BERYL_ERR("Can only index deque with an index");
+	if(!beryl_is_integer(args[0])) {
+		beryl_blame_arg(args[0]);
+		return BERYL_ERR("Can only index deque with an integer number");
+	}
+	
+	i_float f = beryl_as_num(args[0]);
+	if(f < 0 || f >= d->len)
+		return BERYL_NULL;
+	return beryl_retain(*deque_at(d, (i_size) f));
+}
+
+static bool deque_reserve_one(struct deque *d) {
+	if(d->len < d->cap)
+		return true;
+	
+	i_size new_cap = d->cap * 2 + 4;
+	if(new_cap <= d->cap)
+		return false;
+	i_val *new_items = beryl_alloc(sizeof(i_val) * (size_t) new_cap);
+	if(new_items == NULL)
+		return false;
+	
+	for(i_size i = 0; i < d->len; i++)
+		new_items[i] = *deque_at(d, i);
+	beryl_free(d->items);
+	d->items = new_items;
+	d->head = 0;
+	d->cap = new_cap;
+	return true;
+}
+
+/*@@
+	deque
+	... values
+
+	Variadic function.
+	Creates a new double ended queue containing *values*. Values can be added and removed at both ends in constant time, using
+	push-front, push-back, pop-front and pop-back.
+	Deques can be indexed like arrays, and iterated with foreach-in and for-in.
+	Unlike most values, deques are modified in place; all references to a deque see the same deque.
+	
+	Example:
+		let d = deque 1 2
+		push-front d 0
+		pop-back d
+	Returns 2, and leaves *d* containing (0 1)
+@@*/
+static i_val deque_callback(const i_val *args, i_size n_args) {
+	i_val res = beryl_new_object(&deque_class);
+	if(BERYL_TYPEOF(res) == TYPE_NULL)
+		return BERYL_ERR("Out of memory");
+	
+	struct deque *d = as_deque(res);
+	d->items = NULL;
+	d->head = 0;
+	d->len = 0;
+	d->cap = 0;
+	
+	if(n_args != 0) {
+		d->items = beryl_alloc(sizeof(i_val) * n_args);
+		if(d->items == NULL) {
+			beryl_release(res);
+			return BERYL_ERR("Out of memory");
+		}
+		d->cap = n_args;
+		for(i_size i = 0; i < n_args; i++)
+			d->items[i] = beryl_retain(args[i]);
+		d->len = n_args;
+	}
+	return res;
+}
+
+static struct deque *expect_deque(i_val val) {
+	struct deque *d = as_deque(val);
+	if(d == NULL)
+		beryl_blame_arg(val);
+	return d;
+}
+
+/*@@
+	push-back
+	deque value
+
+	Adds *value* to the end of *deque*.
+@@*/
+static i_val push_back_callback(const i_val *args, i_size n_args) {
+	(void) n_args;
+	struct deque *d = expect_deque(args[0]);
+	if(d == NULL)
+		return BERYL_ERR("Expected deque as first argument for 'push-back', got '%0'");
+	if(!deque_reserve_one(d))
+		return BERYL_ERR("Out of memory");
+	
+	d->len++;
+	*deque_at(d, d->len - 1) = beryl_retain(args[1]);
+	return BERYL_NULL;
+}
+
+/*@@
+	push-front
+	deque value
+
+	Adds *value* to the beginning of *deque*.
+@@*/
+static i_val push_front_callback(const i_val *args, i_size n_args) {
+	(void) n_args;
+	struct deque *d = expect_deque(args[0]);
+	if(d == NULL)
+		return BERYL_ERR("Expected deque as first argument for 'push-front', got '%0'");
+	if(!deque_reserve_one(d))
+		return BERYL_ERR("Out of memory");
+	
+	d->head = d->head == 0 ? d->cap - 1 : d->head - 1;
+	d->len++;
+	*deque_at(d, 0) = beryl_retain(args[1]);
+	return BERYL_NULL;
 }
 
-static void write_char(struct stringf *f, char c) {
-	assert(f->at < f->end);
-	*(f->at++) = c;
+/*@@
+	pop-back
+	deque
+
+	Removes and returns the last value of *deque*.
+	Returns an error if *deque* is empty.
+@@*/
+static i_val pop_back_callback(const i_val *args, i_size n_args) {
+	(void) n_args;
+	struct deque *d = expect_deque(args[0]);
+	if(d == NULL)
+		return BERYL_ERR("Expected deque as argument for 'pop-back', got '%0'");
+	if(d->len == 0)
+		return BERYL_ERR("Cannot pop empty deque");
+	
+	i_val res = *deque_at(d, d->len - 1);
+	d->len--;
+	return res;
 }
 
-static void write_char_at(struct stringf *f, size_t offset, char c) {
-	char *s = f->at + offset;
-	assert(s >= f->str && s < f->end);
-	*s = c;
+/*@@
+	pop-front
+	deque
+
+	Removes and returns the first value of *deque*.
+	Returns an error if *deque* is empty.
+@@*/
+static i_val pop_front_callback(const i_val *args, i_size n_args) {
+	(void) n_args;
+	struct deque *d = expect_deque(args[0]);
+	if(d == NULL)
+		return BERYL_ERR("Expected deque as argument for 'pop-front', got '%0'");
+	if(d->len == 0)
+		return BERYL_ERR("Cannot pop empty deque");
+	
+	i_val res = *deque_at(d, 0);
+	d->head++;
+	if(d->head == d->cap)
+		d->head = 0;
+	d->len--;
+	return res;
 }
 
-static void	move_cursor(struct stringf *f, size_t offset) {
-	f->at += offset;
-	assert(f->at <= f->end);
+// Ranges store their length, rather than their end, so that the value at index i is always exactly from + i * step
+struct range {
+	struct beryl_object obj;
+	i_float from, step;
+	i_size len;
+};
+
+static i_val range_call(struct beryl_object *obj, const i_val *args, i_size n_args);
+
+static struct beryl_object_class range_class = {
+	NULL,
+	range_call,
+	sizeof(struct range),
+	"range",
+	sizeof("range") - 1
+};
+
+static struct range *as_range(i_val val) {
+	if(beryl_object_class_type(val) != &range_class)
+		return NULL;
+	return (struct range *) beryl_as_object(val);
 }
 
+static i_val range_at(struct range *r, i_size i) {
+	assert(i < r->len);
+	return BERYL_NUMBER(r->from + i * r->step);
+}
 
-static i_val num_to_str(i_float num) {
-	bool negative = num < 0;
-	if(negative)
-		num = -num;
+static i_val range_call(struct beryl_object *obj, const i_val *args, i_size n_args) {
+	struct range *r = (struct range *) obj;
+	if(n_args != 1)
+		return BERYL_ERR("Can only index range with an index");
+	if(!beryl_is_integer(args[0])) {
+		beryl_blame_arg(args[0]);
+		return BERYL_ERR("Can only index range with an integer number");
+	}
 	
-	if(num / 10 == num) {
-		if(num == 0)
-			return BERYL_CONST_STR("0");
+	i_float f = beryl_as_num(args[0]);
+	if(f < 0 || f >= r->len)
+		return BERYL_NULL;
+	return range_at(r, (i_size) f);
+}
 
-		if(negative)
-			return BERYL_CONST_STR("-infinity");
-		else
-			return BERYL_CONST_STR("infinity");
+static bool range_length(i_float from, i_float to, i_float step, i_size *len) { // Returns false if the range has more than I_SIZE_MAX items
+	i_float n = (to - from) / step;
+	if(!(n > 0)) {
+		*len = 0;
+		return true;
 	}
-	
-	if(num > LARGE_UINT_TYPE_MAX) {
-		i_float	significand;
-		size_t exp = iflog10(num, &significand);
-		size_t n_sig_digits = 4;
-		size_t n_exp_digits = iilog10(exp) + 1;
+	if(n > I_SIZE_MAX)
+		return false;
+	*len = (i_size) n;
+	if(*len < n)
+		(*len)++;
+	return true;
+}
 
-		size_t n_total = (negative ? 1 : 0) + (n_sig_digits + 2) + 2 + n_exp_digits; // [-]x.(digit * n_sig_digits)e+(digit * n_exp_digits)
-		i_val res = beryl_new_string(n_total, NULL);
-		if(BERYL_TYPEOF(res) == TYPE_NULL)
-			return BERYL_NULL;
+static i_val range_as_array(i_float from, i_float step, i_size len) {
+	i_val res = beryl_new_array(len, NULL, len, false);
+	if(BERYL_TYPEOF(res) == TYPE_NULL)
+		return BERYL_ERR("Out of memory");
+	i_val *items = (i_val *) beryl_get_raw_array(res);
+	for(i_size i = 0; i < len; i++)
+		items[i] = BERYL_NUMBER(from + i * step);
+	return res;
+}
 
-		struct stringf s;
-		init_stringf(&s, (char *) beryl_get_raw_str(&res), n_total);
-		if(negative) {
-			write_char(&s, '-');
-		}
-		
-		write_char(&s, int_as_digit(significand));
-		write_char(&s, '.');
-		for(size_t i = 0; i < n_sig_digits; i++) {
-			significand -= (int) significand;
-			significand *= 10;
-			write_char(&s, int_as_digit(significand));
-		}
-		
-		write_char(&s, 'e');
-		write_char(&s, '+');
-		for(size_t i = n_exp_digits - 1; true; i--) {
-			write_char_at(&s, i, int_as_digit(exp % 10));
-			exp /= 10;
-			if(i == 0)
-				break;
+/*@@
+	range
+	from to ... step
+
+	Variadic function taking two or three arguments.
+	Creates a range of the numbers from *from* until *to* (exclusive), counting by *step*. If no *step* is given, counts up by one, or down by one if *to* < *from*.
+	Ranges behave like read-only arrays of their numbers; they can be indexed, and used with sizeof, foreach-in, for-in, map, filter and iter,
+	but the numbers are computed when needed instead of being stored. arrayof converts a range to an array.
+	
+	Example:
+		let r = range 0 10 2
+		r 3
+	Returns 6
+@@*/
+static i_val range_callback(const i_val *args, i_size n_args) {
+	if(n_args > 3)
+		return BERYL_ERR("'range' takes at most three arguments");
+	for(i_size i = 0; i < n_args; i++) {
+		if(BERYL_TYPEOF(args[i]) != TYPE_NUMBER) {
+			beryl_blame_arg(args[i]);
+			return BERYL_ERR("Expected number as argument for 'range', got '%0'");
 		}
-		return res;
 	}
 	
-	large_uint_type int_v = num;
+	i_float from = beryl_as_num(args[0]), to = beryl_as_num(args[1]);
+	i_float step = n_args == 3 ? beryl_as_num(args[2]) : (to < from ? -1 : 1);
+	if(!(step > 0 || step < 0)) {
+		beryl_blame_arg(args[2]);
+		return BERYL_ERR("Step of 'range' must be a non-zero number");
+	}
 	
-	size_t n_idigits = iilog10(int_v) + 1;
-	size_t n_ddigits = beryl_is_integer(BERYL_NUMBER(num)) ? 0 : 4;
+	i_size len;
+	if(!range_length(from, to, step, &len))
+		return BERYL_ERR("Range is too large");
 	
-	size_t n_total = (negative ? 1 : 0) + n_idigits + n_ddigits;
-	if(n_ddigits != 0)
-		n_total += 1; // The dot '.'
-	i_val res = beryl_new_string(n_total, NULL);
+	i_val res = beryl_new_object(&range_class);
 	if(BERYL_TYPEOF(res) == TYPE_NULL)
-		return BERYL_NULL;
-	
-	struct stringf s;
-	init_stringf(&s, (char *) beryl_get_raw_str(&res), n_total);
-	if(negative)
-		write_char(&s, '-');
-	
-	large_uint_type i_num = int_v;
-	for(size_t i = n_idigits - 1; true; i--) {
-		char digit = int_as_digit(i_num % 10);
-		i_num /= 10;
-		write_char_at(&s, i, digit);
-		if(i == 0)
-			break;
+		return BERYL_ERR("Out of memory");
+	struct range *r = as_range(res);
+	r->from = from;
+	r->step = step;
+	r->len = len;
+	return res;
+}
+
+static bool container_object_size(i_val obj, i_size *size) { // For the objects that sizeof treats like arrays
+	struct priority_queue *pq = as_priority_queue(obj);
+	if(pq != NULL) {
+		*size = pq->len;
+		return true;
 	}
-	move_cursor(&s, n_idigits);
-	
-	if(n_ddigits != 0)
-		write_char(&s, '.');
-	
-	i_float dec_part = num - int_v;
-	for(size_t i = 0; i < n_ddigits; i++) {
-		dec_part *= 10;
-		char digit = int_as_digit(((large_uint_type) dec_part) % 10);
-		write_char_at(&s, i, digit);
+	struct deque *d = as_deque(obj);
+	if(d != NULL) {
+		*size = d->len;
+		return true;
 	}
-	
-	return res;
+	struct range *r = as_range(obj);
+	if(r != NULL) {
+		*size = r->len;
+		return true;
+	}
+	return false;
 }
 
-i_val i_val_as_string(i_val val) {
-	switch(BERYL_TYPEOF(val)) {
-		
-		case TYPE_NUMBER: {
-			i_val res = num_to_str(beryl_as_num(val));
-			if(BERYL_TYPEOF(res) == TYPE_NULL)
-				return BERYL_ERR("Out of memory");
-			return res;
-		}
-		
-		case TYPE_FN:
-		case TYPE_EXT_FN:
-			return BERYL_CONST_STR("Function");
-		case TYPE_ARRAY:
-			return BERYL_CONST_STR("Array"); //TODO: Implement array->string conversion
-		case TYPE_TAG:
-			return BERYL_CONST_STR("Tag");
-		case TYPE_NULL:
-			return BERYL_CONST_STR("Null");
-		case TYPE_STR:
-			return beryl_retain(val);
-		case TYPE_TABLE:
-			return BERYL_CONST_STR("Table");
-		default:
-			return BERYL_CONST_STR("Unkown");
+static bool container_object_get(i_val obj, i_size i, i_val *item) { // Returns false if obj cannot be indexed. The item is borrowed, and i must be less than the size
+	struct deque *d = as_deque(obj);
+	if(d != NULL) {
+		*item = *deque_at(d, i);
+		return true;
+	}
+	struct range *r = as_range(obj);
+	if(r != NULL) {
+		*item = range_at(r, i);
+		return true;
+	}
+	return false;
+}
+
+static bool container_object_indexable(i_val obj, i_size *size) { // Returns true if obj can be iterated like an array, using container_object_get
+	i_val item;
+	return container_object_size(obj, size) && (*size == 0 || container_object_get(obj, 0, &item));
+}
+
+static i_val container_object_as_array(i_val obj) {
+	i_size size;
+	container_object_size(obj, &size);
+	i_val res = beryl_new_array(size, NULL, size, false);
+	if(BERYL_TYPEOF(res) == TYPE_NULL)
+		return BERYL_ERR("Out of memory");
+	
+	i_val *items = (i_val *) beryl_get_raw_array(res);
+	for(i_size i = 0; i < size; i++) {
+		container_object_get(obj, i, &items[i]);
+		beryl_retain(items[i]);
 	}
+	return res;
 }
 
 /*@@
-	as-string
-	val
+	priority-queue
+	... key-fn
 
-	Unary function.
-	Coerces *val* into a string.
+	Creates a new, empty, priority queue. Values are added with pq-push, and pq-pop removes and returns the smallest value in the queue.
+	If *key-fn* is given, values are ordered by the result of calling *key-fn* with them (once, when they are pushed) instead.
+	Unlike most values, priority queues are modified in place; all references to a queue see the same queue.
+	
+	Example:
+		let q = new priority-queue
+		pq-push q 3
+		pq-push q 1
+		pq-pop q
+	Returns 1
 @@*/
-static i_val as_string_callback(const i_val *args, i_size n_args) {
-	(void) n_args;
-
-	return i_val_as_string(args[0]);
+static i_val priority_queue_callback(const i_val *args, i_size n_args) {
+	if(n_args > 1)
+		return BERYL_ERR("Expected at most one argument (a key function) for 'priority-queue'");
+	
+	i_val res = beryl_new_object(&priority_queue_class);
+	if(BERYL_TYPEOF(res) == TYPE_NULL)
+		return BERYL_ERR("Out of memory");
+	
+	struct priority_queue *pq = as_priority_queue(res);
+	pq->items = NULL;
+	pq->len = 0;
+	pq->cap = 0;
+	pq->key_fn = n_args == 1 ? beryl_retain(args[0]) : BERYL_NULL;
+	return res;
 }
 
 /*@@
-	round
-	number
+	pq-push
+	queue value
 
-	Rounds the number to the nearest integer.
-	Rounds away from zero. (0.5 is rounded to 1, -0.5 is rounded to -1)
+	Adds *value* to the priority queue *queue*.
+	Returns an error if *value* (or its key) cannot be compared to the values already in the queue, or if out of memory.
 @@*/
-static i_val round_callback(const i_val *args, i_size n_args) {
+static i_val pq_push_callback(const i_val *args, i_size n_args) {
 	(void) n_args;
-
-	EXPECT_TYPE1(TYPE_NUMBER, "number");
+	struct priority_queue *pq = as_priority_queue(args[0]);
+	if(pq == NULL) {
+		beryl_blame_arg(args[0]);
+		return BERYL_ERR("Expected priority queue as first argument for 'pq-push', got '%0'");
+	}
 	
-	i_float num = beryl_as_num(args[0]);
+	i_val item;
+	if(BERYL_TYPEOF(pq->key_fn) == TYPE_NULL)
+		item = beryl_retain(args[1]);
+	else {
+		i_val key = beryl_call(pq->key_fn, &args[1], 1, true);
+		if(BERYL_TYPEOF(key) == TYPE_ERR)
+			return key;
+		
+		i_val pair[] = { key, args[1] };
+		item = beryl_new_array(2, pair, 2, false);
+		beryl_release(key);
+		if(BERYL_TYPEOF(item) == TYPE_NULL)
+			return BERYL_ERR("Out of memory");
+	}
 	
-	bool negative = num < 0;
-	if(negative)
-		num = -num;
+	// The new item is only compared with the items above the slot it is added at, so checking those first means that a push either succeeds or leaves the queue as it was
+	for(i_size at = pq->len; at != 0;) {
+		at = bt_parent(at);
+		if(beryl_val_cmp(pq_item_key(pq, item), pq_item_key(pq, pq->items[at])) == 2) {
+			beryl_blame_arg(pq_item_value(pq, item));
+			beryl_blame_arg(pq_item_value(pq, pq->items[at]));
+			beryl_release(item);
+			return BERYL_ERR("Cannot compare values '%0' and '%1'");
+		}
+	}
 	
-	if(num > BERYL_NUM_MAX_INT)
-		return beryl_retain(args[0]);
+	if(pq->len == pq->cap) {
+		i_size new_cap = pq->cap * 3 / 2 + 4;
+		i_val *new_items = new_cap <= pq->cap ? NULL : beryl_realloc(pq->items, sizeof(i_val) * (size_t) new_cap);
+		if(new_items == NULL) {
+			beryl_release(item);
+			return BERYL_ERR("Out of memory");
+		}
+		pq->items = new_items;
+		pq->cap = new_cap;
+	}
 	
-	large_uint_type i = (large_uint_type) (num + 0.5);
-	i_float res = i;
-	if(negative)
-		res = -res;
+	pq->items[pq->len++] = item;
 	
-	return BERYL_NUMBER(res);
+	struct sort_state state = { .less = pq_greater, .pq = pq };
+	sift_up(&state, pq->items, pq->len - 1);
+	assert(!state.failed);
+	return BERYL_NULL;
 }
 
 /*@@
-	is-int
-	val
+	pq-peek
+	queue
 
-	Returns true if *val* is an integer number, false otherwise.
+	Returns the smallest value in the priority queue *queue*, without removing it.
+	Returns an error if the queue is empty.
 @@*/
-static i_val is_int_callback(const i_val *args, i_size n_args) {
+static i_val pq_peek_callback(const i_val *args, i_size n_args) {
 	(void) n_args;
-
-	return BERYL_BOOL(beryl_is_integer(args[0]));
+	struct priority_queue *pq = as_priority_queue(args[0]);
+	if(pq == NULL) {
+		beryl_blame_arg(args[0]);
+		return BERYL_ERR("Expected priority queue as argument for 'pq-peek', got '%0'");
+	}
+	if(pq->len == 0)
+		return BERYL_ERR("Cannot peek empty priority queue");
+	
+	return beryl_retain(pq_item_value(pq, pq->items[0]));
 }
 
-static i_val pipe_callback(const i_val *args, i_size n_args) { // DOESN'T USE AUTORELEASE
+/*@@
+	pq-pop
+	queue
+
+	Removes and returns the smallest value in the priority queue *queue*.
+	Returns an error if the queue is empty, or if the remaining values cannot be compared with each other (in which case the queue is left as it was).
+@@*/
+static i_val pq_pop_callback(const i_val *args, i_size n_args) {
 	(void) n_args;
+	struct priority_queue *pq = as_priority_queue(args[0]);
+	if(pq == NULL) {
+		beryl_blame_arg(args[0]);
+		return BERYL_ERR("Expected priority queue as argument for 'pq-pop', got '%0'");
+	}
+	if(pq->len == 0)
+		return BERYL_ERR("Cannot pop empty priority queue");
+	
+	i_val top = pq->items[0];
+	pq->len--;
+	if(pq->len != 0) {
+		pq->items[0] = pq->items[pq->len];
+		struct sort_state state = { .less = pq_greater, .pq = pq };
+		i_size at = make_heap(&state, pq->items, 0, pq->len);
+		if(state.failed) { // The moved item got to at by swapping with its parents, so swapping it back up restores the queue
+			for(; at != 0; at = bt_parent(at))
+				swap_vals(&pq->items[at], &pq->items[bt_parent(at)]);
+			pq->items[pq->len++] = pq->items[0];
+			pq->items[0] = top;
+			return state.err;
+		}
+	}
+	
+	i_val res = beryl_retain(pq_item_value(pq, top));
+	beryl_release(top);
+	return res;
+}
 
-	i_val res = beryl_call(args[1], &args[0], 1, false);
+// Iterators are pulled one item at a time by iter_next. Source iterators walk an array, table, string, container object or numeric range,
+// while iter-map, iter-filter and iter-take create stages that pull from another iterator
+enum iterator_kind {
+	ITER_ARRAY,
+	ITER_TABLE,
+	ITER_STRING,
+	ITER_OBJECT,
+	ITER_RANGE,
+	ITER_MAP,
+	ITER_FILTER,
+	ITER_TAKE
+};
+
+struct iterator {
+	struct beryl_object obj;
+	unsigned char kind;
+	bool done;
+	i_val source; // The iterated value, or the previous stage
+	i_val fn;
+	i_size at; // Position in the source, or the number of remaining items for take
+	struct i_val_pair *table_at;
+	i_float from, step; // Item i of a numeric range is from + i * step, which does not build up rounding errors
+	large_uint_type range_at, range_len;
+};
+
+static void iterator_free(struct beryl_object *obj);
+
+static struct beryl_object_class iterator_class = {
+	iterator_free,
+	NULL,
+	sizeof(struct iterator),
+	"iterator",
+	sizeof("iterator") - 1
+};
+
+static struct iterator *as_iterator(i_val val) {
+	if(beryl_object_class_type(val) != &iterator_class)
+		return NULL;
+	return (struct iterator *) beryl_as_object(val);
+}
+
+static void iterator_free(struct beryl_object *obj) {
+	struct iterator *it = (struct iterator *) obj;
+	beryl_release(it->source);
+	beryl_release(it->fn);
+}
+
+static i_val new_iterator(enum iterator_kind kind, i_val source, i_val fn) { // Takes ownership of source and fn
+	i_val res = beryl_new_object(&iterator_class);
+	if(BERYL_TYPEOF(res) == TYPE_NULL) {
+		beryl_release(source);
+		beryl_release(fn);
+		return BERYL_ERR("Out of memory");
+	}
+	
+	struct iterator *it = as_iterator(res);
+	it->kind = kind;
+	it->done = false;
+	it->source = source;
+	it->fn = fn;
+	it->at = 0;
+	it->table_at = NULL;
+	it->from = it->step = 0;
+	it->range_at = it->range_len = 0;
 	return res;
 }
 
-static i_val error_callback(const i_val *args, i_size n_args) {
-	if(BERYL_TYPEOF(args[0]) != TYPE_STR) {
-		beryl_blame_arg(args[0]);
-		return BERYL_ERR("Expected string error message as argument for 'error', got '%0'");
+static i_val iterate(i_val val) { // Returns a (retained) iterator over val, or an error
+	switch(BERYL_TYPEOF(val)) {
+		case TYPE_ARRAY:
+			return new_iterator(ITER_ARRAY, beryl_retain(val), BERYL_NULL);
+		case TYPE_TABLE:
+			return new_iterator(ITER_TABLE, beryl_retain(val), BERYL_NULL);
+		case TYPE_STR:
+			return new_iterator(ITER_STRING, beryl_retain(val), BERYL_NULL);
+		case TYPE_OBJECT: {
+			if(as_iterator(val) != NULL)
+				return beryl_retain(val);
+			i_size size;
+			if(!container_object_indexable(val, &size))
+				break;
+			return new_iterator(ITER_OBJECT, beryl_retain(val), BERYL_NULL);
+		}
 	}
-	for(i_size i = 1; i < n_args; i++)
-		beryl_blame_arg(args[i]);	
-	return beryl_str_as_err(args[0]);
+	beryl_blame_arg(val);
+	return BERYL_ERR("Cannot iterate over '%0'");
 }
 
-static i_size bt_parent(i_size i) {
-	assert(i != 0);
-	return (i - 1) / 2;
+// Returns true and sets *item to the next item (which the caller owns). Returns false once the iterator is exhausted, 
+// in which case *item is either null or an error
+static bool iter_next(struct iterator *it, i_val *item) {
+	*item = BERYL_NULL;
+	if(it->done)
+		return false;
+	
+	switch(it->kind) {
+		case ITER_ARRAY:
+			if(it->at >= BERYL_LENOF(it->source))
+				break;
+			*item = beryl_retain(beryl_get_raw_array(it->source)[it->at++]);
+			return true;
+		
+		case ITER_STRING:
+			if(it->at >= BERYL_LENOF(it->source))
+				break;
+			*item = beryl_new_string(1, beryl_get_raw_str(&it->source) + it->at++);
+			return true;
+		
+		case ITER_TABLE: {
+			it->table_at = beryl_iter_table(it->source, it->table_at);
+			if(it->table_at == NULL)
+				break;
+			i_val pair[] = { it->table_at->key, it->table_at->val };
+			*item = beryl_new_array(2, pair, 2, false);
+			if(BERYL_TYPEOF(*item) == TYPE_NULL) {
+				*item = BERYL_ERR("Out of memory");
+				return false;
+			}
+			return true;
+		}
+		
+		case ITER_OBJECT: {
+			i_size size;
+			if(!container_object_size(it->source, &size) || it->at >= size || !container_object_get(it->source, it->at, item))
+				break;
+			it->at++;
+			beryl_retain(*item);
+			return true;
+		}
+		
+		case ITER_RANGE:
+			if(it->range_at == it->range_len)
+				break;
+			*item = BERYL_NUMBER(it->from + it->range_at * it->step);
+			it->range_at++;
+			return true;
+		
+		case ITER_MAP: {
+			i_val arg;
+			if(!iter_next(as_iterator(it->source), &arg)) {
+				*item = arg;
+				return false;
+			}
+			*item = beryl_call(beryl_retain(it->fn), &arg, 1, false);
+			return BERYL_TYPEOF(*item) != TYPE_ERR;
+		}
+		
+		case ITER_FILTER:
+			while(iter_next(as_iterator(it->source), item)) {
+				i_val keep = beryl_call(it->fn, item, 1, true);
+				if(BERYL_TYPEOF(keep) == TYPE_ERR) {
+					beryl_release(*item);
+					*item = keep;
+					return false;
+				}
+				if(BERYL_TYPEOF(keep) != TYPE_BOOL) {
+					beryl_release(*item);
+					beryl_blame_arg(keep);
+					beryl_release(keep);
+					*item = BERYL_ERR("Filter function must return boolean, not '%0'");
+					return false;
+				}
+				if(beryl_as_bool(keep))
+					return true;
+				beryl_release(*item);
+			}
+			return false;
+		
+		case ITER_TAKE:
+			if(it->at == 0)
+				break;
+			it->at--;
+			return iter_next(as_iterator(it->source), item);
+	}
+	
+	it->done = true;
+	return false;
+}
+
+/*@@
+	iter
+	value
+	
+	Can also be called as:
+		iter from to
+		iter from to step
+	
+	Creates a lazy iterator over *value*, which may be an array, table, string, deque or another iterator (which is returned as is).
+	Tables are iterated as pairs (arrays of key and value), and strings one character at a time.
+	Given numbers, iterates from *from* until *to* (exclusive), by *step*. If no *step* is given, counts up by one, or down by one if *to* < *from*.
+	Iterators are consumed as they are pulled from, by iter-collect, iter-fold or the stages created by iter-map, iter-filter and iter-take.
+	No intermediate arrays are built, each item passes through all the stages before the next one is pulled.
+	
+	Example:
+		iter-collect (iter-map (iter-filter (iter 0 10) with x do (mod x 2) == 0 end) with x do x * x end)
+	Returns (0 4 16 36 64)
+@@*/
+static i_val iter_callback(const i_val *args, i_size n_args) {
+	if(n_args == 1)
+		return iterate(args[0]);
+	if(n_args > 3)
+		return BERYL_ERR("'iter' takes at most three arguments");
+	
+	for(i_size i = 0; i < n_args; i++) {
+		if(BERYL_TYPEOF(args[i]) != TYPE_NUMBER) {
+			beryl_blame_arg(args[i]);
+			return BERYL_ERR("Expected number for numeric 'iter', got '%0'");
+		}
+	}
+	
+	i_float from = beryl_as_num(args[0]), to = beryl_as_num(args[1]);
+	i_float step = n_args == 3 ? beryl_as_num(args[2]) : (to < from ? -1 : 1);
+	if(!(step > 0 || step < 0)) {
+		beryl_blame_arg(args[2]);
+		return BERYL_ERR("Step of 'iter' must be a non-zero number");
+	}
+	
+	i_val res = new_iterator(ITER_RANGE, BERYL_NULL, BERYL_NULL);
+	if(BERYL_TYPEOF(res) == TYPE_ERR)
+		return res;
+	struct iterator *it = as_iterator(res);
+	it->from = from;
+	it->step = step;
+	
+	// Counted the same way as by range_length, but iterators are not limited to I_SIZE_MAX items
+	i_float n = (to - from) / step;
+	if(!(n > 0))
+		it->range_len = 0;
+	else if(n >= (i_float) LARGE_UINT_TYPE_MAX)
+		it->range_len = LARGE_UINT_TYPE_MAX;
+	else {
+		it->range_len = (large_uint_type) n;
+		if(it->range_len < n)
+			it->range_len++;
+	}
+	return res;
 }
 
-static i_size bt_left_child(i_size i) {
-	return i * 2 + 1;
+static i_val iterator_stage(enum iterator_kind kind, i_val source, i_val fn) {
+	i_val src_it = iterate(source);
+	if(BERYL_TYPEOF(src_it) == TYPE_ERR)
+		return src_it;
+	return new_iterator(kind, src_it, beryl_retain(fn));
 }
 
-static i_size bt_right_child(i_size i) {
-	return i * 2 + 2;
+/*@@
+	iter-map
+	iterable fn
+	
+	Returns a lazy iterator that calls *fn* with each item of *iterable*, and yields the results.
+	*iterable* may be anything accepted by iter.
+@@*/
+static i_val iter_map_callback(const i_val *args, i_size n_args) {
+	(void) n_args;
+	return iterator_stage(ITER_MAP, args[0], args[1]);
 }
 
-static bool is_inside_heap(i_size i, i_size len) {
-	return i < len;
+/*@@
+	iter-filter
+	iterable fn
+	
+	Returns a lazy iterator yielding the items of *iterable* for which *fn* returns true.
+	*iterable* may be anything accepted by iter.
+@@*/
+static i_val iter_filter_callback(const i_val *args, i_size n_args) {
+	(void) n_args;
+	return iterator_stage(ITER_FILTER, args[0], args[1]);
 }
 
-static bool sort_err = false;
-
-static inline int checked_cmp(i_val a, i_val b) {
-	int res = beryl_val_cmp(a, b);
-	if(res == 2 && !sort_err) {
-		sort_err = true;
-		beryl_blame_arg(a);
-		beryl_blame_arg(b);
+/*@@
+	iter-take
+	iterable n
+	
+	Returns a lazy iterator yielding at most the first *n* items of *iterable*. Once *n* items have been taken, *iterable* is not pulled from again,
+	so iter-take can be used to stop early without
+	evaluating the rest of a long pipeline.
+@@*/
+static i_val iter_take_callback(const i_val *args, i_size n_args) {
+	(void) n_args;
+	if(!beryl_is_integer(args[1]) || beryl_as_num(args[1]) < 0) {
+		beryl_blame_arg(args[1]);
+		return BERYL_ERR("Expected non-negative integer as second argument for 'iter-take', got '%0'");
 	}
+	
+	i_float n = beryl_as_num(args[1]);
+	i_val res = iterator_stage(ITER_TAKE, args[0], BERYL_NULL);
+	if(BERYL_TYPEOF(res) == TYPE_ERR)
+		return res;
+	as_iterator(res)->at = n > I_SIZE_MAX ? I_SIZE_MAX : (i_size) n;
 	return res;
 }
 
-static void make_heap(i_val *array, i_size at, i_size len) {
-	START:
-	assert(at < len);
-	
-	i_val top = array[at];
-	i_size left_i = bt_left_child(at);
-	i_size right_i = bt_right_child(at);
-	
-	if(!is_inside_heap(left_i, len)) { //If the index has no children
-		assert(!is_inside_heap(right_i, len));
-		return;
-	}
-	
-	i_val left = array[left_i];
+/*@@
+	iter-collect
+	iterable
 	
-	if(!is_inside_heap(right_i, len)) { //If it only has one child
-		if(checked_cmp(left, top) == -1) { //If the left node is larger
-			array[at] = left;
-			array[left_i] = top;
-			
-			at = left_i;
-			goto START; //Essentially tail recursion
-		} else
-			return; //If it only has one child, and that child is less or equal then nothing needs to be done
+	Pulls every item from *iterable* and returns them as an array.
+@@*/
+static i_val iter_collect_callback(const i_val *args, i_size n_args) {
+	(void) n_args;
+	i_val it_v = iterate(args[0]);
+	if(BERYL_TYPEOF(it_v) == TYPE_ERR)
+		return it_v;
+	struct iterator *it = as_iterator(it_v);
+	
+	struct beryl_array_builder builder;
+	i_size reserve = 0;
+	if(it->kind == ITER_ARRAY || it->kind == ITER_STRING)
+		reserve = BERYL_LENOF(it->source) - it->at;
+	else if(it->kind == ITER_OBJECT && container_object_size(it->source, &reserve))
+		reserve = reserve > it->at ? reserve - it->at : 0;
+	if(!beryl_array_builder_init(&builder, reserve)) {
+		beryl_release(it_v);
+		return BERYL_ERR("Out of memory");
 	}
 	
-	//If it has two children
-	assert(is_inside_heap(right_i, len));
-	i_val right = array[right_i];
-	
-	if(checked_cmp(left, top) == -1) {
-		if(checked_cmp(left, right) == -1) {
-			array[at] = left;
-			array[left_i] = top;
-			
-			at = left_i;
-			goto START;
-		} else {
-			array[at] = right;
-			array[right_i] = top;
-			
-			at = right_i;
-			goto START;
+	i_val item;
+	while(iter_next(it, &item)) {
+		if(!beryl_array_builder_push(&builder, item)) {
+			item = BERYL_ERR("Out of memory");
+			break;
 		}
 	}
+	beryl_release(it_v);
 	
-	if(checked_cmp(right, top) == -1) {
-		if(checked_cmp(right, left) == -1) {
-			array[at] = right;
-			array[right_i] = top;
-			
-			at = right_i;
-			goto START;
-		} else {
-			array[at] = left;
-			array[left_i] = top;
-			
-			at = left_i;
-			goto START;
-		}
+	if(BERYL_TYPEOF(item) == TYPE_ERR) {
+		beryl_array_builder_discard(&builder);
+		return item;
 	}
-	
-	return;
+	i_val res = beryl_array_builder_finish(&builder);
+	if(BERYL_TYPEOF(res) == TYPE_NULL)
+		return BERYL_ERR("Out of memory");
+	return res;
 }
 
-static i_val sort_array(i_val *array, i_size len) { //Returns BERYL_NULL on sucess, an error otherwise
-	for(i_size i = bt_parent(len - 1); true; i--) {
-		make_heap(array, i, len); //Make heap makes a heap at the index i, assuming that all children of i are already heaps
-		if(i == 0)
-			break;
-	}
-	
-	for(i_size heap_len = len; heap_len > 1; heap_len--) {
-		i_val max = array[0];
-		i_size leaf_i = heap_len - 1;
-		
-		array[0] = array[leaf_i]; //Swap the leaf and the top
-		array[leaf_i] = max;
-		
-		//Fix the heap now that we've swapped the leaf and the top, but don't include the former leaf (i.e reduce the len by 1)
-		make_heap(array, 0, heap_len - 1);
-	}
+/*@@
+	iter-fold
+	iterable init fn
 	
-	if(sort_err) { // If an comparison error occured somewhere when sorting
-		sort_err = false;
-		return BERYL_ERR("Cannot compare values '%0' and '%1'");
-	}
+	Pulls every item from *iterable*, and calls *fn* with the accumulated value (starting with *init*) and the item. 
+	The result of each call becomes the new accumulated value, which is returned once *iterable* is exhausted.
 	
-	return BERYL_NULL;
-}
-
-/*@@
-	sort
-	array
-
-	Returns a sorted copy of *array*.
-	May return an error if any of the values inside array are not comparable, or if out of memory. 
+	Example:
+		iter-fold (iter 1 5) 0 with acc x do acc + x end
+	Returns 10
 @@*/
-static i_val sort_callback(const i_val *args, i_size n_args) {
+static i_val iter_fold_callback(const i_val *args, i_size n_args) {
 	(void) n_args;
-
-	if(BERYL_TYPEOF(args[0]) != TYPE_ARRAY) {
-		beryl_blame_arg(args[0]);
-		return BERYL_ERR("Can only sort arrays");
-	}
+	i_val it_v = iterate(args[0]);
+	if(BERYL_TYPEOF(it_v) == TYPE_ERR)
+		return it_v;
+	struct iterator *it = as_iterator(it_v);
 	
-	i_val array_to_sort;
-	i_size len = BERYL_LENOF(args[0]);
-	if(beryl_get_refcount(args[0]) == 1) {
-		array_to_sort = beryl_retain(args[0]);
-	} else {
-		array_to_sort = beryl_new_array(len, beryl_get_raw_array(args[0]), len, false); //Creates a copy of the array
+	i_val acc = beryl_retain(args[1]);
+	i_val item;
+	while(iter_next(it, &item)) {
+		i_val fn_args[] = { acc, item }; // The accumulator is moved into fn, so it can update it in place
+		acc = beryl_call(beryl_retain(args[2]), fn_args, 2, false);
+		if(BERYL_TYPEOF(acc) == TYPE_ERR) {
+			item = acc;
+			break;
+		}
 	}
-	if(BERYL_TYPEOF(array_to_sort) == TYPE_NULL)
-		return BERYL_ERR("Out of memory");
+	beryl_release(it_v);
 	
-	i_val err = sort_array((i_val *) beryl_get_raw_array(array_to_sort), len);
-	if(BERYL_TYPEOF(err) == TYPE_ERR) {
-		beryl_release(array_to_sort);
-		return err;
+	if(BERYL_TYPEOF(item) == TYPE_ERR) {
+		if(BERYL_TYPEOF(acc) != TYPE_ERR)
+			beryl_release(acc);
+		return item;
 	}
-	
-	return array_to_sort;
+	return acc;
 }
 
 static large_uint_type random_from(large_uint_type from) {
@@ -2122,11 +5066,8 @@ static i_val slice_array(i_val array, i_size from, i_size to) {
 		return beryl_retain(array);
 	}
 	
-	i_size len = to - from;
-	assert(from + len <= BERYL_LENOF(array));
-	i_val res = beryl_new_array(len, items + from, len, false);
-	
-	if(BERYL_TYPEOF(res) == TYPE_ERR)
+	i_val res = beryl_array_slice(array, from, to);
+	if(BERYL_TYPEOF(res) == TYPE_NULL)
 		return BERYL_ERR("Out of memory");
 	return res;
 }
@@ -2281,6 +5222,7 @@ static i_val join_callback(const i_val *args, i_size n_args) {
 
 	Returns a copy of *array*, where every element has been replaced by
 	the result of calling *fn* with said element.
+	*array* may also be a range or deque, in which case the result is a new array of the same size.
 	May return an error if out of memory.
 
 	Example:
@@ -2288,7 +5230,35 @@ static i_val join_callback(const i_val *args, i_size n_args) {
 		let b = map a with x do x * 2 end
 	'b' in this case will be the array (2 4 6)
 @@*/
+static i_val map_container_object(const i_val *args, i_size size) {
+	i_val res = beryl_new_array(size, NULL, size, false);
+	if(BERYL_TYPEOF(res) == TYPE_NULL)
+		return BERYL_ERR("Out of memory");
+	i_val *dst = (i_val *) beryl_get_raw_array(res);
+	
+	for(i_size i = 0; i < BERYL_LENOF(res); i++) {
+		i_size now_size;
+		if(!container_object_size(args[0], &now_size) || i >= now_size) { // fn has removed items from the container
+			res.len = i;
+			break;
+		}
+		i_val arg;
+		container_object_get(args[0], i, &arg);
+		
+		i_val mapped = beryl_call(args[1], &arg, 1, true);
+		if(BERYL_TYPEOF(mapped) == TYPE_ERR) {
+			beryl_release(res);
+			return mapped;
+		}
+		dst[i] = mapped;
+	}
+	return res;
+}
+
 static i_val map_callback(const i_val *args, i_size n_args) {
+	i_size size;
+	if(BERYL_TYPEOF(args[0]) == TYPE_OBJECT && container_object_indexable(args[0], &size))
+		return map_container_object(args, size);
 	if(BERYL_TYPEOF(args[0]) != TYPE_ARRAY) {
 		beryl_blame_arg(args[0]);
 		return BERYL_ERR("Can only 'map' arrays");
@@ -2424,89 +5394,34 @@ static i_val split_callback(const i_val *args, i_size n_args) {
 		return BERYL_ERR("String splitter cannot be an empty string");
 	}
 	
-	i_size tmp_buff_cap = 4, tmp_buff_len = 0; //TODO: Implement some generic "beryl_array_builder" type that handles this more conveniently
-	i_val *tmp_buff = beryl_alloc(tmp_buff_cap * sizeof(i_val));
-	if(tmp_buff == NULL)
-		return BERYL_ERR("Out of memory");
-	
-	const char *prev = NULL;
-	for(const char *c = str; c < str_end;) {
-		if(match_str(c, str_end, split_at, split_at_len)) {
-			i_val new_str;
-			if(prev == NULL)
-				new_str = BERYL_CONST_STR("");
-			else
-				new_str = beryl_new_string(c - prev, prev);
-			
-			if(BERYL_TYPEOF(new_str) == TYPE_NULL)
-				goto MEM_ERR;
-			if(tmp_buff_len == tmp_buff_cap) {
-				tmp_buff_cap *= 2;
-				if(tmp_buff_cap <= tmp_buff_len) {
-					beryl_release(new_str);
-					goto MEM_ERR;
-				}
-				
-				i_val *tmp = beryl_realloc(tmp_buff, tmp_buff_cap * sizeof(i_val));
-				if(tmp == NULL) {
-					beryl_release(new_str);
-					goto MEM_ERR;
-				}
-				
-				tmp_buff = tmp;
-			}
-			tmp_buff[tmp_buff_len++] = new_str;
-			
-			prev = NULL;
-			c += split_at_len;
-		} else {
-			if(prev == NULL)
-				prev = c;
-			c++;
-		}
-	}
-	
-	i_val new_str;
-	if(prev == NULL)
-		new_str = BERYL_CONST_STR("");
-	else
-		new_str = beryl_new_string(str_end - prev, prev);
-	
-	if(BERYL_TYPEOF(new_str) == TYPE_NULL)
-		goto MEM_ERR;
+	struct beryl_array_builder builder;
+	beryl_array_builder_init(&builder, 0);
 	
-	if(tmp_buff_len == tmp_buff_cap) {
-		tmp_buff_cap += 1;
-		if(tmp_buff_cap <= tmp_buff_len) {
-			beryl_release(new_str);
+	const char *c = str;
+	const char *at;
+	while( (at = find_str(c, str_end, split_at, split_at_len)) ) {
+		i_val new_str = beryl_new_string(at - c, c);
+		if(BERYL_TYPEOF(new_str) == TYPE_NULL)
 			goto MEM_ERR;
-		}
-			
-		i_val *tmp = beryl_realloc(tmp_buff, tmp_buff_cap * sizeof(i_val));
-		if(tmp == NULL) {
-			beryl_release(new_str);
+		if(!beryl_array_builder_push(&builder, new_str))
 			goto MEM_ERR;
-		}
-
-		tmp_buff = tmp;
+		c = at + split_at_len;
 	}
-	tmp_buff[tmp_buff_len++] = new_str;
 	
-	i_val res_array = beryl_new_array(tmp_buff_len, tmp_buff, tmp_buff_len, false);
+	i_val new_str = beryl_new_string(str_end - c, c);
+	if(BERYL_TYPEOF(new_str) == TYPE_NULL)
+		goto MEM_ERR;
+	if(!beryl_array_builder_push(&builder, new_str))
+		goto MEM_ERR;
 	
-	for(i_size i = 0; i < tmp_buff_len; i++)
-		beryl_release(tmp_buff[i]); //The array retains  all the strings when created.
-	beryl_free(tmp_buff);
-
+	i_val res_array = beryl_array_builder_finish(&builder);
 	if(BERYL_TYPEOF(res_array) == TYPE_NULL)
-		return BERYL_ERR("Out of memory");
+		goto MEM_ERR;
 	
 	return res_array;
 	
 	MEM_ERR:
-	for(i_size i = 0; i < tmp_buff_len; i++)
-		beryl_release(tmp_buff[i]);
-	beryl_free(tmp_buff);
+	beryl_array_builder_discard(&builder);
 	return BERYL_ERR("Out of memory");
 }
 
@@ -2626,12 +5541,12 @@ static i_val join_with_callback(const i_val *args, i_size n_args) {
 	for(i_size i = 0; i < n_items; i++) {
 		i_val item = items[i];
 		i_size len = BERYL_LENOF(item);
-		mcpy(str, beryl_get_raw_str(&item), len);
+		mem_copy(str, beryl_get_raw_str(&item), len);
 		str += len;
 		assert(str <= str_end);
 		
 		if(i != n_items - 1) {
-			mcpy(str, beryl_get_raw_str(&join_str), BERYL_LENOF(join_str));
+			mem_copy(str, beryl_get_raw_str(&join_str), BERYL_LENOF(join_str));
 			str += BERYL_LENOF(join_str);
 			assert(str <= str_end);
 		}
@@ -2679,37 +5594,178 @@ static i_val repeat_callback(const i_val *args, i_size n_args) {
 	const char *src_str = beryl_get_raw_str(&args[0]);
 	
 	char *str = (char *) beryl_get_raw_str(&str_res);
-	const char *str_end = str + total_len;
-	for(i_size i = 0; i < times; i++) {
-		mcpy(str, src_str, len);
-		str += len;
-		assert(str <= str_end);
+	// Copy the string once, and then keep doubling the copied part
+	mem_copy(str, src_str, len);
+	i_size done = len;
+	while(done < total_len) {
+		i_size chunk = done < total_len - done ? done : total_len - done;
+		mem_copy(str + done, str, chunk);
+		done += chunk;
 	}
 	
 	return str_res;
 }
 
+static i_val extreme_value(const i_val *args, i_size n_args, int keep_cmp) { // keep_cmp is -1 to find the largest value, 1 to find the smallest
+	if(n_args == 1 && BERYL_TYPEOF(args[0]) == TYPE_ARRAY) {
+		n_args = BERYL_LENOF(args[0]);
+		args = beryl_get_raw_array(args[0]);
+		if(n_args == 0)
+			return BERYL_ERR("Array is empty");
+	}
+	
+	i_val res = args[0];
+	for(i_size i = 1; i < n_args; i++) {
+		int cmp = beryl_val_cmp(args[i], res);
+		if(cmp == 2) {
+			beryl_blame_arg(res); beryl_blame_arg(args[i]);
+			return BERYL_ERR("Uncomparable values");
+		}
+		if(cmp == keep_cmp)
+			res = args[i];
+	}
+	
+	return beryl_retain(res);
+}
+
 /*@@
 	max
 	... values
 	Variadic function taking at least one argument.
 
-	Returns the largest value among *values*.
-	Returns an error if some values are incomparable.
+	Returns the largest value among *values*. If given a single array, returns the largest element of the array.
+	Returns an error if some values are incomparable, or if the array is empty.
 @@*/
 static i_val max_callback(const i_val *args, i_size n_args) {
-	i_val max = args[0];
-	for(i_size i = 1; i < n_args; i++) {
-		int cmp = beryl_val_cmp(args[i], max);
-		if(cmp == 2) {
-			beryl_blame_arg(max); beryl_blame_arg(args[i]);
-			return BERYL_ERR("Uncomparable values");
+	return extreme_value(args, n_args, -1);
+}
+
+/*@@
+	min
+	... values
+	Variadic function taking at least one argument.
+
+	Returns the smallest value among *values*. If given a single array, returns the smallest element of the array.
+	Returns an error if some values are incomparable, or if the array is empty.
+@@*/
+static i_val min_callback(const i_val *args, i_size n_args) {
+	return extreme_value(args, n_args, 1);
+}
+
+/*@@
+	fold
+	array init fn
+	
+	Trinary function.
+	Calls *fn* with an accumulated value (starting with *init*) and each element of *array* in order, the result of each call 
+	becoming the new accumulated value. Returns the final accumulated value.
+	The accumulated value is moved into *fn* rather than copied, so for instance 'fold xs (new array) push' modifies a single array in place.
+	
+	Example:
+		fold (array 1 2 3) 10 with acc x do acc + x end
+	Returns 16
+@@*/
+static i_val fold_callback(const i_val *args, i_size n_args) {
+	(void) n_args;
+	if(BERYL_TYPEOF(args[0]) != TYPE_ARRAY) {
+		beryl_blame_arg(args[0]);
+		return BERYL_ERR("Expected array as first argument for 'fold', got '%0'");
+	}
+	
+	const i_val *items = beryl_get_raw_array(args[0]);
+	i_val acc = beryl_retain(args[1]);
+	for(i_size i = 0; i < BERYL_LENOF(args[0]); i++) {
+		i_val fn_args[] = { acc, beryl_retain(items[i]) };
+		acc = beryl_call(beryl_retain(args[2]), fn_args, 2, false);
+		if(BERYL_TYPEOF(acc) == TYPE_ERR)
+			break;
+	}
+	return acc;
+}
+
+/*@@
+	scan
+	array init fn
+	
+	Trinary function.
+	Like fold, but returns an array of every accumulated value, that is, the result of each call to *fn*.
+	
+	Example:
+		scan (array 1 2 3) 0 with acc x do acc + x end
+	Returns (1 3 6)
+@@*/
+static i_val scan_callback(const i_val *args, i_size n_args) {
+	(void) n_args;
+	if(BERYL_TYPEOF(args[0]) != TYPE_ARRAY) {
+		beryl_blame_arg(args[0]);
+		return BERYL_ERR("Expected array as first argument for 'scan', got '%0'");
+	}
+	
+	const i_val *items = beryl_get_raw_array(args[0]);
+	i_size len = BERYL_LENOF(args[0]);
+	i_val res = beryl_new_array(len, NULL, len, false);
+	if(BERYL_TYPEOF(res) == TYPE_NULL)
+		return BERYL_ERR("Out of memory");
+	i_val *res_items = (i_val *) beryl_get_raw_array(res);
+	
+	i_val acc = args[1];
+	for(i_size i = 0; i < len; i++) {
+		i_val fn_args[] = { acc, items[i] };
+		acc = beryl_call(args[2], fn_args, 2, true); // Each accumulated value is kept in the result, so it cannot be moved into fn
+		if(BERYL_TYPEOF(acc) == TYPE_ERR) {
+			beryl_release(res);
+			return acc;
+		}
+		res_items[i] = acc;
+	}
+	return res;
+}
+
+static i_val fold_numbers(i_val array, i_float init, bool product) {
+	const i_val *items = beryl_get_raw_array(array);
+	i_size len = BERYL_LENOF(array);
+	i_float res = init;
+	for(i_size i = 0; i < len; i++) {
+		if(BERYL_TYPEOF(items[i]) != TYPE_NUMBER) {
+			beryl_blame_arg(items[i]);
+			return BERYL_ERR("Expected array of numbers, but it contains '%0'");
 		}
-		if(cmp == -1)
-			max = args[i];
+		if(product)
+			res *= beryl_as_num(items[i]);
+		else
+			res += beryl_as_num(items[i]);
+	}
+	return BERYL_NUMBER(res);
+}
+
+/*@@
+	sum
+	array
+	
+	Returns the sum of the numbers in *array*, or 0 if it is empty.
+@@*/
+static i_val sum_callback(const i_val *args, i_size n_args) {
+	(void) n_args;
+	if(BERYL_TYPEOF(args[0]) != TYPE_ARRAY) {
+		beryl_blame_arg(args[0]);
+		return BERYL_ERR("Expected array as argument for 'sum', got '%0'");
 	}
+	return fold_numbers(args[0], 0, false);
+}
+
+/*@@
+	product
+	array
 	
-	return beryl_retain(max);
+	Returns the product of the numbers in *array*, or 1 if it is empty.
+@@*/
+static i_val product_callback(const i_val *args, i_size n_args) {
+	(void) n_args;
+	if(BERYL_TYPEOF(args[0]) != TYPE_ARRAY) {
+		beryl_blame_arg(args[0]);
+		return BERYL_ERR("Expected array as argument for 'product', got '%0'");
+	}
+	return fold_numbers(args[0], 1, true);
 }
 
 /*@@
@@ -2865,7 +5921,7 @@ bool load_core_lib() {
 
 		FN(2, "union", union_callback),
 		
-		FN(-3, "cat", concat_callback),
+		MOVED_ARG_FN(-3, "cat", concat_callback),
 		
 		MANUAL_RELEASE_FN(2, "in?", in_callback),
 		
@@ -2890,6 +5946,7 @@ bool load_core_lib() {
 		FN(2, "beginswith?", beginswith_callback),
 		
 		FN(2, "find-right", find_right_callback),
+		FN(2, "find-all", find_all_callback),
 		FN(2, "endswith?", endswith_callback),
 		
 		FN(3, "substring", substring_callback),
@@ -2897,9 +5954,24 @@ bool load_core_lib() {
 		FN(2, "default", default_callback),
 		
 		FN(3, "str-replace", str_replace_callback),
+		FN(2, "str-replace-all", str_replace_all_callback),
+		FN(2, "regex", regex_callback),
+		FN(1, "regex-compile", regex_compile_callback),
+		FN(2, "regex-find-all", regex_find_all_callback),
+		FN(2, "regex-split", regex_split_callback),
+		FN(3, "regex-replace", regex_replace_callback),
+		FN(1, "utf8-valid?", utf8_valid_callback),
+		FN(1, "utf8-length", utf8_length_callback),
+		FN(3, "utf8-substring", utf8_substring_callback),
+		FN(1, "utf8-chars", utf8_chars_callback),
 		
 		FN(1, "parse-number", parse_number_callback),
 		FN(1, "as-string", as_string_callback),
+		FN(-2, "format", format_callback),
+		
+		FN(-1, "string-builder", string_builder_callback),
+		FN(-2, "sb-append", sb_append_callback),
+		FN(1, "build", build_callback),
 		
 		FN(1, "round", round_callback),
 		FN(1, "is-int", is_int_callback),
@@ -2910,6 +5982,29 @@ bool load_core_lib() {
 		FN(-2, "error", error_callback),
 		
 		FN(1, "sort", sort_callback),
+		FN(1, "sort-stable", sort_stable_callback),
+		FN(2, "sort-with", sort_with_callback),
+		FN(2, "sort-by", sort_by_callback),
+		
+		FN(-1, "priority-queue", priority_queue_callback),
+		FN(2, "pq-push", pq_push_callback),
+		FN(1, "pq-peek", pq_peek_callback),
+		FN(1, "pq-pop", pq_pop_callback),
+		
+		FN(-1, "deque", deque_callback),
+		FN(2, "push-back", push_back_callback),
+		FN(2, "push-front", push_front_callback),
+		FN(1, "pop-back", pop_back_callback),
+		FN(1, "pop-front", pop_front_callback),
+		
+		FN(-3, "range", range_callback),
+		
+		FN(-2, "iter", iter_callback),
+		FN(2, "iter-map", iter_map_callback),
+		FN(2, "iter-filter", iter_filter_callback),
+		FN(2, "iter-take", iter_take_callback),
+		FN(1, "iter-collect", iter_collect_callback),
+		FN(3, "iter-fold", iter_fold_callback),
 		
 		FN(0, "random", random_callback),
 		
@@ -2938,6 +6033,11 @@ bool load_core_lib() {
 		FN(2, "repeat", repeat_callback),
 		
 		FN(-2, "max", max_callback),
+		FN(-2, "min", min_callback),
+		FN(1, "sum", sum_callback),
+		FN(1, "product", product_callback),
+		FN(3, "fold", fold_callback),
+		FN(3, "scan", scan_callback),
 		
 		FN(2, "find-in", find_in_callback),
 		
@@ -4,7 +4,7 @@
 
 typedef struct i_val i_val;
 
-#define FN(arity, name, fn) { arity, true, name, sizeof(name) - 1, fn }
+#define FN(arity, name, fn) { arity, true, name, sizeof(name) - 1, fn, false }
 
 static i_val refcount_callback(const i_val *args, i_size n_args) {
 	(void) n_args;
@@ -21,6 +21,10 @@ static i_val ptrof_callback(const i_val *args, i_size n_args) {
 		case TYPE_ARRAY:
 			ptr = beryl_get_raw_array(args[0]);
 			break;
+		case TYPE_STR:
+			if(BERYL_LENOF(args[0]) > BERYL_INLINE_STR_MAX_LEN) // Inline strings are stored in the value itself
+				ptr = beryl_get_raw_str(&args[0]);
+			break;
 	}
 	
 	return BERYL_NUMBER((unsigned long long) ptr);
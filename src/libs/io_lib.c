@@ -9,7 +9,7 @@
 
 typedef struct i_val i_val;
 
-#define FN(arity, name, fn) { arity, true, name, sizeof(name) - 1, fn }
+#define FN(arity, name, fn) { arity, true, name, sizeof(name) - 1, fn, false }
 
 #ifdef __windows__
 #define PATH_SEPARATOR "\\"
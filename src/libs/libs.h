@@ -6,6 +6,7 @@
 bool load_core_lib();
 struct i_val i_val_as_string(struct i_val val);
 void beryl_core_lib_clear_evals();
+void beryl_core_lib_clear_caches();
 
 bool load_debug_lib();
 
@@ -13,7 +13,6 @@
 	#include <dlfcn.h>
 	#include <unistd.h>
 	#include <sys/wait.h>
-	#include <regex.h>
 	typedef void *dyn_lib;
 	#define DL_IS_NULL(dl) ((dl) == NULL)
 	#define DL_OPEN(path) dlopen(path, RTLD_NOW)
@@ -530,96 +529,7 @@ static i_val get_time_callback(const i_val *args, i_size n_args) {
 	return BERYL_NUMBER(t);
 }
 
-/*@
-	regex
-	expr str
-
-	Binary function.
-	Matches the string *str* against the POSIX regular expression *expr* and returns an array.
-	The first index of the array is the matched string, the rest of the array contains the strings
-	captured as capture groups (if any).
-	Returns an empty array if the expression is not matched.
-	May return an error on out of memory or if the expression is invalid.
-@*/
-static i_val regex_callback(const i_val *args, i_size n_args) {
-	(void) n_args, (void) args;
-	
-	#if defined(__unix__)
-	if(BERYL_TYPEOF(args[0]) != TYPE_STR) {
-		beryl_blame_arg(args[0]);
-		return BERYL_ERR("Expected string (pattern) as first argument for 'regex'");
-	}
-	if(BERYL_TYPEOF(args[1]) != TYPE_STR) {
-		beryl_blame_arg(args[1]);
-		return BERYL_ERR("Expected string as second argument for 'regex'");
-	}
-	
-	size_t plen = BERYL_LENOF(args[0]);
-	size_t mlen = BERYL_LENOF(args[1]);
-	
-	char *buff = beryl_talloc(plen + 1 + mlen + 1);
-	if(buff == NULL)
-		return BERYL_ERR("Out of memory");
-	
-	memcpy(buff, beryl_get_raw_str(&args[0]), plen);
-	buff[plen] = '\0';
-	
-	memcpy(buff + plen + 1, beryl_get_raw_str(&args[1]), mlen);
-	buff[plen + 1 + mlen] = '\0';
-	
-	regex_t reg;
-	if(regcomp(&reg, buff, 0)) {
-		beryl_tfree(buff);
-		beryl_blame_arg(args[0]);
-		return BERYL_ERR("Regex error");
-	}
-	
-	#define MAX_MATCH 16
-	static regmatch_t matches[MAX_MATCH];
-	int res = regexec(&reg, buff + plen + 1, MAX_MATCH, matches, 0);
-	if(res != 0)
-		matches[0] = (regmatch_t) { -1, -1 };
-	
-	regfree(&reg);
-	beryl_tfree(buff);
-	
-	const char *match_str = beryl_get_raw_str(&args[1]);
-	i_val res_array = beryl_new_array(0, NULL, 1, false);
-	if(BERYL_TYPEOF(res_array) == TYPE_ERR)
-		return BERYL_ERR("Out of memory");
-	
-	for(size_t i = 0; i < MAX_MATCH; i++) {
-		if(matches[i].rm_so == -1)
-			break;
-		size_t match_end = matches[0].rm_so + matches[i].rm_eo;
-		i_val str = beryl_new_string(match_end - matches[i].rm_so, match_str + matches[i].rm_so);
-		if(BERYL_TYPEOF(str) == TYPE_ERR) {
-			beryl_release(res_array);
-			return BERYL_ERR("Out of memory");
-		}
-		
-		bool ok = beryl_array_push(&res_array, str);
-		beryl_release(str);
-		if(!ok) {
-			beryl_release(res_array);
-			return BERYL_ERR("Out of memory");
-		}
-	}
-	
-	return res_array;
-	
-	#undef MAX_MATCH
-	
-	beryl_tfree(buff);
-	
-	#else
-	
-	return BERYL_ERR("'regex' is not supported on this platform");
-	
-	#endif
-}
-
-#define FN(arity, name, fn) { arity, true, name, sizeof(name) - 1, fn }
+#define FN(arity, name, fn) { arity, true, name, sizeof(name) - 1, fn, false }
 
 bool load_unix_lib() {
 	static struct beryl_external_fn fns[] = {
@@ -630,8 +540,7 @@ bool load_unix_lib() {
 		FN(1, "rand-hexs", rands_hex),
 		FN(0, "time", time_callback),
 		FN(1, "convert-time", convert_time_callback),
-		FN(1, "get-time", get_time_callback),
-		FN(2, "regex", regex_callback)
+		FN(1, "get-time", get_time_callback)
 	};
 
 	for(size_t i = 0; i < LENOF(fns); i++) {
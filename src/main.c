@@ -7,6 +7,12 @@
 #include "utils.h"
 #include "io.h"
 
+#if defined(__unix__)
+	#include <pthread.h>
+	#include <unistd.h>
+	#define HAS_THREADS
+#endif
+
 static void generic_print_callback(void *f, const char *str, size_t len) {
 	fwrite(str, sizeof(char), len, f); 
 }
@@ -40,12 +46,75 @@ static bool load_beryl_argv(const char **args, int argc) {
 	return ok;
 }
 
+#ifdef HAS_THREADS
+
+#define MAX_THREADS 256
+
+struct parallel_worker {
+	void (*task)(void *, size_t);
+	void *data;
+	size_t n_tasks, n_workers, first_task;
+};
+
+static void *run_parallel_worker(void *worker_p) {
+	struct parallel_worker *worker = worker_p;
+	for(size_t i = worker->first_task; i < worker->n_tasks; i += worker->n_workers)
+		worker->task(worker->data, i);
+	return NULL;
+}
+
+static unsigned n_threads = 1;
+
+static void run_parallel(void (*task)(void *, size_t), void *data, size_t n_tasks) {
+	size_t n_workers = n_tasks < n_threads ? n_tasks : n_threads;
+	
+	static struct parallel_worker workers[MAX_THREADS];
+	static pthread_t threads[MAX_THREADS];
+	static bool started[MAX_THREADS];
+	for(size_t i = 0; i < n_workers; i++) {
+		workers[i] = (struct parallel_worker) { task, data, n_tasks, n_workers, i };
+		started[i] = i != 0 && pthread_create(&threads[i], NULL, run_parallel_worker, &workers[i]) == 0;
+	}
+	
+	for(size_t i = 0; i < n_workers; i++) {
+		if(!started[i]) // The first worker runs on this thread, as does any worker whose thread could not be created
+			run_parallel_worker(&workers[i]);
+	}
+	for(size_t i = 0; i < n_workers; i++) {
+		if(started[i])
+			pthread_join(threads[i], NULL);
+	}
+}
+
+static unsigned get_n_threads() { // BERYL_THREADS sets the number of threads, otherwise there is one per processor
+	const char *threads_env = getenv("BERYL_THREADS");
+	long n = 0;
+	if(threads_env != NULL)
+		n = strtol(threads_env, NULL, 10);
+	#ifdef _SC_NPROCESSORS_ONLN
+	else
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+	#endif
+	
+	if(n < 1)
+		return 1;
+	if(n > MAX_THREADS)
+		return MAX_THREADS;
+	return n;
+}
+
+#endif
+
 #include "libs/libs.h"
 
 int main(int argc, const char **argv) {
 	
 	beryl_set_mem(malloc, free, realloc);
 	beryl_set_io(generic_print_callback, print_i_val_io_callback, stderr);
+	#ifdef HAS_THREADS
+	n_threads = get_n_threads();
+	beryl_set_threads(run_parallel, n_threads);
+	#endif
 	
 	
 	bool ok = beryl_load_included_libs();
@@ -103,6 +172,7 @@ int main(int argc, const char **argv) {
 	
 	beryl_clear();
 	beryl_core_lib_clear_evals();
+	beryl_core_lib_clear_caches();
 	
 	return ret_code;
 }
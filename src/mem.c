@@ -0,0 +1,146 @@
+#include "mem.h"
+
+#if __STDC_HOSTED__ && !defined(NO_LIBC)
+	#define MEM_USE_LIBC
+	#include <string.h>
+#endif
+
+#if !defined(NO_SIMD) && defined(__GNUC__) && defined(__SSE2__)
+	#define MEM_USE_SSE2
+	#include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__) && defined(__BYTE_ORDER__)
+	#define MEM_USE_WORDS
+	// Words may be unaligned, and may alias anything
+	typedef size_t __attribute__((__may_alias__, __aligned__(1))) mem_word;
+	#define WORD_SIZE sizeof(mem_word)
+#endif
+
+#if defined(MEM_USE_WORDS) && !defined(MEM_USE_LIBC)
+static mem_word fill_word(unsigned char byte) {
+	mem_word w = byte;
+	for(size_t i = 1; i < WORD_SIZE; i++)
+		w = (w << 8) | byte;
+	return w;
+}
+#endif
+
+void mem_copy(void *to_ptr, const void *from_ptr, size_t n) {
+#ifdef MEM_USE_LIBC
+	if(n != 0)
+		memcpy(to_ptr, from_ptr, n);
+#else
+	unsigned char *to = to_ptr;
+	const unsigned char *from = from_ptr;
+	
+	#ifdef MEM_USE_SSE2
+	for(; n >= 16; n -= 16, to += 16, from += 16)
+		_mm_storeu_si128((__m128i *) to, _mm_loadu_si128((const __m128i *) from));
+	#endif
+	#ifdef MEM_USE_WORDS
+	for(; n >= WORD_SIZE; n -= WORD_SIZE, to += WORD_SIZE, from += WORD_SIZE)
+		*(mem_word *) to = *(const mem_word *) from;
+	#endif
+	
+	while(n--)
+		*(to++) = *(from++);
+#endif
+}
+
+void mem_fill(void *to_ptr, unsigned char byte, size_t n) {
+#ifdef MEM_USE_LIBC
+	if(n != 0)
+		memset(to_ptr, byte, n);
+#else
+	unsigned char *to = to_ptr;
+	
+	#ifdef MEM_USE_SSE2
+	__m128i fill = _mm_set1_epi8((char) byte);
+	for(; n >= 16; n -= 16, to += 16)
+		_mm_storeu_si128((__m128i *) to, fill);
+	#endif
+	#ifdef MEM_USE_WORDS
+	mem_word w = fill_word(byte);
+	for(; n >= WORD_SIZE; n -= WORD_SIZE, to += WORD_SIZE)
+		*(mem_word *) to = w;
+	#endif
+	
+	while(n--)
+		*(to++) = byte;
+#endif
+}
+
+size_t mem_mismatch(const void *a_ptr, const void *b_ptr, size_t n) {
+	const unsigned char *a = a_ptr;
+	const unsigned char *b = b_ptr;
+	size_t i = 0;
+	
+#ifdef MEM_USE_SSE2
+	for(; n - i >= 16; i += 16) {
+		__m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (a + i)), _mm_loadu_si128((const __m128i *) (b + i)));
+		unsigned mask = ~(unsigned) _mm_movemask_epi8(eq) & 0xFFFF;
+		if(mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+#endif
+#ifdef MEM_USE_WORDS
+	for(; n - i >= WORD_SIZE; i += WORD_SIZE) {
+		mem_word diff = *(const mem_word *) (a + i) ^ *(const mem_word *) (b + i);
+		if(diff != 0) {
+	#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+			return i + __builtin_ctzll(diff) / 8;
+	#else
+			return i + (__builtin_clzll(diff) - (sizeof(unsigned long long) - WORD_SIZE) * 8) / 8;
+	#endif
+		}
+	}
+#endif
+	
+	for(; i < n; i++) {
+		if(a[i] != b[i])
+			return i;
+	}
+	return n;
+}
+
+_Bool mem_equal(const void *a, const void *b, size_t n) {
+#ifdef MEM_USE_LIBC
+	return n == 0 || memcmp(a, b, n) == 0;
+#else
+	return mem_mismatch(a, b, n) == n;
+#endif
+}
+
+size_t mem_find_byte(const void *ptr, unsigned char byte, size_t n) {
+#ifdef MEM_USE_LIBC
+	const unsigned char *found = n == 0 ? NULL : memchr(ptr, byte, n);
+	return found == NULL ? n : (size_t) (found - (const unsigned char *) ptr);
+#else
+	const unsigned char *p = ptr;
+	size_t i = 0;
+	
+	#ifdef MEM_USE_SSE2
+	__m128i pattern = _mm_set1_epi8((char) byte);
+	for(; n - i >= 16; i += 16) {
+		unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + i)), pattern));
+		if(mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+	#elif defined(MEM_USE_WORDS)
+	// A word has a zero byte iff (w - 0x01..01) & ~w & 0x80..80 is non zero; the matching bytes are zero after the xor
+	mem_word ones = fill_word(0x01), highs = fill_word(0x80), pattern = fill_word(byte);
+	for(; n - i >= WORD_SIZE; i += WORD_SIZE) {
+		mem_word w = *(const mem_word *) (p + i) ^ pattern;
+		if(((w - ones) & ~w & highs) != 0)
+			break;
+	}
+	#endif
+	
+	for(; i < n; i++) {
+		if(p[i] == byte)
+			return i;
+	}
+	return n;
+#endif
+}
@@ -0,0 +1,15 @@
+#ifndef MEM_H_INCLUDED
+#define MEM_H_INCLUDED
+
+#include <stddef.h>
+
+// Memory primitives used by the interpreter and the libraries. These use memcpy/memcmp/memset when a C library is available,
+// and otherwise copy/compare a word (or an SSE2 register) at a time, so that freestanding builds (-D NO_LIBC) are not stuck with byte loops.
+
+void mem_copy(void *to, const void *from, size_t n); // The regions may not overlap
+void mem_fill(void *to, unsigned char byte, size_t n);
+_Bool mem_equal(const void *a, const void *b, size_t n);
+size_t mem_mismatch(const void *a, const void *b, size_t n); // Returns the index of the first byte that differs, or n if there is none
+size_t mem_find_byte(const void *ptr, unsigned char byte, size_t n); // Returns the index of the first occurrence of byte, or n if there is none
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef NUM_H_INCLUDED
+#define NUM_H_INCLUDED
+
+#include "beryl.h"
+
+#define NUM_STR_MAX 32 // The longest string num_format can write
+
+// Writes the shortest string that parses back to exactly num (e.g. 0.1, 1e+300, -2.5e-8) to buff, which must hold at least NUM_STR_MAX characters.
+// Returns the length of the string.
+size_t num_format(i_float num, char *buff);
+
+#define NUM_FIXED_PRECISION_MAX 100
+#define NUM_FIXED_STR_MAX(precision) (DBL_MAX_10_EXP + 3 + (precision)) // A sign, up to 309 integer digits and a point, followed by the decimals
+
+// Writes num with exactly precision digits after the point (and no point if precision is 0), correctly rounded, as in 3.14 or -0.50.
+// precision must be at most NUM_FIXED_PRECISION_MAX. Returns the length of the string.
+size_t num_format_fixed(i_float num, unsigned precision, char *buff);
+
+// Parses a number of the form 123.456e-7 from the start of str, rounding correctly to the nearest i_float. There is no sign. If separators is true,
+// the digits may contain ' (as in 1'000'000). Returns the number of characters read, or 0 if str does not start with a digit.
+size_t num_parse(const char *str, size_t len, bool separators, i_float *res);
+
+#endif
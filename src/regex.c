@@ -0,0 +1,1416 @@
+#include "regex.h"
+#include "mem.h"
+
+#include "utils.h"
+
+typedef struct i_val i_val;
+
+#define MAX_REPEAT 1000
+#define MAX_DEPTH 250 // Of nested groups and repetitions; parsing and compiling recurse this deep
+#define MAX_INSTS 100000
+#define MAX_PREFIX 32
+#define DFA_MAX_MEM (1 << 21) // Per DFA; when the states take more than this they are all thrown away, and built again as needed
+
+#define NONE ((unsigned) -1)
+
+static bool grow(void **array, unsigned *cap, unsigned need, size_t item_size) {
+	if(need <= *cap)
+		return true;
+	unsigned new_cap = *cap == 0 ? 16 : *cap;
+	while(new_cap < need)
+		new_cap *= 2;
+	void *new_array = *array == NULL ? beryl_alloc(new_cap * item_size) : beryl_realloc(*array, new_cap * item_size);
+	if(new_array == NULL)
+		return false;
+	*array = new_array;
+	*cap = new_cap;
+	return true;
+}
+
+struct byte_set {
+	unsigned bits[8];
+};
+
+static bool set_has(const struct byte_set *set, unsigned char c) {
+	return (set->bits[c >> 5] >> (c & 31)) & 1;
+}
+
+static void set_add_range(struct byte_set *set, unsigned char from, unsigned char to) {
+	for(unsigned c = from; c <= to; c++)
+		set->bits[c >> 5] |= 1u << (c & 31);
+}
+
+static void set_invert(struct byte_set *set) {
+	for(size_t i = 0; i < LENOF(set->bits); i++)
+		set->bits[i] = ~set->bits[i];
+}
+
+/* Parsing */
+
+enum node_type {
+	NODE_EMPTY,
+	NODE_BYTE,
+	NODE_SET,
+	NODE_CAT,
+	NODE_ALT,
+	NODE_REPEAT,
+	NODE_GROUP,
+	NODE_BOL,
+	NODE_EOL
+};
+
+struct node {
+	unsigned char type;
+	bool greedy;
+	unsigned arg; // The byte, set or group number
+	int min, max; // Of a repeat; max is -1 if there is no limit
+	unsigned child, next; // The first child, and the next sibling
+};
+
+struct parser {
+	const unsigned char *c, *end;
+	
+	struct node *nodes;
+	unsigned n_nodes, nodes_cap;
+	
+	struct byte_set *sets;
+	unsigned n_sets, sets_cap;
+	
+	unsigned n_groups, depth;
+	
+	bool failed;
+	i_val err;
+};
+
+#define PARSE_ERR(p, msg) ((p)->failed ? NONE : ((p)->failed = true, (p)->err = BERYL_ERR(msg), NONE))
+
+static unsigned new_node(struct parser *p, enum node_type type) {
+	if(!grow((void **) &p->nodes, &p->nodes_cap, p->n_nodes + 1, sizeof(struct node)))
+		return PARSE_ERR(p, "Out of memory");
+	p->nodes[p->n_nodes] = (struct node) { .type = type, .greedy = true, .child = NONE, .next = NONE };
+	return p->n_nodes++;
+}
+
+static unsigned new_set_node(struct parser *p, const struct byte_set *set) {
+	if(!grow((void **) &p->sets, &p->sets_cap, p->n_sets + 1, sizeof(struct byte_set)))
+		return PARSE_ERR(p, "Out of memory");
+	unsigned node = new_node(p, NODE_SET);
+	if(node == NONE)
+		return NONE;
+	p->sets[p->n_sets] = *set;
+	p->nodes[node].arg = p->n_sets++;
+	return node;
+}
+
+static unsigned new_byte_node(struct parser *p, unsigned char c) {
+	unsigned node = new_node(p, NODE_BYTE);
+	if(node != NONE)
+		p->nodes[node].arg = c;
+	return node;
+}
+
+static bool is_alpha(unsigned char c) {
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+static bool is_digit(unsigned char c) {
+	return c >= '0' && c <= '9';
+}
+
+static void add_escape_class(struct byte_set *to, unsigned char name) {
+	struct byte_set set = { { 0 } };
+	switch(name | 0x20) {
+		case 'd':
+			set_add_range(&set, '0', '9');
+			break;
+		case 'w':
+			set_add_range(&set, '0', '9');
+			set_add_range(&set, 'a', 'z');
+			set_add_range(&set, 'A', 'Z');
+			set_add_range(&set, '_', '_');
+			break;
+		case 's':
+			set_add_range(&set, '\t', '\r');
+			set_add_range(&set, ' ', ' ');
+			break;
+	}
+	if(name >= 'A' && name <= 'Z')
+		set_invert(&set);
+	for(size_t i = 0; i < LENOF(set.bits); i++)
+		to->bits[i] |= set.bits[i];
+}
+
+#define ESCAPE_CLASS 256
+#define ESCAPE_ERR -1
+
+// Parses what follows a \. Returns the escaped byte, or ESCAPE_CLASS if it was a class such as \d (which is added to class)
+static int parse_escape(struct parser *p, struct byte_set *class) {
+	if(p->c == p->end)
+		return PARSE_ERR(p, "Invalid escape at end of regular expression %0"), ESCAPE_ERR;
+	
+	unsigned char c = *(p->c++);
+	switch(c) {
+		case 'd': case 'D':
+		case 'w': case 'W':
+		case 's': case 'S':
+			add_escape_class(class, c);
+			return ESCAPE_CLASS;
+		
+		case 'n':
+			return '\n';
+		case 't':
+			return '\t';
+		case 'r':
+			return '\r';
+		case 'f':
+			return '\f';
+		case 'v':
+			return '\v';
+		
+		case 'x': {
+			int val = 0;
+			for(int i = 0; i < 2; i++) {
+				unsigned char d = p->c == p->end ? '\0' : *(p->c++);
+				if(is_digit(d))
+					val = val * 16 + (d - '0');
+				else if((d | 0x20) >= 'a' && (d | 0x20) <= 'f')
+					val = val * 16 + ((d | 0x20) - 'a' + 10);
+				else
+					return PARSE_ERR(p, "Invalid \\x escape in regular expression %0, expected two hexadecimal digits"), ESCAPE_ERR;
+			}
+			return val;
+		}
+		
+		default:
+			if(is_alpha(c) || is_digit(c))
+				return PARSE_ERR(p, "Unknown escape in regular expression %0"), ESCAPE_ERR;
+			return c;
+	}
+}
+
+static bool in_posix_class(int class, unsigned char c) {
+	switch(class) {
+		case 0: return is_alpha(c);
+		case 1: return is_digit(c);
+		case 2: return is_alpha(c) || is_digit(c);
+		case 3: return c >= 'A' && c <= 'Z';
+		case 4: return c >= 'a' && c <= 'z';
+		case 5: return c == ' ' || (c >= '\t' && c <= '\r');
+		case 6: return c == ' ' || c == '\t';
+		case 7: return c > ' ' && c < 127 && !is_alpha(c) && !is_digit(c);
+		case 8: return is_digit(c) || ((c | 0x20) >= 'a' && (c | 0x20) <= 'f');
+		case 9: return c < ' ' || c == 127;
+		case 10: return c >= ' ' && c < 127;
+		case 11: return c > ' ' && c < 127;
+	}
+	return false;
+}
+
+// Parses a class such as [:alpha:], from the [
+static bool parse_posix_class(struct parser *p, struct byte_set *set) {
+	static const char *const names[] = { "alpha", "digit", "alnum", "upper", "lower", "space", "blank", "punct", "xdigit", "cntrl", "print", "graph" };
+	
+	const unsigned char *name = p->c + 2, *name_end = name;
+	while(name_end != p->end && is_alpha(*name_end))
+		name_end++;
+	if(p->end - name_end < 2 || name_end[0] != ':' || name_end[1] != ']')
+		return PARSE_ERR(p, "Invalid character class in regular expression %0"), false;
+	
+	for(size_t i = 0; i < LENOF(names); i++) {
+		size_t len = 0;
+		while(names[i][len] != '\0')
+			len++;
+		if(len != (size_t) (name_end - name) || !mem_equal(names[i], name, len))
+			continue;
+		
+		for(unsigned c = 0; c < 256; c++) {
+			if(in_posix_class(i, c))
+				set_add_range(set, c, c);
+		}
+		p->c = name_end + 2;
+		return true;
+	}
+	return PARSE_ERR(p, "Unknown character class in regular expression %0"), false;
+}
+
+// Parses a bracket expression, after the [
+static unsigned parse_bracket(struct parser *p) {
+	struct byte_set set = { { 0 } };
+	bool negate = false;
+	if(p->c != p->end && *p->c == '^') {
+		negate = true;
+		p->c++;
+	}
+	
+	for(bool first = true; ; first = false) {
+		if(p->c == p->end)
+			return PARSE_ERR(p, "Missing ] in regular expression %0");
+		if(*p->c == ']' && !first) {
+			p->c++;
+			break;
+		}
+		
+		int from;
+		if(*p->c == '[' && p->end - p->c >= 2 && p->c[1] == ':') {
+			if(!parse_posix_class(p, &set))
+				return NONE;
+			continue;
+		} else if(*p->c == '\\') {
+			p->c++;
+			from = parse_escape(p, &set);
+			if(from == ESCAPE_ERR)
+				return NONE;
+			if(from == ESCAPE_CLASS)
+				continue;
+		} else
+			from = *(p->c++);
+		
+		int to = from;
+		if(p->end - p->c >= 2 && p->c[0] == '-' && p->c[1] != ']') {
+			p->c++;
+			if(*p->c == '\\') {
+				p->c++;
+				struct byte_set ignored;
+				to = parse_escape(p, &ignored);
+				if(to == ESCAPE_ERR)
+					return NONE;
+			} else if(*p->c == '[' && p->end - p->c >= 2 && p->c[1] == ':')
+				to = ESCAPE_CLASS;
+			else
+				to = *(p->c++);
+			
+			if(to == ESCAPE_CLASS || to < from)
+				return PARSE_ERR(p, "Invalid range in regular expression %0");
+		}
+		set_add_range(&set, from, to);
+	}
+	
+	if(negate)
+		set_invert(&set);
+	return new_set_node(p, &set);
+}
+
+// Parses {n}, {n,} or {n,m}. Returns false, without consuming anything, if the brace does not start a repetition count (it is then just a brace)
+static bool parse_count(struct parser *p, int *min, int *max) {
+	const unsigned char *c = p->c + 1;
+	int vals[2] = { 0, -1 };
+	int n_vals = 0;
+	
+	for(;;) {
+		if(c == p->end || !is_digit(*c)) {
+			if(n_vals == 1 && c != p->end && *c == '}') // {n,}
+				break;
+			return false;
+		}
+		int val = 0;
+		for(; c != p->end && is_digit(*c); c++) {
+			if(val <= MAX_REPEAT)
+				val = val * 10 + (*c - '0');
+		}
+		vals[n_vals++] = val;
+		
+		if(c == p->end)
+			return false;
+		if(*c == '}') {
+			if(n_vals == 1)
+				vals[1] = vals[0];
+			break;
+		}
+		if(*c != ',' || n_vals == 2)
+			return false;
+		c++;
+	}
+	
+	p->c = c + 1;
+	if(vals[0] > MAX_REPEAT || vals[1] > MAX_REPEAT || (vals[1] != -1 && vals[1] < vals[0]))
+		return PARSE_ERR(p, "Invalid repetition count in regular expression %0 (counts must be at most 1000)"), false;
+	*min = vals[0];
+	*max = vals[1];
+	return true;
+}
+
+static unsigned parse_alt(struct parser *p);
+
+static unsigned parse_atom(struct parser *p) {
+	unsigned char c = *(p->c++);
+	switch(c) {
+		case '(': {
+			unsigned group = 0;
+			if(p->end - p->c >= 2 && p->c[0] == '?' && p->c[1] == ':')
+				p->c += 2;
+			else if(p->c != p->end && *p->c == '?')
+				return PARSE_ERR(p, "Unsupported group in regular expression %0");
+			else
+				group = ++p->n_groups;
+			
+			unsigned inner = parse_alt(p);
+			if(inner == NONE)
+				return NONE;
+			if(p->c == p->end)
+				return PARSE_ERR(p, "Missing ) in regular expression %0");
+			p->c++;
+			
+			if(group == 0)
+				return inner;
+			unsigned node = new_node(p, NODE_GROUP);
+			if(node != NONE) {
+				p->nodes[node].arg = group;
+				p->nodes[node].child = inner;
+			}
+			return node;
+		}
+		
+		case '*':
+		case '+':
+		case '?':
+			return PARSE_ERR(p, "Nothing to repeat in regular expression %0");
+		
+		case '.': {
+			struct byte_set all = { { 0 } };
+			set_add_range(&all, 0, 255);
+			return new_set_node(p, &all);
+		}
+		
+		case '^':
+			return new_node(p, NODE_BOL);
+		case '$':
+			return new_node(p, NODE_EOL);
+		
+		case '[':
+			return parse_bracket(p);
+		
+		case '\\': {
+			struct byte_set class = { { 0 } };
+			int escaped = parse_escape(p, &class);
+			if(escaped == ESCAPE_ERR)
+				return NONE;
+			if(escaped == ESCAPE_CLASS)
+				return new_set_node(p, &class);
+			return new_byte_node(p, escaped);
+		}
+		
+		default:
+			return new_byte_node(p, c);
+	}
+}
+
+static unsigned parse_repeat(struct parser *p) {
+	unsigned node = parse_atom(p);
+	unsigned depth = p->depth;
+	
+	while(node != NONE && p->c != p->end) {
+		int min, max;
+		if(*p->c == '*' || *p->c == '+' || *p->c == '?') {
+			min = *p->c == '+' ? 1 : 0;
+			max = *p->c == '?' ? 1 : -1;
+			p->c++;
+		} else if(*p->c != '{' || !parse_count(p, &min, &max)) {
+			if(p->failed)
+				return NONE;
+			break;
+		}
+		
+		bool greedy = true;
+		if(p->c != p->end && *p->c == '?') {
+			greedy = false;
+			p->c++;
+		}
+		if(++p->depth > MAX_DEPTH)
+			return PARSE_ERR(p, "Regular expression %0 is nested too deeply");
+		
+		unsigned repeat = new_node(p, NODE_REPEAT);
+		if(repeat == NONE)
+			return NONE;
+		p->nodes[repeat].min = min;
+		p->nodes[repeat].max = max;
+		p->nodes[repeat].greedy = greedy;
+		p->nodes[repeat].child = node;
+		node = repeat;
+	}
+	
+	p->depth = depth;
+	return node;
+}
+
+static unsigned parse_cat(struct parser *p) {
+	unsigned first = NONE, last = NONE;
+	while(p->c != p->end && *p->c != '|' && *p->c != ')') {
+		unsigned node = parse_repeat(p);
+		if(node == NONE)
+			return NONE;
+		if(first == NONE)
+			first = node;
+		else
+			p->nodes[last].next = node;
+		last = node;
+	}
+	
+	if(first == NONE)
+		return new_node(p, NODE_EMPTY);
+	if(first == last)
+		return first;
+	
+	unsigned cat = new_node(p, NODE_CAT);
+	if(cat != NONE)
+		p->nodes[cat].child = first;
+	return cat;
+}
+
+static unsigned parse_alt(struct parser *p) {
+	if(++p->depth > MAX_DEPTH)
+		return PARSE_ERR(p, "Regular expression %0 is nested too deeply");
+	
+	unsigned first = parse_cat(p);
+	if(first == NONE || p->c == p->end || *p->c != '|') {
+		p->depth--;
+		return first;
+	}
+	
+	unsigned last = first;
+	while(p->c != p->end && *p->c == '|') {
+		p->c++;
+		unsigned node = parse_cat(p);
+		if(node == NONE)
+			return NONE;
+		p->nodes[last].next = node;
+		last = node;
+	}
+	
+	unsigned alt = new_node(p, NODE_ALT);
+	if(alt != NONE)
+		p->nodes[alt].child = first;
+	p->depth--;
+	return alt;
+}
+
+// Appends the bytes that every match of the node starts with to prefix. Returns true if the node always matches exactly those bytes,
+// so that what follows it can add to the prefix
+static bool node_prefix(const struct node *nodes, unsigned n, unsigned char *prefix, size_t *len) {
+	const struct node *node = &nodes[n];
+	switch(node->type) {
+		case NODE_EMPTY:
+			return true;
+		
+		case NODE_BYTE:
+			if(*len == MAX_PREFIX)
+				return false;
+			prefix[(*len)++] = node->arg;
+			return true;
+		
+		case NODE_GROUP:
+			return node_prefix(nodes, node->child, prefix, len);
+		
+		case NODE_CAT:
+			for(unsigned child = node->child; child != NONE; child = nodes[child].next) {
+				if(!node_prefix(nodes, child, prefix, len))
+					return false;
+			}
+			return true;
+		
+		case NODE_REPEAT:
+			if(node->min == 0)
+				return false;
+			return node_prefix(nodes, node->child, prefix, len) && node->max == 1;
+		
+		default:
+			return false;
+	}
+}
+
+/* Compiling */
+
+enum {
+	OP_BYTE, // Matches the byte x
+	OP_SET, // Matches a byte in the set x
+	OP_SPLIT, // Continues at both x and y, preferring x
+	OP_JMP,
+	OP_SAVE, // Stores the position in capture slot x
+	OP_BOL,
+	OP_EOL,
+	OP_MATCH
+};
+
+struct inst {
+	unsigned char op;
+	unsigned x, y;
+};
+
+struct program {
+	struct inst *insts;
+	unsigned n, cap;
+};
+
+struct compiler {
+	const struct node *nodes;
+	struct program *prog;
+	bool reverse; // Compiles the expression backwards, for finding where matches start. Assertions are swapped, and groups are not saved
+	bool too_large, out_of_mem;
+};
+
+static unsigned emit(struct compiler *c, unsigned char op, unsigned x, unsigned y) {
+	if(c->too_large || c->out_of_mem)
+		return NONE;
+	if(c->prog->n == MAX_INSTS) {
+		c->too_large = true;
+		return NONE;
+	}
+	if(!grow((void **) &c->prog->insts, &c->prog->cap, c->prog->n + 1, sizeof(struct inst))) {
+		c->out_of_mem = true;
+		return NONE;
+	}
+	c->prog->insts[c->prog->n] = (struct inst) { op, x, y };
+	return c->prog->n++;
+}
+
+static void compile_node(struct compiler *c, unsigned n);
+
+// In Perl, an iteration of a repetition that matches empty ends it. Following the threads in order of priority, and dropping the ones that reach
+// an instruction that has already been visited, would instead drop the thread for the empty iteration when it comes back to the end of the body.
+// So instructions that don't consume anything may be visited twice (see visit), which lets that thread take the exit of the split after the body,
+// ahead of the threads that leave the loop without trying another iteration. The split only goes back to the start of the body if that has not
+// been visited yet for this position, i.e if the iteration matched something (see loops_back_empty). Loops are the only backward jumps, and
+// x* is compiled as (x+)? so that the split after the body is where the loop goes back from
+static void compile_repeat(struct compiler *c, const struct node *node) {
+	struct inst **insts = &c->prog->insts; // The instructions may move as the program grows
+	
+	int copies = node->max == -1 && node->min > 0 ? node->min - 1 : node->min;
+	for(int i = 0; i < copies; i++)
+		compile_node(c, node->child);
+	
+	if(node->max == -1) {
+		if(node->min > 0) { // L: child; SPLIT L, out
+			unsigned loop = c->prog->n;
+			compile_node(c, node->child);
+			unsigned split = emit(c, OP_SPLIT, loop, loop);
+			if(split == NONE)
+				return;
+			if(node->greedy)
+				(*insts)[split].y = split + 1;
+			else
+				(*insts)[split].x = split + 1;
+		} else { // As (x+)?: SPLIT L, out; L: child; SPLIT L, out
+			unsigned split = emit(c, OP_SPLIT, 0, 0);
+			unsigned loop = c->prog->n;
+			compile_node(c, node->child);
+			unsigned loop_split = emit(c, OP_SPLIT, 0, 0);
+			if(c->too_large || c->out_of_mem)
+				return;
+			(*insts)[split].x = node->greedy ? loop : c->prog->n;
+			(*insts)[split].y = node->greedy ? c->prog->n : loop;
+			(*insts)[loop_split].x = node->greedy ? loop : c->prog->n;
+			(*insts)[loop_split].y = node->greedy ? c->prog->n : loop;
+		}
+		return;
+	}
+	
+	// Each optional copy may be skipped, which skips the copies after it as well. The splits are chained through y until the end is known
+	unsigned chain = NONE;
+	for(int i = node->min; i < node->max; i++) {
+		unsigned split = emit(c, OP_SPLIT, 0, chain);
+		chain = split;
+		compile_node(c, node->child);
+	}
+	if(c->too_large || c->out_of_mem)
+		return;
+	
+	unsigned end = c->prog->n;
+	while(chain != NONE) {
+		unsigned next = (*insts)[chain].y;
+		(*insts)[chain].x = node->greedy ? chain + 1 : end;
+		(*insts)[chain].y = node->greedy ? end : chain + 1;
+		chain = next;
+	}
+}
+
+static void compile_node(struct compiler *c, unsigned n) {
+	if(c->too_large || c->out_of_mem)
+		return;
+	
+	const struct node *node = &c->nodes[n];
+	switch(node->type) {
+		case NODE_EMPTY:
+			break;
+		
+		case NODE_BYTE:
+			emit(c, OP_BYTE, node->arg, 0);
+			break;
+		case NODE_SET:
+			emit(c, OP_SET, node->arg, 0);
+			break;
+		
+		case NODE_BOL:
+			emit(c, c->reverse ? OP_EOL : OP_BOL, 0, 0);
+			break;
+		case NODE_EOL:
+			emit(c, c->reverse ? OP_BOL : OP_EOL, 0, 0);
+			break;
+		
+		case NODE_GROUP:
+			if(!c->reverse)
+				emit(c, OP_SAVE, (node->arg - 1) * 2, 0);
+			compile_node(c, node->child);
+			if(!c->reverse)
+				emit(c, OP_SAVE, (node->arg - 1) * 2 + 1, 0);
+			break;
+		
+		case NODE_REPEAT:
+			compile_repeat(c, node);
+			break;
+		
+		case NODE_CAT: {
+			if(!c->reverse) {
+				for(unsigned child = node->child; child != NONE; child = c->nodes[child].next)
+					compile_node(c, child);
+				break;
+			}
+			
+			unsigned n_children = 0;
+			for(unsigned child = node->child; child != NONE; child = c->nodes[child].next)
+				n_children++;
+			unsigned *children = beryl_alloc(n_children * sizeof(unsigned));
+			if(children == NULL) {
+				c->out_of_mem = true;
+				break;
+			}
+			
+			unsigned i = 0;
+			for(unsigned child = node->child; child != NONE; child = c->nodes[child].next)
+				children[i++] = child;
+			while(i > 0)
+				compile_node(c, children[--i]);
+			beryl_free(children);
+			break;
+		}
+		
+		case NODE_ALT: { // SPLIT L1, L2; L1: a; JMP end; L2: SPLIT L2', L3 ... Ln: z
+			unsigned jumps = NONE; // Chained through x until the end is known
+			for(unsigned child = node->child; child != NONE; child = c->nodes[child].next) {
+				if(c->nodes[child].next == NONE) {
+					compile_node(c, child);
+					break;
+				}
+				
+				unsigned split = emit(c, OP_SPLIT, 0, 0);
+				compile_node(c, child);
+				unsigned jump = emit(c, OP_JMP, jumps, 0);
+				if(c->too_large || c->out_of_mem)
+					return;
+				jumps = jump;
+				c->prog->insts[split].x = split + 1;
+				c->prog->insts[split].y = c->prog->n;
+			}
+			if(c->too_large || c->out_of_mem)
+				return;
+			
+			while(jumps != NONE) {
+				unsigned next = c->prog->insts[jumps].x;
+				c->prog->insts[jumps].x = c->prog->n;
+				jumps = next;
+			}
+			break;
+		}
+	}
+}
+
+/* Lazy DFA */
+
+#define STATE_RESTART 1 // The search is unanchored, and no match has been found yet, so matches may still start after this state
+#define STATE_MATCH 2
+#define STATE_DEAD 4
+
+// A DFA state is the list of NFA instructions that are waiting for the next byte (or for the end of the string), in order of priority
+struct dfa_state {
+	struct dfa_state *next_in_bucket;
+	unsigned hash, n_insts;
+	unsigned char flags;
+	signed char final_match; // Whether the state matches if the end of the input is the end of the string; -1 until known
+	unsigned *insts;
+	struct dfa_state *trans[]; // The next state for each byte class, or null if not built yet
+};
+
+static struct dfa_state dead_state = { .flags = STATE_DEAD }; // The state with no instructions, which can never match
+
+struct dfa {
+	const struct regex *re;
+	const struct program *prog;
+	bool unanchored, longest; // Longest finds the longest match, instead of the leftmost-first one
+	
+	struct dfa_state **buckets;
+	unsigned n_buckets, n_states;
+	size_t mem;
+	unsigned long flushes;
+	
+	struct dfa_state *start[2]; // Not at, and at, a string boundary
+	bool restart_matters; // False if no match can start at a position other than the start of the string
+	
+	// Scratch space for building states
+	unsigned *visited, generation;
+	unsigned *stack;
+	unsigned *list, n_list;
+};
+
+struct pike;
+
+struct regex {
+	struct program forward, reverse;
+	struct byte_set *sets;
+	unsigned n_groups;
+	
+	unsigned char byte_class[256]; // Bytes that every instruction treats the same are in the same class
+	unsigned char class_byte[256]; // A byte from each class
+	unsigned n_classes;
+	
+	unsigned char prefix[MAX_PREFIX]; // Every match starts with these bytes
+	size_t prefix_len;
+	
+	struct dfa forward_dfa, reverse_dfa;
+	struct pike *pike;
+};
+
+static bool inst_matches(const struct regex *re, const struct inst *inst, unsigned char c) {
+	return (inst->op == OP_BYTE && inst->x == c) || (inst->op == OP_SET && set_has(&re->sets[inst->x], c));
+}
+
+// Returns how many times an instruction has been visited in this generation, including this visit, or 0 if it is not to be visited again.
+// The first visit is recorded as the generation, and the second as the generation + 1; instructions that consume a byte or match are only
+// visited once (see compile_repeat)
+static unsigned visit(unsigned *visited, unsigned generation, const struct inst *inst) {
+	if(*visited < generation) {
+		*visited = generation;
+		return 1;
+	}
+	if(*visited == generation && inst->op != OP_BYTE && inst->op != OP_SET && inst->op != OP_MATCH) {
+		*visited = generation + 1;
+		return 2;
+	}
+	return 0;
+}
+
+// Whether the split at pc going to to would start another iteration of a loop after one that matched empty
+static bool loops_back_empty(const unsigned *visited, unsigned generation, unsigned pc, unsigned to) {
+	return to < pc && visited[to] >= generation;
+}
+
+static void dfa_next_generation(struct dfa *d) {
+	d->n_list = 0;
+	d->generation += 2;
+	if(d->generation < 2) {
+		for(unsigned i = 0; i < d->prog->n; i++)
+			d->visited[i] = 0;
+		d->generation = 2;
+	}
+}
+
+// Adds the instructions reachable from pc without consuming a byte to the list, in order of priority. In leftmost-first mode nothing after a match
+// matters, so this returns false once a match is added
+static bool dfa_add(struct dfa *d, unsigned pc, bool at_start, bool at_end) {
+	unsigned n_stack = 0;
+	d->stack[n_stack++] = pc;
+	
+	while(n_stack > 0) {
+		pc = d->stack[--n_stack];
+		const struct inst *inst = &d->prog->insts[pc];
+		unsigned visits = visit(&d->visited[pc], d->generation, inst);
+		if(visits == 0)
+			continue;
+		
+		switch(inst->op) {
+			case OP_JMP:
+				d->stack[n_stack++] = inst->x;
+				break;
+			case OP_SPLIT:
+				if(!loops_back_empty(d->visited, d->generation, pc, inst->y))
+					d->stack[n_stack++] = inst->y;
+				if(!loops_back_empty(d->visited, d->generation, pc, inst->x))
+					d->stack[n_stack++] = inst->x;
+				break;
+			case OP_SAVE:
+				d->stack[n_stack++] = pc + 1;
+				break;
+			case OP_BOL:
+				if(at_start)
+					d->stack[n_stack++] = pc + 1;
+				break;
+			case OP_EOL:
+				if(at_end)
+					d->stack[n_stack++] = pc + 1;
+				else if(visits == 1)
+					d->list[d->n_list++] = pc;
+				break;
+			case OP_MATCH:
+				d->list[d->n_list++] = pc;
+				if(!d->longest)
+					return false;
+				break;
+			default:
+				d->list[d->n_list++] = pc;
+				break;
+		}
+	}
+	return true;
+}
+
+static void dfa_flush(struct dfa *d) {
+	for(unsigned i = 0; i < d->n_buckets; i++) {
+		struct dfa_state *state = d->buckets[i];
+		while(state != NULL) {
+			struct dfa_state *next = state->next_in_bucket;
+			beryl_free(state);
+			state = next;
+		}
+		d->buckets[i] = NULL;
+	}
+	d->n_states = 0;
+	d->mem = d->n_buckets * sizeof(struct dfa_state *);
+	d->start[0] = d->start[1] = NULL;
+	d->flushes++;
+}
+
+static bool dfa_grow_buckets(struct dfa *d) {
+	unsigned n_buckets = d->n_buckets == 0 ? 64 : d->n_buckets * 2;
+	struct dfa_state **buckets = beryl_alloc(n_buckets * sizeof(struct dfa_state *));
+	if(buckets == NULL)
+		return false;
+	for(unsigned i = 0; i < n_buckets; i++)
+		buckets[i] = NULL;
+	
+	for(unsigned i = 0; i < d->n_buckets; i++) {
+		struct dfa_state *state = d->buckets[i];
+		while(state != NULL) {
+			struct dfa_state *next = state->next_in_bucket;
+			state->next_in_bucket = buckets[state->hash & (n_buckets - 1)];
+			buckets[state->hash & (n_buckets - 1)] = state;
+			state = next;
+		}
+	}
+	
+	d->mem += (n_buckets - d->n_buckets) * sizeof(struct dfa_state *);
+	beryl_free(d->buckets);
+	d->buckets = buckets;
+	d->n_buckets = n_buckets;
+	return true;
+}
+
+// Returns the state for the instructions in the list, creating it if it does not exist yet. Returns null if out of memory
+static struct dfa_state *dfa_intern(struct dfa *d, unsigned char flags) {
+	if(d->n_list == 0 && !(flags & STATE_RESTART))
+		return &dead_state;
+	
+	unsigned hash = 2166136261u;
+	for(unsigned i = 0; i < d->n_list; i++) {
+		if(d->prog->insts[d->list[i]].op == OP_MATCH)
+			flags |= STATE_MATCH;
+		hash = (hash ^ d->list[i]) * 16777619u;
+	}
+	hash = (hash ^ flags) * 16777619u;
+	
+	if(d->n_buckets != 0) {
+		for(struct dfa_state *state = d->buckets[hash & (d->n_buckets - 1)]; state != NULL; state = state->next_in_bucket) {
+			if(state->hash == hash && state->flags == flags && state->n_insts == d->n_list && mem_equal(state->insts, d->list, d->n_list * sizeof(unsigned)))
+				return state;
+		}
+	}
+	
+	size_t insts_offset = sizeof(struct dfa_state) + d->re->n_classes * sizeof(struct dfa_state *);
+	size_t size = insts_offset + d->n_list * sizeof(unsigned);
+	
+	// The caller may still be using the last couple of states, so those are never thrown away
+	if(d->mem + size > DFA_MAX_MEM && d->n_states > 2)
+		dfa_flush(d);
+	if(d->n_states >= d->n_buckets && !dfa_grow_buckets(d))
+		return NULL;
+	
+	struct dfa_state *state = beryl_alloc(size);
+	if(state == NULL)
+		return NULL;
+	state->hash = hash;
+	state->flags = flags;
+	state->final_match = -1;
+	state->n_insts = d->n_list;
+	state->insts = (unsigned *) ((unsigned char *) state + insts_offset);
+	mem_copy(state->insts, d->list, d->n_list * sizeof(unsigned));
+	for(unsigned i = 0; i < d->re->n_classes; i++)
+		state->trans[i] = NULL;
+	
+	state->next_in_bucket = d->buckets[hash & (d->n_buckets - 1)];
+	d->buckets[hash & (d->n_buckets - 1)] = state;
+	d->n_states++;
+	d->mem += size;
+	return state;
+}
+
+static struct dfa_state *dfa_start(struct dfa *d, bool at_boundary) {
+	if(d->start[at_boundary] != NULL)
+		return d->start[at_boundary];
+	
+	dfa_next_generation(d);
+	bool restart = d->unanchored && d->restart_matters;
+	if(!dfa_add(d, 0, at_boundary, false))
+		restart = false;
+	
+	struct dfa_state *state = dfa_intern(d, restart ? STATE_RESTART : 0);
+	d->start[at_boundary] = state;
+	return state;
+}
+
+static struct dfa_state *dfa_step(struct dfa *d, const struct dfa_state *state, unsigned char class) {
+	unsigned char c = d->re->class_byte[class];
+	dfa_next_generation(d);
+	
+	bool restart = state->flags & STATE_RESTART;
+	for(unsigned i = 0; i < state->n_insts; i++) {
+		unsigned pc = state->insts[i];
+		if(inst_matches(d->re, &d->prog->insts[pc], c) && !dfa_add(d, pc + 1, false, false)) {
+			restart = false;
+			break;
+		}
+	}
+	if(restart && !dfa_add(d, 0, false, false))
+		restart = false;
+	
+	return dfa_intern(d, restart ? STATE_RESTART : 0);
+}
+
+// Whether the state matches at the end of the input. Assertions for the end of the string are only checked if the input ends where the string does
+static bool dfa_final_match(struct dfa *d, struct dfa_state *state, bool at_string_end, bool at_string_start) {
+	if(state == &dead_state)
+		return false;
+	if(state->flags & STATE_MATCH)
+		return true;
+	if(!at_string_end)
+		return false;
+	if(state->final_match != -1 && !at_string_start)
+		return state->final_match;
+	
+	dfa_next_generation(d);
+	bool match = false;
+	for(unsigned i = 0; i < state->n_insts && !match; i++) {
+		if(d->prog->insts[state->insts[i]].op != OP_EOL)
+			continue;
+		unsigned from = d->n_list;
+		dfa_add(d, state->insts[i] + 1, at_string_start, true);
+		for(unsigned j = from; j < d->n_list; j++) {
+			if(d->prog->insts[d->list[j]].op == OP_MATCH)
+				match = true;
+		}
+	}
+	
+	if(!at_string_start)
+		state->final_match = match;
+	return match;
+}
+
+#define SCAN_OUT_OF_MEMORY ((size_t) -2)
+
+// Builds the transition from state for a byte class that has not been seen in it before
+static struct dfa_state *dfa_next(struct dfa *d, struct dfa_state *state, unsigned char class) {
+	unsigned long flushes = d->flushes;
+	struct dfa_state *next = dfa_step(d, state, class);
+	if(next != NULL && d->flushes == flushes) // Otherwise state has been freed
+		state->trans[class] = next;
+	return next;
+}
+
+// Returns the first position after the prefix can be found, or len
+static size_t find_prefix(const struct regex *re, const unsigned char *str, size_t len, size_t from) {
+	while(len - from >= re->prefix_len) {
+		size_t i = from + mem_find_byte(str + from, re->prefix[0], len - from - re->prefix_len + 1);
+		if(len - i < re->prefix_len)
+			break;
+		if(mem_equal(str + i + 1, re->prefix + 1, re->prefix_len - 1))
+			return i;
+		from = i + 1;
+	}
+	return len;
+}
+
+// Returns where the leftmost match that starts at or after from ends
+static size_t scan_forward(struct regex *re, const unsigned char *str, size_t len, size_t from) {
+	struct dfa *d = &re->forward_dfa;
+	
+	// While the search is in the starting state, no match is under way, so it can skip ahead to where the prefix appears
+	struct dfa_state *skip_from = NULL;
+	if(re->prefix_len != 0) {
+		skip_from = dfa_start(d, false);
+		if(skip_from == NULL)
+			return SCAN_OUT_OF_MEMORY;
+	}
+	struct dfa_state *state = dfa_start(d, from == 0);
+	if(state == NULL)
+		return SCAN_OUT_OF_MEMORY;
+	if(skip_from != NULL && skip_from != d->start[0] && (skip_from = dfa_start(d, false)) == NULL) // Getting the other start state flushed the states
+		return SCAN_OUT_OF_MEMORY;
+	if(state == &dead_state)
+		return REGEX_NO_MATCH;
+	
+	size_t last = state->flags & STATE_MATCH ? from : REGEX_NO_MATCH;
+	size_t i = from;
+	for(; i < len; i++) {
+		if(state == skip_from) {
+			i = find_prefix(re, str, len, i);
+			if(i == len)
+				return last;
+		}
+		
+		struct dfa_state *next = state->trans[re->byte_class[str[i]]];
+		if(next == NULL) {
+			unsigned long flushes = d->flushes;
+			next = dfa_next(d, state, re->byte_class[str[i]]);
+			if(next == NULL)
+				return SCAN_OUT_OF_MEMORY;
+			if(d->flushes != flushes && skip_from != NULL && (skip_from = dfa_start(d, false)) == NULL) // Cannot flush again, there is only one state now
+				return SCAN_OUT_OF_MEMORY;
+		}
+		state = next;
+		
+		if(state->flags & (STATE_MATCH | STATE_DEAD)) {
+			if(state == &dead_state)
+				return last;
+			last = i + 1;
+		}
+	}
+	
+	if(dfa_final_match(d, state, true, i == 0))
+		last = len;
+	return last;
+}
+
+// Returns where the leftmost match that ends at end starts, given that there is one that starts at or after from
+static size_t scan_reverse(struct regex *re, const unsigned char *str, size_t len, size_t from, size_t end) {
+	struct dfa *d = &re->reverse_dfa;
+	struct dfa_state *state = dfa_start(d, end == len);
+	if(state == NULL)
+		return SCAN_OUT_OF_MEMORY;
+	
+	size_t first = state->flags & STATE_MATCH ? end : REGEX_NO_MATCH;
+	size_t i = end;
+	for(; i > from && state != &dead_state; i--) {
+		struct dfa_state *next = state->trans[re->byte_class[str[i - 1]]];
+		if(next == NULL && (next = dfa_next(d, state, re->byte_class[str[i - 1]])) == NULL)
+			return SCAN_OUT_OF_MEMORY;
+		state = next;
+		if(state->flags & STATE_MATCH)
+			first = i - 1;
+	}
+	
+	if(i == from && dfa_final_match(d, state, from == 0, i == len))
+		first = from;
+	return first;
+}
+
+static bool dfa_init(struct dfa *d, const struct regex *re, const struct program *prog, bool forward) {
+	*d = (struct dfa) { .re = re, .prog = prog, .unanchored = forward, .longest = !forward };
+	d->visited = beryl_alloc(prog->n * sizeof(unsigned));
+	d->stack = beryl_alloc((prog->n * 4 + 2) * sizeof(unsigned)); // Two for each visit
+	d->list = beryl_alloc(prog->n * sizeof(unsigned));
+	if(d->visited == NULL || d->stack == NULL || d->list == NULL)
+		return false;
+	for(unsigned i = 0; i < prog->n; i++)
+		d->visited[i] = 0;
+	
+	dfa_next_generation(d);
+	dfa_add(d, 0, false, false);
+	d->restart_matters = d->n_list != 0;
+	return true;
+}
+
+static void dfa_free(struct dfa *d) {
+	if(d->buckets != NULL)
+		dfa_flush(d);
+	beryl_free(d->buckets);
+	beryl_free(d->visited);
+	beryl_free(d->stack);
+	beryl_free(d->list);
+}
+
+/* NFA simulation, for capture groups */
+
+struct pike_list {
+	unsigned *pcs, n;
+	unsigned *visited, generation;
+	size_t *slots; // The capture slots of the thread at each instruction
+};
+
+struct pike_frame {
+	unsigned pc, slot; // Restores the slot to val, if slot is not NONE
+	size_t val;
+};
+
+struct pike {
+	struct pike_list lists[2];
+	struct pike_frame *stack;
+	size_t *slots;
+	unsigned n_slots;
+};
+
+static void pike_clear(struct pike_list *list, unsigned n_insts) {
+	list->n = 0;
+	list->generation += 2; // See visit
+	if(list->generation < 2) {
+		for(unsigned i = 0; i < n_insts; i++)
+			list->visited[i] = 0;
+		list->generation = 2;
+	}
+}
+
+// Adds the threads reachable from pc to the list, in order of priority. slots is restored before returning
+static void pike_add(const struct regex *re, struct pike *pk, struct pike_list *list, unsigned pc, size_t pos, size_t len, size_t *slots) {
+	const struct inst *insts = re->forward.insts;
+	unsigned n_stack = 0;
+	pk->stack[n_stack++] = (struct pike_frame) { pc, NONE, 0 };
+	
+	while(n_stack > 0) {
+		struct pike_frame frame = pk->stack[--n_stack];
+		if(frame.slot != NONE) {
+			slots[frame.slot] = frame.val;
+			continue;
+		}
+		
+		pc = frame.pc;
+		const struct inst *inst = &insts[pc];
+		if(visit(&list->visited[pc], list->generation, inst) == 0)
+			continue;
+		
+		switch(inst->op) {
+			case OP_JMP:
+				pk->stack[n_stack++] = (struct pike_frame) { inst->x, NONE, 0 };
+				break;
+			case OP_SPLIT:
+				if(!loops_back_empty(list->visited, list->generation, pc, inst->y))
+					pk->stack[n_stack++] = (struct pike_frame) { inst->y, NONE, 0 };
+				if(!loops_back_empty(list->visited, list->generation, pc, inst->x))
+					pk->stack[n_stack++] = (struct pike_frame) { inst->x, NONE, 0 };
+				break;
+			case OP_SAVE:
+				pk->stack[n_stack++] = (struct pike_frame) { 0, inst->x, slots[inst->x] };
+				pk->stack[n_stack++] = (struct pike_frame) { pc + 1, NONE, 0 };
+				slots[inst->x] = pos;
+				break;
+			case OP_BOL:
+				if(pos == 0)
+					pk->stack[n_stack++] = (struct pike_frame) { pc + 1, NONE, 0 };
+				break;
+			case OP_EOL:
+				if(pos == len)
+					pk->stack[n_stack++] = (struct pike_frame) { pc + 1, NONE, 0 };
+				break;
+			default:
+				list->pcs[list->n++] = pc;
+				mem_copy(list->slots + (size_t) pc * pk->n_slots, slots, pk->n_slots * sizeof(size_t));
+				break;
+		}
+	}
+}
+
+static struct pike *pike_new(const struct regex *re) {
+	unsigned n = re->forward.n, n_slots = re->n_groups * 2;
+	struct pike *pk = beryl_alloc(sizeof(struct pike));
+	if(pk == NULL)
+		return NULL;
+	*pk = (struct pike) { .n_slots = n_slots };
+	
+	bool ok = true;
+	for(int i = 0; i < 2; i++) {
+		struct pike_list *list = &pk->lists[i];
+		list->pcs = beryl_alloc(n * sizeof(unsigned));
+		list->visited = beryl_alloc(n * sizeof(unsigned));
+		list->slots = beryl_alloc((size_t) n * n_slots * sizeof(size_t));
+		if(list->pcs == NULL || list->visited == NULL || list->slots == NULL)
+			ok = false;
+		else {
+			for(unsigned j = 0; j < n; j++)
+				list->visited[j] = 0;
+		}
+	}
+	pk->stack = beryl_alloc((n * 4 + 2) * sizeof(struct pike_frame)); // Two for each visit
+	pk->slots = beryl_alloc(n_slots * sizeof(size_t));
+	if(pk->stack == NULL || pk->slots == NULL)
+		ok = false;
+	
+	if(!ok) {
+		for(int i = 0; i < 2; i++) {
+			beryl_free(pk->lists[i].pcs);
+			beryl_free(pk->lists[i].visited);
+			beryl_free(pk->lists[i].slots);
+		}
+		beryl_free(pk->stack);
+		beryl_free(pk->slots);
+		beryl_free(pk);
+		return NULL;
+	}
+	return pk;
+}
+
+// Finds the capture groups of the leftmost-first match that starts at start, which is known to end at end
+static bool pike_run(struct regex *re, const unsigned char *str, size_t len, size_t start, size_t end, size_t *groups, size_t n_slots) {
+	if(re->pike == NULL && (re->pike = pike_new(re)) == NULL)
+		return false;
+	struct pike *pk = re->pike;
+	
+	struct pike_list *current = &pk->lists[0], *next = &pk->lists[1];
+	for(unsigned i = 0; i < pk->n_slots; i++)
+		pk->slots[i] = REGEX_NO_MATCH;
+	pike_clear(current, re->forward.n);
+	pike_add(re, pk, current, 0, start, len, pk->slots);
+	
+	for(size_t pos = start; current->n != 0; pos++) {
+		pike_clear(next, re->forward.n);
+		for(unsigned i = 0; i < current->n; i++) {
+			unsigned pc = current->pcs[i];
+			const struct inst *inst = &re->forward.insts[pc];
+			size_t *slots = current->slots + (size_t) pc * pk->n_slots;
+			
+			if(inst->op == OP_MATCH) { // Threads after this one have lower priority
+				if(pos == end)
+					mem_copy(groups, slots, n_slots * sizeof(size_t));
+				break;
+			}
+			if(pos < end && inst_matches(re, inst, str[pos])) {
+				mem_copy(pk->slots, slots, pk->n_slots * sizeof(size_t));
+				pike_add(re, pk, next, pc + 1, pos + 1, len, pk->slots);
+			}
+		}
+		if(pos == end)
+			break;
+		
+		struct pike_list *tmp = current;
+		current = next;
+		next = tmp;
+	}
+	return true;
+}
+
+static void pike_free(struct pike *pk) {
+	if(pk == NULL)
+		return;
+	for(int i = 0; i < 2; i++) {
+		beryl_free(pk->lists[i].pcs);
+		beryl_free(pk->lists[i].visited);
+		beryl_free(pk->lists[i].slots);
+	}
+	beryl_free(pk->stack);
+	beryl_free(pk->slots);
+	beryl_free(pk);
+}
+
+/* Interface */
+
+static void compute_byte_classes(struct regex *re) {
+	bool boundary[257] = { false }; // Whether bytes i - 1 and i may be treated differently
+	for(unsigned i = 0; i < re->forward.n; i++) {
+		const struct inst *inst = &re->forward.insts[i];
+		if(inst->op == OP_BYTE)
+			boundary[inst->x] = boundary[inst->x + 1] = true;
+		else if(inst->op == OP_SET) {
+			for(unsigned c = 1; c < 256; c++) {
+				if(set_has(&re->sets[inst->x], c) != set_has(&re->sets[inst->x], c - 1))
+					boundary[c] = true;
+			}
+		}
+	}
+	
+	unsigned class = 0;
+	re->class_byte[0] = 0;
+	for(unsigned c = 0; c < 256; c++) {
+		if(c != 0 && boundary[c])
+			re->class_byte[++class] = c;
+		re->byte_class[c] = class;
+	}
+	re->n_classes = class + 1;
+}
+
+struct regex *regex_compile(const char *pattern, size_t len, i_val *err) {
+	struct parser p = { .c = (const unsigned char *) pattern, .end = (const unsigned char *) pattern + len };
+	unsigned root = parse_alt(&p);
+	if(!p.failed && p.c != p.end)
+		PARSE_ERR(&p, "Unmatched ) in regular expression %0");
+	
+	struct regex *re = NULL;
+	if(p.failed) {
+		*err = p.err;
+		goto FAIL;
+	}
+	
+	re = beryl_alloc(sizeof(struct regex));
+	if(re == NULL) {
+		*err = BERYL_ERR("Out of memory");
+		goto FAIL;
+	}
+	*re = (struct regex) { .sets = p.sets, .n_groups = p.n_groups };
+	p.sets = NULL;
+	
+	struct compiler forward = { p.nodes, &re->forward, false, false, false };
+	compile_node(&forward, root);
+	emit(&forward, OP_MATCH, 0, 0);
+	struct compiler reverse = { p.nodes, &re->reverse, true, false, false };
+	compile_node(&reverse, root);
+	emit(&reverse, OP_MATCH, 0, 0);
+	
+	if(forward.too_large || reverse.too_large) {
+		*err = BERYL_ERR("Regular expression %0 is too large");
+		goto FAIL;
+	}
+	if(forward.out_of_mem || reverse.out_of_mem) {
+		*err = BERYL_ERR("Out of memory");
+		goto FAIL;
+	}
+	
+	compute_byte_classes(re);
+	node_prefix(p.nodes, root, re->prefix, &re->prefix_len);
+	
+	if(!dfa_init(&re->forward_dfa, re, &re->forward, true) || !dfa_init(&re->reverse_dfa, re, &re->reverse, false)) {
+		*err = BERYL_ERR("Out of memory");
+		goto FAIL;
+	}
+	
+	beryl_free(p.nodes);
+	return re;
+	
+	FAIL:
+	beryl_free(p.nodes);
+	beryl_free(p.sets);
+	if(re != NULL)
+		regex_free(re);
+	return NULL;
+}
+
+void regex_free(struct regex *re) {
+	dfa_free(&re->forward_dfa);
+	dfa_free(&re->reverse_dfa);
+	pike_free(re->pike);
+	beryl_free(re->forward.insts);
+	beryl_free(re->reverse.insts);
+	beryl_free(re->sets);
+	beryl_free(re);
+}
+
+size_t regex_n_groups(const struct regex *re) {
+	return re->n_groups;
+}
+
+int regex_search(struct regex *re, const char *str_chars, size_t len, size_t from, size_t *groups, size_t n_groups) {
+	const unsigned char *str = (const unsigned char *) str_chars;
+	if(from > len)
+		return 0;
+	
+	size_t end = scan_forward(re, str, len, from);
+	if(end == SCAN_OUT_OF_MEMORY)
+		return -1;
+	if(end == REGEX_NO_MATCH)
+		return 0;
+	
+	size_t start = scan_reverse(re, str, len, from, end);
+	if(start == SCAN_OUT_OF_MEMORY)
+		return -1;
+	assert(start != REGEX_NO_MATCH);
+	
+	groups[0] = start;
+	groups[1] = end;
+	for(size_t i = 2; i < n_groups * 2; i++)
+		groups[i] = REGEX_NO_MATCH;
+	
+	size_t n_slots = n_groups - 1 < re->n_groups ? (n_groups - 1) * 2 : re->n_groups * 2;
+	if(n_slots != 0 && !pike_run(re, str, len, start, end, groups + 2, n_slots))
+		return -1;
+	return 1;
+}
@@ -0,0 +1,40 @@
+#ifndef REGEX_H_INCLUDED
+#define REGEX_H_INCLUDED
+
+#include "beryl.h"
+
+// A regular expression engine that takes time linear in the length of the searched string (times the size of the expression) for every expression,
+// and behaves the same on every platform. A search runs a lazily built DFA forwards to find where the leftmost match ends, skipping ahead with a
+// literal prefix of the expression when there is one, and then backwards from there to find where it starts. Capture groups are filled in by
+// simulating the NFA over just the match. Alternatives and repetitions are leftmost-first (as in Perl), the matched text is bytes.
+// As in Perl, an iteration of a repetition that matches empty ends the repetition. One difference remains: when a repetition that can match empty
+// is inside another one that can, the groups inside them may keep what they captured in an earlier iteration (for (((a){0,2})+)+ on "a",
+// group 1 is "a" where Perl gives "").
+//
+// Syntax:
+//	.           Any byte
+//	[abc] [^a-z] Any byte in (or not in) the set, which may contain ranges, escapes and classes such as [:alpha:]
+//	\d \w \s    Digits, word characters ([0-9A-Za-z_]) and whitespace; \D \W \S are the opposite
+//	\n \t \r \f \v \xHH, and \ followed by punctuation, for that character
+//	^ $         The start and end of the string
+//	(x) (?:x)   Capturing and non-capturing groups
+//	x|y         x, or else y
+//	x* x+ x?    Zero or more, one or more, zero or one; followed by ? they match as few times as possible
+//	x{n} x{n,} x{n,m}  Between n and m repetitions (at most 1000)
+
+struct regex;
+
+#define REGEX_NO_MATCH ((size_t) -1)
+
+// Returns null and stores an error in *err if the pattern is invalid, or if out of memory. The error message refers to the pattern as %0
+struct regex *regex_compile(const char *pattern, size_t len, struct i_val *err);
+void regex_free(struct regex *re);
+
+size_t regex_n_groups(const struct regex *re); // Capture groups, not counting the whole match
+
+// Finds the leftmost match in str that starts at or after from. Stores the start and end of the match in groups[0] and groups[1], followed by the
+// start and end of the first n_groups - 1 capture groups (REGEX_NO_MATCH for groups that did not take part in the match), and returns 1.
+// Returns 0 if there is no match, and -1 if out of memory.
+int regex_search(struct regex *re, const char *str, size_t len, size_t from, size_t *groups, size_t n_groups);
+
+#endif
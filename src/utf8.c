@@ -0,0 +1,156 @@
+#include "utf8.h"
+
+#if !defined(NO_SIMD) && defined(__GNUC__) && defined(__SSE2__)
+	#define UTF8_USE_SSE2
+	#include <emmintrin.h>
+#elif defined(__GNUC__)
+	#define UTF8_USE_WORDS
+	// Words may be unaligned, and may alias anything
+	typedef unsigned long long __attribute__((__may_alias__, __aligned__(1))) utf8_word;
+	#define UTF8_WORD_SIZE sizeof(utf8_word)
+	#define UTF8_WORD_HIGHS 0x8080808080808080ull
+#endif
+
+#define IS_CONTINUATION(c) (((c) & 0xC0) == 0x80)
+
+// Returns the length of the valid multibyte sequence at the start of str, or 0 if there is none (see table 3-7 of the Unicode standard)
+static size_t valid_sequence(const unsigned char *str, size_t len) {
+	unsigned char lead = str[0];
+	unsigned char lo = 0x80, hi = 0xBF; // The range of the second byte
+	size_t seq_len;
+	
+	if(lead >= 0xC2 && lead <= 0xDF)
+		seq_len = 2;
+	else if(lead >= 0xE0 && lead <= 0xEF) {
+		seq_len = 3;
+		if(lead == 0xE0)
+			lo = 0xA0; // Overlong
+		else if(lead == 0xED)
+			hi = 0x9F; // Surrogates
+	} else if(lead >= 0xF0 && lead <= 0xF4) {
+		seq_len = 4;
+		if(lead == 0xF0)
+			lo = 0x90; // Overlong
+		else if(lead == 0xF4)
+			hi = 0x8F; // Above U+10FFFF
+	} else
+		return 0;
+	
+	if(len < seq_len || str[1] < lo || str[1] > hi)
+		return 0;
+	for(size_t i = 2; i < seq_len; i++) {
+		if(!IS_CONTINUATION(str[i]))
+			return 0;
+	}
+	return seq_len;
+}
+
+size_t utf8_validate(const char *str_ptr, size_t len) {
+	const unsigned char *str = (const unsigned char *) str_ptr;
+	size_t i = 0;
+	
+	while(i < len) {
+#ifdef UTF8_USE_SSE2
+		if(len - i >= 16) {
+			unsigned mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) (str + i)));
+			if(mask == 0) {
+				i += 16;
+				continue;
+			}
+			i += __builtin_ctz(mask);
+		}
+#elif defined(UTF8_USE_WORDS)
+		if(len - i >= UTF8_WORD_SIZE && (*(const utf8_word *) (str + i) & UTF8_WORD_HIGHS) == 0) {
+			i += UTF8_WORD_SIZE;
+			continue;
+		}
+#endif
+		if(str[i] < 0x80) {
+			i++;
+			continue;
+		}
+		
+		size_t seq_len = valid_sequence(str + i, len - i);
+		if(seq_len == 0)
+			return i;
+		i += seq_len;
+	}
+	return len;
+}
+
+size_t utf8_count(const char *str_ptr, size_t len) {
+	const unsigned char *str = (const unsigned char *) str_ptr;
+	size_t i = 0, n = 0;
+
+#ifdef UTF8_USE_SSE2
+	// Bytes above 0xBF (as signed bytes) start a codepoint; each block of up to 255 registers is summed bytewise before being added up
+	__m128i zero = _mm_setzero_si128();
+	__m128i last_continuation = _mm_set1_epi8((char) 0xBF);
+	while(len - i >= 16) {
+		size_t blocks = (len - i) / 16;
+		if(blocks > 255)
+			blocks = 255;
+		
+		__m128i counts = zero;
+		for(size_t b = 0; b < blocks; b++, i += 16) {
+			__m128i bytes = _mm_loadu_si128((const __m128i *) (str + i));
+			counts = _mm_sub_epi8(counts, _mm_cmpgt_epi8(bytes, last_continuation));
+		}
+		__m128i sums = _mm_sad_epu8(counts, zero);
+		n += (size_t) _mm_cvtsi128_si32(sums) + (size_t) _mm_extract_epi16(sums, 4);
+	}
+#elif defined(UTF8_USE_WORDS)
+	// A byte is a continuation byte iff its high bit is set and the one below it is not
+	for(; len - i >= UTF8_WORD_SIZE; i += UTF8_WORD_SIZE) {
+		utf8_word w = *(const utf8_word *) (str + i);
+		n += UTF8_WORD_SIZE - __builtin_popcountll(w & ~(w << 1) & UTF8_WORD_HIGHS);
+	}
+#endif
+
+	for(; i < len; i++)
+		n += !IS_CONTINUATION(str[i]);
+	return n;
+}
+
+size_t utf8_advance(const char *str_ptr, size_t len, size_t n) {
+	const unsigned char *str = (const unsigned char *) str_ptr;
+	size_t i = 0;
+
+#ifdef UTF8_USE_SSE2
+	__m128i last_continuation = _mm_set1_epi8((char) 0xBF);
+	for(; len - i >= 16; i += 16) {
+		__m128i bytes = _mm_loadu_si128((const __m128i *) (str + i));
+		size_t starts = __builtin_popcount(_mm_movemask_epi8(_mm_cmpgt_epi8(bytes, last_continuation)));
+		if(starts > n)
+			break;
+		n -= starts;
+	}
+#elif defined(UTF8_USE_WORDS)
+	for(; len - i >= UTF8_WORD_SIZE; i += UTF8_WORD_SIZE) {
+		utf8_word w = *(const utf8_word *) (str + i);
+		size_t starts = UTF8_WORD_SIZE - __builtin_popcountll(w & ~(w << 1) & UTF8_WORD_HIGHS);
+		if(starts > n)
+			break;
+		n -= starts;
+	}
+#endif
+
+	for(; i < len; i++) {
+		if(!IS_CONTINUATION(str[i])) {
+			if(n == 0)
+				return i;
+			n--;
+		}
+	}
+	return n == 0 ? len : UTF8_OUT_OF_RANGE;
+}
+
+size_t utf8_char_len(unsigned char lead) {
+	if(lead < 0xC0)
+		return 1;
+	if(lead < 0xE0)
+		return 2;
+	if(lead < 0xF0)
+		return 3;
+	return 4;
+}
@@ -0,0 +1,18 @@
+#ifndef UTF8_H_INCLUDED
+#define UTF8_H_INCLUDED
+
+#include <stddef.h>
+
+// UTF-8 primitives used by the libraries. Runs of ASCII are skipped an SSE2 register (or a word) at a time, and codepoints are counted
+// by counting the bytes that are not continuation bytes (10xxxxxx), which does not need to decode anything.
+
+#define UTF8_OUT_OF_RANGE ((size_t) -1)
+
+size_t utf8_validate(const char *str, size_t len); // Returns the index of the first byte of the first invalid sequence, or len if str is valid UTF-8
+
+// These expect valid UTF-8
+size_t utf8_count(const char *str, size_t len); // The number of codepoints in str
+size_t utf8_advance(const char *str, size_t len, size_t n); // The byte offset of codepoint n (len if n is the number of codepoints), or UTF8_OUT_OF_RANGE
+size_t utf8_char_len(unsigned char lead); // The length of the sequence starting with the byte lead
+
+#endif